@@ -7,7 +7,9 @@
  * password "default_password".
  * Ping to client is enabled by default.
  * It also sets up the necessary callbacks to handle incoming WebSocket messages and 
- * implements an echo functionality.
+ * implements an echo functionality. forwardMessage() sends each message back from
+ * the buffer it was received in, so echoing costs no copy or allocation; pass
+ * another session's handle to relay it instead.
  */
 extern "C" void app_main(void) {
     WSLightServer &server = WSLightServer::getInstance();
@@ -16,17 +18,11 @@ extern "C" void app_main(void) {
     server.start("default_ssid", "default_password", 8080, 25000, 60000, true, []()
                  { ESP_LOGW("WSLightServer", "Test extra config"); });
 
-    // Set the callback for text messages
-    server.onTextMessage([&server](int client_sock, const std::string &message) {
-        ESP_LOGI("EchoServer", "Received text message: %s", message.c_str());
-        server.sendTextMessage(message);
-    });
-
-    // Set the callback for binary messages
-    server.onBinaryMessage([&server](int client_sock, const std::vector<uint8_t> &message) {
-        ESP_LOGI("EchoServer", "Received binary message");
-        esp_log_buffer_hex("Received WS binary", message.data(), message.size());
-        server.sendBinaryMessage(message.data(), message.size());
+    // Echo text and binary messages straight from the receive buffer, without copying them
+    server.onConnectionMessage([&server](ws_conn_handle_t handle, void *, const ws_message_view_t &message) {
+        ESP_LOGI("EchoServer", "Received %s message of %zu bytes",
+                 message.type == HTTPD_WS_TYPE_TEXT ? "text" : "binary", message.length);
+        server.forwardMessage(message, handle);
     });
 
     // Set the callback for when a client connects
@@ -1,5 +1,9 @@
 #include "ws_light_server.h"
 #include "mbedtls/base64.h"
+#include <atomic>
+
+static TaskHandle_t nepe_task = nullptr;  /**< Producer woken by onDrain and connection changes */
+static std::atomic<int> connected_clients{0};
 
 /**
  * @brief Task that performs intensive mathematical calculations.
@@ -72,7 +76,9 @@ void compressionTask(void *pvp)
 /**
  * @brief Task that sends WebSocket messages.
  *
- * This task sends text and binary messages through a WebSocket server in an infinite loop.
+ * This task sends text and binary messages through a WebSocket server as fast as the
+ * slowest client takes them: once its queue passes the low watermark the task sleeps
+ * until onDrain wakes it.
  *
  * @param pvp Task parameter (not used).
  */
@@ -82,12 +88,15 @@ void nepe(void *pvp)
 
     for (;;)
     {
-        vTaskDelay(pdMS_TO_TICKS(5));
+        if (connected_clients == 0 || server.bufferedAmount() > ws_server_config_t().tx_low_watermark)
+        {
+            // The timeout only guards against a wakeup lost to a client leaving.
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(1000));
+            continue;
+        }
         server.sendTextMessage("Hola desde el socket");
-        vTaskDelay(pdMS_TO_TICKS(5));
         uint8_t pene[] = {0x01, 0x02, 0x03};
         server.sendBinaryMessage(pene, sizeof(pene));
-        vTaskDelay(pdMS_TO_TICKS(5));
     }
 }
 
@@ -133,15 +142,26 @@ extern "C" void app_main(void)
                           { ESP_LOGI("WSLightServer", "Client %d closed connection", client_sock); });
 
     server.onClientConnected([](int client_sock)
-                             { ESP_LOGI("WSLightServer", "Client connected: %d", client_sock); });
+                             {
+                                 ESP_LOGI("WSLightServer", "Client connected: %d", client_sock);
+                                 connected_clients++;
+                                 xTaskNotifyGive(nepe_task); });
 
     server.onClientDisconnected([](int client_sock)
-                                { ESP_LOGI("WSLightServer", "Client disconnected: %d", client_sock); });
+                                {
+                                    ESP_LOGI("WSLightServer", "Client disconnected: %d", client_sock);
+                                    connected_clients--;
+                                    xTaskNotifyGive(nepe_task); });
+
+    server.onDrain([](int client_sock)
+                   { xTaskNotifyGive(nepe_task); });
+
+    // Created first: the callbacks above notify it.
+    xTaskCreate(&nepe, "nepe", 4096, nullptr, tskIDLE_PRIORITY, &nepe_task);
 
     server.start("default_ssid", "default_password", 8080, 8000, 60000, false, []()
                  { ESP_LOGW("WSLightServer", "Test extra config"); });
 
-    xTaskCreate(&nepe, "nepe", 4096, nullptr, tskIDLE_PRIORITY, nullptr);
     xTaskCreate(&mathTask, "mathTask", 6048, nullptr, tskIDLE_PRIORITY, nullptr);
     xTaskCreate(&arrayTask, "arrayTask", 10024, nullptr, tskIDLE_PRIORITY, nullptr);
     xTaskCreate(&compressionTask, "compressionTask", 6048, nullptr, tskIDLE_PRIORITY, nullptr);
@@ -0,0 +1,32 @@
+
+#include "ws_light_server.h"
+
+/**
+ * This function runs the WebSocket server inside the application's own loop.
+ * With WS_RUN_POLLED, start() creates no task: every accept, read, callback,
+ * write and ping happens inside poll(), so the 10 KB server task stack is not
+ * allocated. The loop below echoes text messages and leaves room for the
+ * application's own work between calls.
+ */
+extern "C" void app_main(void) {
+    WSLightServer &server = WSLightServer::getInstance();
+
+    ws_server_config_t config;
+    config.port = 8080;
+    config.run_mode = WS_RUN_POLLED;
+
+    // Callbacks run inside poll(), on this task
+    server.onTextMessage([&server](int client_sock, const std::string &message) {
+        server.sendTextMessage(client_sock, message);
+    });
+
+    if (server.start(config) != ESP_OK) {
+        ESP_LOGE("PolledExample", "Server failed to start");
+        return;
+    }
+
+    while (true) {
+        // Wait up to 20 ms for clients, then do the application's own work
+        server.poll(20);
+    }
+}
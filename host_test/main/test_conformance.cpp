@@ -0,0 +1,242 @@
+/**
+ * @file test_conformance.cpp
+ * @brief RFC 6455 framing tests run against the server over loopback.
+ *
+ * @author Daniel Giménez
+ * @date 2024-08-05
+ * @license MIT License
+ */
+
+#include <string>
+#include <vector>
+#include "unity.h"
+#include "test_server.h"
+#include "ws_test_client.h"
+
+static std::vector<uint8_t> pattern(size_t length)
+{
+    std::vector<uint8_t> data(length);
+    for (size_t i = 0; i < length; ++i)
+    {
+        data[i] = static_cast<uint8_t>(i * 31 + (i >> 8));
+    }
+    return data;
+}
+
+static std::vector<uint8_t> close_payload(uint16_t code, const std::string &reason = "")
+{
+    std::vector<uint8_t> payload = {static_cast<uint8_t>(code >> 8), static_cast<uint8_t>(code & 0xFF)};
+    payload.insert(payload.end(), reason.begin(), reason.end());
+    return payload;
+}
+
+/**
+ * @brief Read frames until the server's close frame and return its status code.
+ * @return The close code, 0 if the close frame had none, -1 if none arrived.
+ */
+static int read_close_code(WSTestClient &client)
+{
+    ws_test_frame_t frame;
+    while (client.read_frame(frame))
+    {
+        if (frame.opcode == 0x8)
+        {
+            return frame.payload.size() >= 2 ? (frame.payload[0] << 8) | frame.payload[1] : 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Send @p bytes and expect the server to close with @p code and drop the connection.
+ */
+static void expect_close(const std::vector<uint8_t> &bytes, int code)
+{
+    WSTestClient client;
+    TEST_ASSERT_TRUE(client.connect());
+    TEST_ASSERT_TRUE(client.send_raw(bytes));
+    TEST_ASSERT_EQUAL(code, read_close_code(client));
+    TEST_ASSERT_TRUE(client.send_raw(WSTestClient::frame(0x8, close_payload(code))));
+    TEST_ASSERT_TRUE(client.wait_closed());
+}
+
+TEST_CASE("payload lengths use the 7-bit, 16-bit and 64-bit encodings", "[conformance]")
+{
+    ws_server_config_t config = ws_test_config();
+    config.rx_buffer_size = 72 * 1024;
+    config.tx_fragment_size = 128 * 1024;
+    ws_test_start_echo(config);
+
+    WSTestClient client;
+    TEST_ASSERT_TRUE(client.connect());
+    const size_t lengths[] = {0, 1, 125, 126, 127, 65535, 65536, 70000};
+    for (size_t length : lengths)
+    {
+        std::vector<uint8_t> payload = pattern(length);
+        TEST_ASSERT_TRUE(client.send_raw(WSTestClient::frame(0x2, payload)));
+        ws_test_frame_t frame;
+        TEST_ASSERT_TRUE(client.read_frame(frame, 5000));
+        TEST_ASSERT_TRUE(frame.fin);
+        TEST_ASSERT_EQUAL(0x2, frame.opcode);
+        TEST_ASSERT_EQUAL(length <= 125 ? 2 : length <= 65535 ? 4 : 10, frame.header_len);
+        TEST_ASSERT_EQUAL(length, frame.payload.size());
+        TEST_ASSERT_TRUE(frame.payload == payload);
+    }
+    client.close();
+    ws_test_stop();
+}
+
+TEST_CASE("control frames interleaved with fragments are answered in order", "[conformance]")
+{
+    ws_test_start_echo(ws_test_config());
+
+    WSTestClient client;
+    TEST_ASSERT_TRUE(client.connect());
+    std::vector<uint8_t> bytes = WSTestClient::frame(0x1, "Hel", false);
+    std::vector<uint8_t> next = WSTestClient::frame(0x9, "p");
+    bytes.insert(bytes.end(), next.begin(), next.end());
+    next = WSTestClient::frame(0x0, "lo ", false);
+    bytes.insert(bytes.end(), next.begin(), next.end());
+    next = WSTestClient::frame(0x9, "q");
+    bytes.insert(bytes.end(), next.begin(), next.end());
+    next = WSTestClient::frame(0x0, "world", true);
+    bytes.insert(bytes.end(), next.begin(), next.end());
+    TEST_ASSERT_TRUE(client.send_raw(bytes));
+
+    uint8_t opcode;
+    std::vector<uint8_t> payload;
+    TEST_ASSERT_TRUE(client.read_message(opcode, payload));
+    TEST_ASSERT_EQUAL(0xA, opcode);
+    TEST_ASSERT_EQUAL_STRING("p", std::string(payload.begin(), payload.end()).c_str());
+    TEST_ASSERT_TRUE(client.read_message(opcode, payload));
+    TEST_ASSERT_EQUAL(0xA, opcode);
+    TEST_ASSERT_EQUAL_STRING("q", std::string(payload.begin(), payload.end()).c_str());
+    TEST_ASSERT_TRUE(client.read_message(opcode, payload));
+    TEST_ASSERT_EQUAL(0x1, opcode);
+    TEST_ASSERT_EQUAL_STRING("Hello world", std::string(payload.begin(), payload.end()).c_str());
+    client.close();
+    ws_test_stop();
+}
+
+TEST_CASE("fragmented binary messages are reassembled across the buffer limit", "[conformance]")
+{
+    ws_server_config_t config = ws_test_config();
+    config.rx_message_max = 16 * 1024;
+    ws_test_start_echo(config);
+
+    WSTestClient client;
+    TEST_ASSERT_TRUE(client.connect());
+    std::vector<uint8_t> data = pattern(3000);
+    for (size_t offset = 0; offset < data.size(); offset += 1000)
+    {
+        std::vector<uint8_t> part(data.begin() + offset, data.begin() + offset + 1000);
+        TEST_ASSERT_TRUE(client.send_raw(WSTestClient::frame(offset == 0 ? 0x2 : 0x0, part, offset + 1000 == data.size())));
+    }
+    uint8_t opcode;
+    std::vector<uint8_t> payload;
+    TEST_ASSERT_TRUE(client.read_message(opcode, payload));
+    TEST_ASSERT_EQUAL(0x2, opcode);
+    TEST_ASSERT_TRUE(payload == data);
+    client.close();
+    ws_test_stop();
+}
+
+TEST_CASE("binary frames larger than the receive buffer go to a supplied buffer", "[conformance]")
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    ws_server_config_t config = ws_test_config();
+    ws_test_start_echo(config);
+
+    std::vector<uint8_t> sink;
+    size_t received = 0;
+    esp_err_t result = ESP_FAIL;
+    server.onBinaryBuffer([&sink](int, size_t length)
+                          { sink.assign(length, 0); return sink.data(); },
+                          [&received, &result](int, uint8_t *, size_t length, esp_err_t status)
+                          { received = length; result = status; });
+
+    WSTestClient client;
+    TEST_ASSERT_TRUE(client.connect());
+    std::vector<uint8_t> data = pattern(20000);
+    TEST_ASSERT_TRUE(client.send_raw(WSTestClient::frame(0x2, data)));
+    TEST_ASSERT_TRUE(client.send_raw(WSTestClient::frame(0x1, "done")));
+    uint8_t opcode;
+    std::vector<uint8_t> payload;
+    TEST_ASSERT_TRUE(client.read_message(opcode, payload));
+    TEST_ASSERT_EQUAL(0x1, opcode);
+    TEST_ASSERT_EQUAL(ESP_OK, result);
+    TEST_ASSERT_EQUAL(data.size(), received);
+    TEST_ASSERT_TRUE(sink == data);
+    client.close();
+    ws_test_stop();
+}
+
+TEST_CASE("frames split into single bytes and frames sent back to back", "[conformance]")
+{
+    ws_test_start_echo(ws_test_config());
+
+    WSTestClient client;
+    TEST_ASSERT_TRUE(client.connect());
+    TEST_ASSERT_TRUE(client.send_slowly(WSTestClient::frame(0x1, "one byte at a time"), 1, 1));
+    uint8_t opcode;
+    std::vector<uint8_t> payload;
+    TEST_ASSERT_TRUE(client.read_message(opcode, payload));
+    TEST_ASSERT_EQUAL_STRING("one byte at a time", std::string(payload.begin(), payload.end()).c_str());
+
+    std::vector<uint8_t> burst;
+    for (int i = 0; i < 200; ++i)
+    {
+        std::vector<uint8_t> next = WSTestClient::frame(0x1, std::to_string(i));
+        burst.insert(burst.end(), next.begin(), next.end());
+    }
+    TEST_ASSERT_TRUE(client.send_raw(burst));
+    for (int i = 0; i < 200; ++i)
+    {
+        TEST_ASSERT_TRUE(client.read_message(opcode, payload));
+        TEST_ASSERT_EQUAL_STRING(std::to_string(i).c_str(), std::string(payload.begin(), payload.end()).c_str());
+    }
+    client.close();
+    ws_test_stop();
+}
+
+TEST_CASE("close handshake echoes the code and validates the payload", "[conformance]")
+{
+    ws_test_start_echo(ws_test_config());
+
+    WSTestClient client;
+    TEST_ASSERT_TRUE(client.connect());
+    TEST_ASSERT_TRUE(client.send_raw(WSTestClient::frame(0x8, close_payload(1000, "bye"))));
+    TEST_ASSERT_EQUAL(1000, read_close_code(client));
+    TEST_ASSERT_TRUE(client.wait_closed());
+    client.close();
+
+    expect_close(WSTestClient::frame(0x8, close_payload(999)), 1002);
+    expect_close(WSTestClient::frame(0x8, close_payload(1000, "\xC3\x28")), 1007);
+    expect_close(WSTestClient::frame(0x8, std::vector<uint8_t>{0x03}), 1002);
+    ws_test_stop();
+}
+
+TEST_CASE("protocol violations close the connection with the matching code", "[conformance]")
+{
+    ws_test_start_echo(ws_test_config());
+
+    expect_close(WSTestClient::frame(0x1, pattern(4), true, false), 1002);
+
+    std::vector<uint8_t> reserved = WSTestClient::frame(0x1, "rsv");
+    reserved[0] |= 0x40;
+    expect_close(reserved, 1002);
+
+    expect_close(WSTestClient::frame(0x0, "orphan"), 1002);
+
+    std::vector<uint8_t> interrupted = WSTestClient::frame(0x1, "first", false);
+    std::vector<uint8_t> next = WSTestClient::frame(0x1, "second");
+    interrupted.insert(interrupted.end(), next.begin(), next.end());
+    expect_close(interrupted, 1002);
+
+    expect_close(WSTestClient::frame(0x9, pattern(126)), 1002);
+    expect_close(WSTestClient::frame(0x9, "ping", false), 1002);
+    expect_close(WSTestClient::frame(0x3, "reserved"), 1002);
+    expect_close(WSTestClient::frame(0x1, "\xFF\xFE"), 1007);
+    expect_close(WSTestClient::frame(0x2, pattern(MAX_MESSAGE_SIZE + 1)), 1009);
+    ws_test_stop();
+}
@@ -0,0 +1,264 @@
+/**
+ * @file test_digest.cpp
+ * @brief rx_digest checksums against reference vectors, and their cost fused into the
+ *        unmasking pass against a second pass over the received message.
+ *
+ * @author Daniel Giménez
+ * @date 2024-08-05
+ * @license MIT License
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <esp_rom_crc.h>
+#include <mbedtls/sha256.h>
+#include "esp_timer.h"
+#include "unity.h"
+#include "test_server.h"
+#include "ws_test_client.h"
+
+/** CRC-32 and SHA-256 of a payload, from the published test vectors. */
+typedef struct {
+    std::string payload;
+    uint32_t crc32;
+    const char *sha256;
+} digest_vector_t;
+
+static const digest_vector_t CHECK_VECTOR = {"123456789", 0xCBF43926,
+                                             "15e2b0d3c33891ebb0f1ef609ec419420c20e320ce94c65fbc8c3312448eb225"};
+static const digest_vector_t PREFIX_VECTOR = {"1234", 0x9BE3E0A3,
+                                              "03ac674216f3e15c761ee1a5e255f067953623c8b388b4459e13f978d7c846f4"};
+static const digest_vector_t ABC_VECTOR = {"abc", 0x352441C2,
+                                           "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"};
+static const digest_vector_t MILLION_A_VECTOR = {std::string(1000000, 'a'), 0xDC25BFBC,
+                                                 "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"};
+
+static const double MAX_FUSED_OVER_SEPARATE = 1.2; /**< Fused upload time over the time with a second pass, at most, with room for noise */
+
+/**
+ * @brief Check a digest read in a callback against a vector.
+ * @param flags rx_digest of the server; checksums it does not select must read as zero.
+ */
+static void expect_digest(const ws_message_digest_t &digest, const digest_vector_t &vector, uint8_t flags, bool complete)
+{
+    uint8_t sha256[32] = {};
+    if (flags & WS_DIGEST_SHA256)
+    {
+        for (size_t i = 0; i < sizeof(sha256); ++i)
+        {
+            sha256[i] = static_cast<uint8_t>(std::stoul(std::string(vector.sha256 + 2 * i, 2), nullptr, 16));
+        }
+    }
+    TEST_ASSERT_EQUAL(vector.payload.size(), digest.length);
+    TEST_ASSERT_EQUAL(complete, digest.complete);
+    TEST_ASSERT_EQUAL_HEX32((flags & WS_DIGEST_CRC32) ? vector.crc32 : 0, digest.crc32);
+    TEST_ASSERT_EQUAL_HEX8_ARRAY(sha256, digest.sha256, sizeof(sha256));
+}
+
+/**
+ * @brief Send a text message and wait for its echo, so every frame sent before it was handled.
+ */
+static void sync_with_server(WSTestClient &client)
+{
+    uint8_t opcode;
+    std::vector<uint8_t> payload;
+    TEST_ASSERT_TRUE(client.send_raw(WSTestClient::frame(0x1, "done")));
+    do
+    {
+        // Pongs to earlier pings come first.
+        TEST_ASSERT_TRUE(client.read_message(opcode, payload, 10000));
+    } while (opcode == 0xA);
+    TEST_ASSERT_EQUAL(0x1, opcode);
+}
+
+TEST_CASE("digests of a binary message match the reference vectors", "[digest]")
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    const uint8_t flag_sets[] = {WS_DIGEST_CRC32, WS_DIGEST_SHA256, WS_DIGEST_CRC32 | WS_DIGEST_SHA256};
+    for (uint8_t flags : flag_sets)
+    {
+        ws_server_config_t config = ws_test_config();
+        config.rx_digest = flags;
+        ws_test_start_echo(config);
+
+        std::vector<ws_message_digest_t> digests;
+        server.onBinaryMessage([&server, &digests](int sock, const std::vector<uint8_t> &)
+                               {
+            ws_message_digest_t digest;
+            if (server.getMessageDigest(sock, digest) == ESP_OK)
+            {
+                digests.push_back(digest);
+            } });
+
+        WSTestClient client;
+        TEST_ASSERT_TRUE(client.connect());
+        TEST_ASSERT_TRUE(client.send_raw(WSTestClient::frame(0x2, CHECK_VECTOR.payload)));
+        TEST_ASSERT_TRUE(client.send_raw(WSTestClient::frame(0x2, ABC_VECTOR.payload)));
+        sync_with_server(client);
+
+        TEST_ASSERT_EQUAL(2, digests.size());
+        expect_digest(digests[0], CHECK_VECTOR, flags, true);
+        expect_digest(digests[1], ABC_VECTOR, flags, true);
+        client.close();
+        ws_test_stop();
+    }
+}
+
+TEST_CASE("digests cover the received part of a fragmented message", "[digest]")
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    const uint8_t flags = WS_DIGEST_CRC32 | WS_DIGEST_SHA256;
+    ws_server_config_t config = ws_test_config();
+    config.rx_digest = flags;
+    ws_test_start_echo(config);
+
+    // A ping between the fragments sees the message while it is still arriving.
+    std::vector<ws_message_digest_t> partial;
+    std::vector<ws_message_digest_t> digests;
+    server.onPingMessage([&server, &partial](int sock)
+                         {
+        ws_message_digest_t digest;
+        if (server.getMessageDigest(sock, digest) == ESP_OK)
+        {
+            partial.push_back(digest);
+        } });
+    server.onBinaryMessage([&server, &digests](int sock, const std::vector<uint8_t> &)
+                           {
+        ws_message_digest_t digest;
+        if (server.getMessageDigest(sock, digest) == ESP_OK)
+        {
+            digests.push_back(digest);
+        } });
+
+    WSTestClient client;
+    TEST_ASSERT_TRUE(client.connect());
+    TEST_ASSERT_TRUE(client.send_raw(WSTestClient::frame(0x2, "1234", false)));
+    TEST_ASSERT_TRUE(client.send_raw(WSTestClient::frame(0x9, "p")));
+    TEST_ASSERT_TRUE(client.send_raw(WSTestClient::frame(0x0, "5", false)));
+    TEST_ASSERT_TRUE(client.send_raw(WSTestClient::frame(0x0, "6789", true)));
+    // The next message starts over.
+    TEST_ASSERT_TRUE(client.send_raw(WSTestClient::frame(0x2, ABC_VECTOR.payload)));
+    sync_with_server(client);
+
+    TEST_ASSERT_EQUAL(1, partial.size());
+    expect_digest(partial[0], PREFIX_VECTOR, flags, false);
+    TEST_ASSERT_EQUAL(2, digests.size());
+    expect_digest(digests[0], CHECK_VECTOR, flags, true);
+    expect_digest(digests[1], ABC_VECTOR, flags, true);
+    client.close();
+    ws_test_reset_callbacks();
+    ws_test_stop();
+}
+
+TEST_CASE("digests of a message received into a supplied buffer", "[digest]")
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    const uint8_t flags = WS_DIGEST_CRC32 | WS_DIGEST_SHA256;
+    ws_server_config_t config = ws_test_config();
+    config.rx_digest = flags;
+    ws_test_start_echo(config);
+
+    // Far larger than the receive buffer, so the payload arrives over many reads.
+    std::vector<uint8_t> sink;
+    std::vector<ws_message_digest_t> digests;
+    esp_err_t result = ESP_FAIL;
+    server.onBinaryBuffer([&sink](int, size_t length)
+                          { sink.assign(length, 0); return sink.data(); },
+                          [&server, &digests, &result](int sock, uint8_t *, size_t, esp_err_t status)
+                          {
+        result = status;
+        ws_message_digest_t digest;
+        if (server.getMessageDigest(sock, digest) == ESP_OK)
+        {
+            digests.push_back(digest);
+        } });
+
+    WSTestClient client;
+    TEST_ASSERT_TRUE(client.connect());
+    TEST_ASSERT_TRUE(client.send_raw(WSTestClient::frame(0x2, MILLION_A_VECTOR.payload)));
+    sync_with_server(client);
+
+    TEST_ASSERT_EQUAL(ESP_OK, result);
+    TEST_ASSERT_EQUAL(1, digests.size());
+    expect_digest(digests[0], MILLION_A_VECTOR, flags, true);
+    TEST_ASSERT_TRUE(std::string(sink.begin(), sink.end()) == MILLION_A_VECTOR.payload);
+    client.close();
+    ws_test_reset_callbacks();
+    ws_test_stop();
+}
+
+/**
+ * @brief Upload 1 MiB binary messages into a supplied buffer and time them.
+ * @param flags rx_digest of the server.
+ * @param second_pass Checksum each complete message in the callback, as an application without rx_digest would.
+ * @return Microseconds from the first byte sent until the server handled the last message.
+ */
+static int64_t time_upload(uint8_t flags, bool second_pass)
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    ws_server_config_t config = ws_test_config();
+    config.rx_digest = flags;
+    ws_test_start_echo(config);
+
+    const size_t length = 1024 * 1024;
+    const int messages = 32;
+    std::vector<uint8_t> sink(length);
+    uint32_t crc32 = 0;
+    server.onBinaryBuffer([&sink](int, size_t)
+                          { return sink.data(); },
+                          [&crc32, second_pass](int, uint8_t *data, size_t received, esp_err_t)
+                          {
+        if (second_pass)
+        {
+            uint8_t sha256[32];
+            mbedtls_sha256_context context;
+            mbedtls_sha256_init(&context);
+            mbedtls_sha256_starts(&context, 0);
+            crc32 = esp_rom_crc32_le(0, data, received);
+            mbedtls_sha256_update(&context, data, received);
+            mbedtls_sha256_finish(&context, sha256);
+            mbedtls_sha256_free(&context);
+        } });
+
+    std::vector<uint8_t> payload(length);
+    for (size_t i = 0; i < length; ++i)
+    {
+        payload[i] = static_cast<uint8_t>(i * 31 + (i >> 8));
+    }
+    std::vector<uint8_t> message = WSTestClient::frame(0x2, payload);
+    WSTestClient client;
+    TEST_ASSERT_TRUE(client.connect());
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < messages; ++i)
+    {
+        TEST_ASSERT_TRUE(client.send_raw(message));
+    }
+    sync_with_server(client);
+    int64_t elapsed_us = esp_timer_get_time() - start;
+
+    client.close();
+    ws_test_reset_callbacks();
+    ws_test_stop();
+    return elapsed_us;
+}
+
+TEST_CASE("checksums fused into unmasking cost no more than a second pass", "[digest]")
+{
+    const uint8_t flags = WS_DIGEST_CRC32 | WS_DIGEST_SHA256;
+    // Interleaved, so a change in machine load affects both alike.
+    int64_t plain_us = 0;
+    int64_t fused_us = 0;
+    int64_t separate_us = 0;
+    for (int round = 0; round < 3; ++round)
+    {
+        plain_us += time_upload(WS_DIGEST_NONE, false);
+        fused_us += time_upload(flags, false);
+        separate_us += time_upload(WS_DIGEST_NONE, true);
+    }
+    const double mib = 3 * 32;
+    printf("upload of %.0f MiB with CRC-32 and SHA-256: none %.0f MiB/s, fused %.0f MiB/s, second pass %.0f MiB/s\n",
+           mib, mib * 1e6 / plain_us, mib * 1e6 / fused_us, mib * 1e6 / separate_us);
+    TEST_ASSERT_TRUE(fused_us <= separate_us * MAX_FUSED_OVER_SEPARATE);
+}
@@ -0,0 +1,93 @@
+/**
+ * @file test_idle.cpp
+ * @brief Wakeups of an idle server against the bound set by its ping and inactivity deadlines.
+ *
+ * @author Daniel Giménez
+ * @date 2024-08-05
+ * @license MIT License
+ */
+
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "unity.h"
+#include "test_server.h"
+#include "ws_test_client.h"
+
+static const uint32_t IDLE_WINDOW_MS = 2000; /**< Measured idle time, shortened from the minutes a device would idle */
+
+TEST_CASE("an idle server wakes only for its deadlines", "[idle]")
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    const int client_count = 2;
+    ws_server_config_t config = ws_test_config();
+    config.max_connections = client_count;
+    config.enable_ping_pong = true;
+    config.ping_interval_ms = 200;
+    config.max_inactivity_ms = 500;
+    config.timer_slack_ms = 50;
+    ws_test_start_echo(config);
+
+    // The clients answer every ping and otherwise stay silent, so they are never closed for inactivity.
+    WSTestClient clients[client_count];
+    std::atomic<bool> responding(true);
+    std::vector<std::thread> responders;
+    for (WSTestClient &client : clients)
+    {
+        TEST_ASSERT_TRUE(client.connect());
+        responders.emplace_back([&client, &responding]()
+                                {
+            ws_test_frame_t frame;
+            while (responding)
+            {
+                if (client.read_frame(frame, 50) && frame.opcode == 0x9)
+                {
+                    client.send_raw(WSTestClient::frame(0xA, frame.payload));
+                }
+            } });
+    }
+
+    // Let the handshakes and the first pings settle before counting.
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    ws_wakeup_stats_t before = server.getWakeupStats();
+    std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_WINDOW_MS));
+    ws_wakeup_stats_t after = server.getWakeupStats();
+    responding = false;
+    for (std::thread &responder : responders)
+    {
+        responder.join();
+    }
+
+    // Deadlines: one ping for all clients, and an inactivity deadline per client, merged on
+    // the slack grid. Socket activity: one pong per client and ping. One more for the window edges.
+    double seconds = IDLE_WINDOW_MS / 1000.0;
+    double deadlines_per_sec = 1000.0 / config.ping_interval_ms + client_count * 1000.0 / config.max_inactivity_ms;
+    double timer_bound = std::min(deadlines_per_sec, 1000.0 / config.timer_slack_ms) + 1 / seconds;
+    double bound = timer_bound + client_count * 1000.0 / config.ping_interval_ms;
+    double wakeups = (after.wakeups - before.wakeups) / seconds;
+    double timer_wakeups = (after.timer_wakeups - before.timer_wakeups) / seconds;
+    printf("idle with %d clients: %.1f wakeups per second (%.1f on a deadline), bound %.1f (%.1f); last window %u\n",
+           client_count, wakeups, timer_wakeups, bound, timer_bound, (unsigned)after.wakeups_per_sec);
+    TEST_ASSERT_TRUE(wakeups <= bound);
+    TEST_ASSERT_TRUE(timer_wakeups <= timer_bound);
+    TEST_ASSERT_TRUE(after.wakeups_per_sec <= bound + 1);
+
+    // The pongs kept both sessions open.
+    for (WSTestClient &client : clients)
+    {
+        uint8_t opcode;
+        std::vector<uint8_t> payload;
+        TEST_ASSERT_TRUE(client.send_raw(WSTestClient::frame(0x1, "still here")));
+        do
+        {
+            TEST_ASSERT_TRUE(client.read_message(opcode, payload));
+        } while (opcode == 0x9);
+        TEST_ASSERT_EQUAL(0x1, opcode);
+        client.close();
+    }
+    ws_test_stop();
+}
@@ -0,0 +1,123 @@
+/**
+ * @file test_isr.cpp
+ * @brief Event-to-wire latency of messages submitted with sendBinaryMessageFromISR().
+ *
+ * The linux target has no interrupts, so a thread at the highest real-time priority the
+ * process may use stands in for the interrupt handler.
+ *
+ * @author Daniel Giménez
+ * @date 2024-08-05
+ * @license MIT License
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "esp_timer.h"
+#include "unity.h"
+#include "test_server.h"
+#include "ws_test_client.h"
+
+static const int64_t MAX_ISR_P99_US = 5 * 1000;      /**< Event to client, 99th percentile */
+static const int64_t MAX_ISR_LATENCY_US = 50 * 1000; /**< Event to client, worst case */
+
+/**
+ * @brief Run the calling thread at the highest SCHED_FIFO priority, if the process may.
+ * @return Whether the priority was raised; without it the thread keeps the default policy.
+ */
+static bool raise_to_interrupt_priority()
+{
+    struct sched_param param = {};
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+    return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+}
+
+TEST_CASE("messages sent from an interrupt reach the client quickly", "[isr]")
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    ws_server_config_t config = ws_test_config();
+    config.tx_ring_size = 4096;
+    config.isr_submission = true;
+    ws_test_start_echo(config);
+
+    std::atomic<ws_conn_handle_t> session(ws_conn_handle_t{});
+    server.onConnectionOpened([&session](ws_conn_handle_t handle) -> void *
+                              { session = handle; return nullptr; });
+    WSTestClient client;
+    TEST_ASSERT_TRUE(client.connect());
+    int64_t deadline = esp_timer_get_time() + 1000 * 1000;
+    while (session.load().generation == 0 && esp_timer_get_time() < deadline)
+    {
+        std::this_thread::yield();
+    }
+    ws_conn_handle_t handle = session;
+    TEST_ASSERT_NOT_EQUAL(0, handle.generation);
+
+    // One event a millisecond; each message carries its sequence number and the time of its event.
+    const uint32_t events = 1000;
+    std::atomic<uint32_t> refused(0);
+    std::atomic<bool> raised(false);
+    std::thread interrupt([&server, handle, events, &refused, &raised]()
+                          {
+        raised = raise_to_interrupt_priority();
+        struct timespec next;
+        clock_gettime(CLOCK_MONOTONIC, &next);
+        for (uint32_t sequence = 0; sequence < events; ++sequence)
+        {
+            next.tv_nsec += 1000 * 1000;
+            if (next.tv_nsec >= 1000 * 1000 * 1000)
+            {
+                next.tv_sec++;
+                next.tv_nsec -= 1000 * 1000 * 1000;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr);
+            uint8_t message[12];
+            int64_t event_us = esp_timer_get_time();
+            memcpy(message, &sequence, sizeof(sequence));
+            memcpy(message + sizeof(sequence), &event_us, sizeof(event_us));
+            if (server.sendBinaryMessageFromISR(handle, message, sizeof(message)) != ESP_OK)
+            {
+                refused++;
+            }
+        } });
+
+    std::vector<int64_t> latencies;
+    bool ordered = true;
+    ws_test_frame_t frame;
+    for (uint32_t expected = 0; ordered && expected < events; ++expected)
+    {
+        ordered = client.read_frame(frame, 5000) && frame.opcode == 0x2 && frame.payload.size() == 12;
+        if (ordered)
+        {
+            int64_t received_us = esp_timer_get_time();
+            uint32_t sequence;
+            int64_t event_us;
+            memcpy(&sequence, frame.payload.data(), sizeof(sequence));
+            memcpy(&event_us, frame.payload.data() + sizeof(sequence), sizeof(event_us));
+            ordered = sequence == expected;
+            latencies.push_back(received_us - event_us);
+        }
+    }
+    interrupt.join();
+
+    TEST_ASSERT_EQUAL(0, refused.load());
+    TEST_ASSERT_TRUE(ordered);
+    std::sort(latencies.begin(), latencies.end());
+    int64_t p50 = latencies[latencies.size() / 2];
+    int64_t p99 = latencies[latencies.size() * 99 / 100];
+    int64_t worst = latencies.back();
+    printf("interrupt to client%s: p50 %lld us, p99 %lld us, max %lld us\n", raised ? "" : " (default priority)",
+           (long long)p50, (long long)p99, (long long)worst);
+    TEST_ASSERT_LESS_OR_EQUAL(MAX_ISR_P99_US, p99);
+    TEST_ASSERT_LESS_OR_EQUAL(MAX_ISR_LATENCY_US, worst);
+
+    client.close();
+    ws_test_reset_callbacks();
+    ws_test_stop();
+}
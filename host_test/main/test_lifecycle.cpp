@@ -0,0 +1,256 @@
+/**
+ * @file test_lifecycle.cpp
+ * @brief Start, stop and restart: time to listening and memory returned across cycles.
+ *
+ * @author Daniel Giménez
+ * @date 2024-08-05
+ * @license MIT License
+ */
+
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "unity.h"
+#include "test_server.h"
+#include "ws_test_client.h"
+
+static const int64_t MAX_RESTART_US = 100 * 1000; /**< restart() until a new client is answered */
+static const size_t LEAK_SLACK_BYTES = 4096;      /**< Heap growth tolerated over the cycles, under 5 bytes a cycle */
+
+/**
+ * @brief Connect, check one echo and disconnect.
+ */
+static bool echo_once(const std::string &text)
+{
+    WSTestClient client;
+    uint8_t opcode;
+    std::vector<uint8_t> payload;
+    return client.connect() && client.send_raw(WSTestClient::frame(0x1, text)) &&
+           client.read_message(opcode, payload) && std::string(payload.begin(), payload.end()) == text;
+}
+
+/**
+ * @brief Bytes currently allocated from the heap.
+ *
+ * The linux target allocates through the host C library, so its counters include the
+ * server's buffers, tasks and sockets bookkeeping.
+ */
+static size_t heap_used()
+{
+    // Deleted tasks are freed by the idle task.
+    vTaskDelay(pdMS_TO_TICKS(10));
+    return mallinfo2().uordblks;
+}
+
+TEST_CASE("restart rebinds the port and serves clients quickly", "[lifecycle]")
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    ws_server_config_t config = ws_test_config();
+    ws_test_start_echo(config);
+    TEST_ASSERT_TRUE(echo_once("before"));
+
+    config.rx_buffer_size = 4096;
+    int64_t start = esp_timer_get_time();
+    TEST_ASSERT_EQUAL(ESP_OK, server.restart(config));
+    TEST_ASSERT_TRUE(echo_once("after"));
+    int64_t elapsed_us = esp_timer_get_time() - start;
+
+    printf("restart to first echo: %lld us\n", (long long)elapsed_us);
+    TEST_ASSERT_LESS_OR_EQUAL(MAX_RESTART_US, elapsed_us);
+    ws_test_stop();
+}
+
+TEST_CASE("1000 start and stop cycles return all memory", "[lifecycle]")
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    ws_server_config_t config = ws_test_config();
+    config.max_connections = 2;
+    config.tx_ring_size = 1024;
+
+    // The first cycles allocate what stays for the life of the process, such as the log buffers.
+    for (int i = 0; i < 10; ++i)
+    {
+        ws_test_start_echo(config);
+        TEST_ASSERT_TRUE(echo_once("warm-up"));
+        ws_test_stop();
+    }
+
+    size_t before = heap_used();
+    const int cycles = 1000;
+    for (int i = 0; i < cycles; ++i)
+    {
+        TEST_ASSERT_EQUAL(ESP_OK, server.start(config));
+        TEST_ASSERT_TRUE(echo_once(std::to_string(i)));
+        ws_test_stop();
+    }
+    size_t after = heap_used();
+
+    printf("heap before %zu, after %zu bytes over %d cycles\n", before, after, cycles);
+    TEST_ASSERT_LESS_OR_EQUAL(before + LEAK_SLACK_BYTES, after);
+}
+
+TEST_CASE("stop waits for ring producers holding a reservation", "[lifecycle]")
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    ws_server_config_t config = ws_test_config();
+    config.tx_ring_size = 4096;
+    ws_test_start_echo(config);
+
+    std::atomic<ws_conn_handle_t> session(ws_conn_handle_t{});
+    server.onConnectionOpened([&session](ws_conn_handle_t handle) -> void *
+                              { session = handle; return nullptr; });
+
+    // Producers keep reserving, filling and committing across every stop and start.
+    std::atomic<bool> producing(true);
+    std::atomic<uint32_t> committed(0);
+    std::vector<std::thread> producers;
+    for (int i = 0; i < 3; ++i)
+    {
+        producers.emplace_back([&]()
+                               {
+            while (producing)
+            {
+                ws_tx_reservation_t reservation;
+                if (server.reserveMessage(session, 64, reservation) != ESP_OK)
+                {
+                    std::this_thread::yield();
+                    continue;
+                }
+                memset(reservation.data, 0x42, 64);
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+                if (server.commitMessage(reservation, 64) == ESP_OK)
+                {
+                    committed++;
+                }
+            } });
+    }
+
+    bool ok = true;
+    for (int i = 0; i < 100 && ok; ++i)
+    {
+        WSTestClient client;
+        ok = client.connect();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        ok = ok && server.stop(0) == ESP_OK && server.getMemoryStats().used == 0 && server.start(config) == ESP_OK;
+    }
+    producing = false;
+    for (std::thread &producer : producers)
+    {
+        producer.join();
+    }
+
+    printf("%u ring messages committed across restarts\n", (unsigned)committed.load());
+    TEST_ASSERT_TRUE(ok);
+    TEST_ASSERT_GREATER_THAN(0, committed.load());
+    ws_test_stop();
+}
+
+TEST_CASE("stop from a callback run by pollPrepare is refused", "[lifecycle]")
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    ws_server_config_t config = ws_test_config();
+    config.run_mode = WS_RUN_POLLED;
+    config.enable_ping_pong = true;
+    config.ping_interval_ms = 100000;
+    config.max_inactivity_ms = 50;
+    config.close_linger_ms = 20;
+    config.timer_slack_ms = 1;
+    ws_test_start_echo(config);
+
+    // The inactivity timer closes the session inside pollPrepare(), which reports the disconnect.
+    bool disconnected = false;
+    esp_err_t stopped = ESP_OK;
+    server.onClientDisconnected([&](int)
+                                { disconnected = true; stopped = server.stop(); });
+    // The handshake only completes while the loop below polls.
+    WSTestClient client;
+    std::atomic<bool> connected(false);
+    std::thread connector([&]()
+                          { connected = client.connect(); });
+    for (int i = 0; i < 100 && !disconnected; ++i)
+    {
+        fd_set read_fds;
+        fd_set write_fds;
+        FD_ZERO(&read_fds);
+        FD_ZERO(&write_fds);
+        uint32_t timeout_ms = 20;
+        int max_fd = server.pollPrepare(&read_fds, &write_fds, &timeout_ms);
+        struct timeval tv = {};
+        tv.tv_usec = timeout_ms * 1000;
+        select(max_fd + 1, &read_fds, &write_fds, nullptr, &tv);
+        server.pollDispatch(&read_fds, &write_fds);
+    }
+    connector.join();
+
+    TEST_ASSERT_TRUE(connected);
+    TEST_ASSERT_TRUE(disconnected);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, stopped);
+    ws_test_reset_callbacks();
+    ws_test_stop();
+}
+
+/**
+ * @brief Listen on the test port so the server cannot bind it.
+ * @return The listening socket.
+ */
+static int occupy_test_port()
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(WS_TEST_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    TEST_ASSERT_TRUE(sock >= 0);
+    // Connections of earlier tests may linger in TIME_WAIT; the listening socket still keeps the server out.
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    TEST_ASSERT_EQUAL(0, bind(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)));
+    TEST_ASSERT_EQUAL(0, listen(sock, 1));
+    return sock;
+}
+
+TEST_CASE("a start that cannot bind leaves nothing behind", "[lifecycle]")
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    ws_server_config_t config = ws_test_config();
+    config.tx_ring_size = 1024;
+    config.isr_submission = true;
+    ws_test_start_echo(config);
+    ws_test_stop();
+
+    const ws_run_mode_t modes[] = {WS_RUN_TASK, WS_RUN_POLLED};
+    int blocker = occupy_test_port();
+    for (ws_run_mode_t mode : modes)
+    {
+        config.run_mode = mode;
+        TEST_ASSERT_NOT_EQUAL(ESP_OK, server.start(config));
+
+        // Not running, nothing reserved, and the producer paths refuse instead of reporting success.
+        TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, server.stop());
+        TEST_ASSERT_EQUAL(0, server.getMemoryStats().used);
+        ws_tx_reservation_t reservation;
+        ws_conn_handle_t handle = {0, 1};
+        TEST_ASSERT_EQUAL(ESP_ERR_NOT_SUPPORTED, server.reserveMessage(handle, 16, reservation));
+        uint8_t byte = 0;
+        TEST_ASSERT_NOT_EQUAL(ESP_OK, server.sendBinaryMessageFromISR(handle, &byte, 1));
+    }
+    close(blocker);
+
+    // The next start gets fresh rings and serves clients.
+    config.run_mode = WS_RUN_TASK;
+    TEST_ASSERT_EQUAL(ESP_OK, server.start(config));
+    TEST_ASSERT_TRUE(echo_once("after a failed start"));
+    ws_test_stop();
+}
@@ -0,0 +1,23 @@
+/**
+ * @file test_main.cpp
+ * @brief Entry point of the host test application.
+ *
+ * Build for the linux target and run the resulting executable; it exits with
+ * status 1 if any test failed.
+ *
+ * @author Daniel Giménez
+ * @date 2024-08-05
+ * @license MIT License
+ */
+
+#include <stdlib.h>
+#include "unity.h"
+#include "unity_test_runner.h"
+
+extern "C" void app_main(void)
+{
+    UNITY_BEGIN();
+    unity_run_all_tests();
+    int failures = UNITY_END();
+    exit(failures == 0 ? 0 : 1);
+}
@@ -0,0 +1,76 @@
+/**
+ * @file test_memory.cpp
+ * @brief Outbound queues under the memory budget.
+ *
+ * @author Daniel Giménez
+ * @date 2024-08-05
+ * @license MIT License
+ */
+
+#include <stdio.h>
+#include <atomic>
+#include <vector>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "unity.h"
+#include "test_server.h"
+#include "ws_test_client.h"
+
+TEST_CASE("shedding under memory pressure drops whole fragmented messages", "[memory]")
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    ws_server_config_t config = ws_test_config();
+    config.memory.budget = 32 * 1024;
+    config.tx_fragment_size = 1024;
+    ws_test_start_echo(config);
+
+    std::atomic<int> sock(-1);
+    server.onClientConnected([&sock](int client_sock)
+                             { sock = client_sock; });
+    WSTestClient client;
+    TEST_ASSERT_TRUE(client.connect());
+    int64_t deadline = esp_timer_get_time() + 1000 * 1000;
+    while (sock < 0 && esp_timer_get_time() < deadline)
+    {
+        vTaskDelay(1);
+    }
+    TEST_ASSERT_TRUE(sock >= 0);
+
+    // The client does not read until the kernel buffers are full and the queue has been shed.
+    const int messages = 4000;
+    const size_t length = 5000;
+    int accepted = 0;
+    for (int i = 0; i < messages; ++i)
+    {
+        std::vector<uint8_t> data(length, static_cast<uint8_t>(i));
+        if (server.sendBinaryMessage(sock, data.data(), data.size()) == ESP_OK)
+        {
+            accepted++;
+        }
+    }
+    uint32_t shed_frames = server.getMemoryStats().shed_frames;
+    TEST_ASSERT_GREATER_THAN(0, shed_frames);
+
+    // Every message that arrives is whole: it opens with a binary frame and its fragments agree.
+    int received = 0;
+    ws_test_frame_t frame;
+    while (client.read_frame(frame, 500))
+    {
+        TEST_ASSERT_EQUAL(0x2, frame.opcode);
+        std::vector<uint8_t> message = frame.payload;
+        while (!frame.fin)
+        {
+            TEST_ASSERT_TRUE(client.read_frame(frame));
+            TEST_ASSERT_EQUAL(0x0, frame.opcode);
+            message.insert(message.end(), frame.payload.begin(), frame.payload.end());
+        }
+        TEST_ASSERT_EQUAL(length, message.size());
+        TEST_ASSERT_TRUE(std::vector<uint8_t>(length, message[0]) == message);
+        received++;
+    }
+    printf("%d messages accepted, %d received, %u frames shed\n", accepted, received, (unsigned)shed_frames);
+    TEST_ASSERT_GREATER_THAN(0, received);
+    client.close();
+    ws_test_stop();
+}
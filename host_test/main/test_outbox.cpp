@@ -0,0 +1,376 @@
+/**
+ * @file test_outbox.cpp
+ * @brief Store-and-forward outbox on a file, on its own and drained by the server.
+ *
+ * Small sectors make the tests wrap the ring and fill it with a handful of records.
+ *
+ * @author Daniel Giménez
+ * @date 2024-08-05
+ * @license MIT License
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "unity.h"
+#include "test_server.h"
+#include "ws_test_client.h"
+
+static const char *OUTBOX_PATH = "/tmp/ws_light_server_outbox.bin"; /**< Backing file, recreated by each test */
+static const size_t SMALL_SECTOR = 256;                 /**< Sector of the format tests, three 60-byte records */
+static const uint32_t MIN_APPENDS_PER_SEC = 2000;       /**< 64-byte appends through 4 KiB batches, each synced */
+static const int64_t MAX_DRAIN_US = 2000 * 1000;        /**< Connect until 2000 stored messages arrived */
+
+/**
+ * @brief Open a blank outbox file.
+ */
+static void open_storage(WSFileStorage &storage, size_t size, size_t sector_size = 4096)
+{
+    unlink(OUTBOX_PATH);
+    TEST_ASSERT_EQUAL(ESP_OK, storage.init(OUTBOX_PATH, size, sector_size));
+}
+
+/**
+ * @brief Wait for the server to release everything it drained.
+ */
+static bool wait_empty(const WSOutbox &outbox, uint32_t timeout_ms = 2000)
+{
+    int64_t deadline = esp_timer_get_time() + static_cast<int64_t>(timeout_ms) * 1000;
+    while (!outbox.empty() && esp_timer_get_time() < deadline)
+    {
+        vTaskDelay(1);
+    }
+    return outbox.empty();
+}
+
+static std::string text_of(const std::vector<uint8_t> &payload)
+{
+    return std::string(payload.begin(), payload.end());
+}
+
+/**
+ * @brief Store a text record of @p length bytes that starts with @p text.
+ */
+static esp_err_t append_text(WSOutbox &outbox, const std::string &text, size_t length = 60)
+{
+    std::string record = text;
+    record.resize(std::max(length, text.size()), '.');
+    return outbox.append(reinterpret_cast<const uint8_t *>(record.data()), record.size(), HTTPD_WS_TYPE_TEXT);
+}
+
+/**
+ * @brief Gather one batch, keeping what each record starts with.
+ * @param limit Records to accept before the deliver callback refuses the rest.
+ */
+static std::vector<std::string> gather_texts(WSOutbox &outbox, size_t limit = SIZE_MAX)
+{
+    std::vector<std::string> texts;
+    outbox.gather([&texts, limit](const uint8_t *data, size_t length, ws_type_t type)
+                  {
+        if (texts.size() == limit || type != HTTPD_WS_TYPE_TEXT)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+        std::string text(reinterpret_cast<const char *>(data), length);
+        texts.push_back(text.substr(0, text.find('.')));
+        return ESP_OK; });
+    return texts;
+}
+
+TEST_CASE("a stored message no client can take does not hold back the drain", "[outbox]")
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    WSFileStorage storage;
+    WSOutbox outbox;
+    open_storage(storage, 8 * 4096);
+    TEST_ASSERT_EQUAL(ESP_OK, outbox.init(&storage, 0));
+    ws_server_config_t config = ws_test_config();
+    config.tx_fragment_size = 0;
+    config.outbox = &outbox;
+    ws_test_start_echo(config);
+
+    // Over MAX_MESSAGE_SIZE unfragmented: refused instead of stored.
+    std::vector<uint8_t> large(MAX_MESSAGE_SIZE + 1, 0x55);
+    TEST_ASSERT_EQUAL(ESP_OK, server.sendTextMessage("first"));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, server.sendBinaryMessage(large.data(), large.size()));
+    // One stored under a configuration that could send it is dropped by the drain.
+    TEST_ASSERT_EQUAL(ESP_OK, outbox.append(large.data(), large.size(), HTTPD_WS_TYPE_BINARY));
+    TEST_ASSERT_EQUAL(ESP_OK, server.sendTextMessage("last"));
+
+    WSTestClient client;
+    TEST_ASSERT_TRUE(client.connect());
+    uint8_t opcode;
+    std::vector<uint8_t> payload;
+    TEST_ASSERT_TRUE(client.read_message(opcode, payload));
+    TEST_ASSERT_EQUAL_STRING("first", text_of(payload).c_str());
+    TEST_ASSERT_TRUE(client.read_message(opcode, payload));
+    TEST_ASSERT_EQUAL_STRING("last", text_of(payload).c_str());
+    // Released on the pass after the socket took them.
+    TEST_ASSERT_TRUE(wait_empty(outbox));
+    client.close();
+    ws_test_stop();
+
+    ws_outbox_stats_t stats = outbox.stats();
+    TEST_ASSERT_EQUAL(3, stats.appended);
+    TEST_ASSERT_EQUAL(2, stats.drained);
+    TEST_ASSERT_EQUAL(1, stats.dropped);
+    TEST_ASSERT_TRUE(outbox.empty());
+}
+
+TEST_CASE("records are gathered in order and released", "[outbox]")
+{
+    WSFileStorage storage;
+    WSOutbox outbox;
+    open_storage(storage, 4 * SMALL_SECTOR, SMALL_SECTOR);
+    TEST_ASSERT_EQUAL(ESP_OK, outbox.init(&storage));
+    TEST_ASSERT_TRUE(outbox.empty());
+
+    TEST_ASSERT_EQUAL(ESP_OK, append_text(outbox, "a"));
+    TEST_ASSERT_EQUAL(ESP_OK, append_text(outbox, "b", 3));
+    uint8_t bytes[] = {0x00, 0xFF, 0x7E};
+    TEST_ASSERT_EQUAL(ESP_OK, outbox.append(bytes, sizeof(bytes), HTTPD_WS_TYPE_BINARY));
+    // The three appends fit the RAM batch; gather() writes it first.
+    TEST_ASSERT_NOT_EQUAL(0, outbox.flush_deadline());
+    TEST_ASSERT_FALSE(outbox.empty());
+
+    std::vector<std::pair<ws_type_t, std::vector<uint8_t>>> records;
+    TEST_ASSERT_EQUAL(3, outbox.gather([&records](const uint8_t *data, size_t length, ws_type_t type)
+                                       { records.push_back({type, std::vector<uint8_t>(data, data + length)}); return ESP_OK; }));
+    TEST_ASSERT_EQUAL(0, outbox.flush_deadline());
+    TEST_ASSERT_EQUAL(HTTPD_WS_TYPE_TEXT, records[0].first);
+    TEST_ASSERT_EQUAL(60, records[0].second.size());
+    TEST_ASSERT_EQUAL_STRING("b..", text_of(records[1].second).c_str());
+    TEST_ASSERT_EQUAL(HTTPD_WS_TYPE_BINARY, records[2].first);
+    TEST_ASSERT_TRUE(records[2].second == std::vector<uint8_t>(bytes, bytes + sizeof(bytes)));
+    TEST_ASSERT_EQUAL(0, gather_texts(outbox).size());
+
+    TEST_ASSERT_FALSE(outbox.empty());
+    outbox.release();
+    TEST_ASSERT_TRUE(outbox.empty());
+    ws_outbox_stats_t stats = outbox.stats();
+    TEST_ASSERT_EQUAL(3, stats.appended);
+    TEST_ASSERT_EQUAL(3, stats.drained);
+    TEST_ASSERT_EQUAL(0, stats.rejected);
+
+    // Appended after the drain, read behind nothing.
+    TEST_ASSERT_EQUAL(ESP_OK, append_text(outbox, "c"));
+    std::vector<std::string> texts = gather_texts(outbox);
+    TEST_ASSERT_EQUAL(1, texts.size());
+    TEST_ASSERT_EQUAL_STRING("c", texts[0].c_str());
+}
+
+TEST_CASE("rewind after a dropped client gathers the unreleased records again", "[outbox]")
+{
+    WSFileStorage storage;
+    WSOutbox outbox;
+    open_storage(storage, 4 * SMALL_SECTOR, SMALL_SECTOR);
+    TEST_ASSERT_EQUAL(ESP_OK, outbox.init(&storage, 0));
+    const char *names[] = {"0", "1", "2", "3", "4"};
+    for (const char *name : names)
+    {
+        TEST_ASSERT_EQUAL(ESP_OK, append_text(outbox, name));
+    }
+
+    // The first client takes two records, releases them, takes one more and drops.
+    TEST_ASSERT_EQUAL(2, gather_texts(outbox, 2).size());
+    outbox.release();
+    std::vector<std::string> texts = gather_texts(outbox, 1);
+    TEST_ASSERT_EQUAL(1, texts.size());
+    TEST_ASSERT_EQUAL_STRING("2", texts[0].c_str());
+    outbox.rewind();
+
+    // The next one starts at the first record not released, across the sector boundary.
+    texts = gather_texts(outbox);
+    TEST_ASSERT_EQUAL(1, texts.size());
+    TEST_ASSERT_EQUAL_STRING("2", texts[0].c_str());
+    outbox.release();
+    texts = gather_texts(outbox);
+    TEST_ASSERT_EQUAL(2, texts.size());
+    TEST_ASSERT_EQUAL_STRING("3", texts[0].c_str());
+    TEST_ASSERT_EQUAL_STRING("4", texts[1].c_str());
+    outbox.release();
+    TEST_ASSERT_TRUE(outbox.empty());
+    TEST_ASSERT_EQUAL(5, outbox.stats().drained);
+}
+
+TEST_CASE("records survive a re-init on the same file and a torn write", "[outbox]")
+{
+    {
+        WSFileStorage storage;
+        WSOutbox outbox;
+        open_storage(storage, 4 * SMALL_SECTOR, SMALL_SECTOR);
+        TEST_ASSERT_EQUAL(ESP_OK, outbox.init(&storage));
+        const char *names[] = {"0", "1", "2", "3"};
+        for (const char *name : names)
+        {
+            TEST_ASSERT_EQUAL(ESP_OK, append_text(outbox, name));
+        }
+        // Sector 0 is drained and marked; "3" in sector 1 is gathered but never released.
+        TEST_ASSERT_EQUAL(3, gather_texts(outbox).size());
+        outbox.release();
+        TEST_ASSERT_EQUAL(1, gather_texts(outbox).size());
+        // Left in the batch, written by the destructor.
+        TEST_ASSERT_EQUAL(ESP_OK, append_text(outbox, "4"));
+    }
+
+    // The last payload byte of "4" is lost, as in a power cut in the middle of the write.
+    FILE *file = fopen(OUTBOX_PATH, "r+b");
+    TEST_ASSERT_NOT_NULL(file);
+    uint8_t corrupt = 0;
+    fseek(file, SMALL_SECTOR + 16 + 2 * 68 - 1, SEEK_SET);
+    fwrite(&corrupt, 1, 1, file);
+    fclose(file);
+
+    WSFileStorage storage;
+    WSOutbox outbox;
+    TEST_ASSERT_EQUAL(ESP_OK, storage.init(OUTBOX_PATH, 4 * SMALL_SECTOR, SMALL_SECTOR));
+    TEST_ASSERT_EQUAL(ESP_OK, outbox.init(&storage, 0));
+    TEST_ASSERT_FALSE(outbox.empty());
+    // Appends after the torn record go to a new sector instead of programming over it.
+    TEST_ASSERT_EQUAL(ESP_OK, append_text(outbox, "5"));
+
+    std::vector<std::string> texts = gather_texts(outbox);
+    TEST_ASSERT_EQUAL(1, texts.size());
+    TEST_ASSERT_EQUAL_STRING("3", texts[0].c_str());
+    texts = gather_texts(outbox);
+    TEST_ASSERT_EQUAL(1, texts.size());
+    TEST_ASSERT_EQUAL_STRING("5", texts[0].c_str());
+    outbox.release();
+    TEST_ASSERT_TRUE(outbox.empty());
+
+    // A drained outbox stays empty across the next re-init.
+    WSOutbox reopened;
+    TEST_ASSERT_EQUAL(ESP_OK, reopened.init(&storage, 0));
+    TEST_ASSERT_TRUE(reopened.empty());
+}
+
+TEST_CASE("sectors are reused round robin as the ring wraps", "[outbox]")
+{
+    WSFileStorage storage;
+    WSOutbox outbox;
+    const size_t sectors = 4;
+    open_storage(storage, sectors * SMALL_SECTOR, SMALL_SECTOR);
+    TEST_ASSERT_EQUAL(ESP_OK, outbox.init(&storage, 0));
+
+    // A backlog of four records, kept while three go in and three come out each round.
+    int next_in = 0;
+    int next_out = 0;
+    for (int round = 0; round < 40; ++round)
+    {
+        for (int i = 0; i < (round == 0 ? 7 : 3); ++i)
+        {
+            TEST_ASSERT_EQUAL(ESP_OK, append_text(outbox, std::to_string(next_in++)));
+        }
+        for (int taken = 0; taken < 3;)
+        {
+            std::vector<std::string> texts = gather_texts(outbox, 3 - taken);
+            TEST_ASSERT_NOT_EQUAL(0, texts.size());
+            for (const std::string &text : texts)
+            {
+                TEST_ASSERT_EQUAL_STRING(std::to_string(next_out++).c_str(), text.c_str());
+            }
+            taken += texts.size();
+            outbox.release();
+        }
+    }
+
+    // Recovery finds the oldest undrained sector after the wrap.
+    WSOutbox reopened;
+    TEST_ASSERT_EQUAL(ESP_OK, reopened.init(&storage, 0));
+    std::vector<std::string> texts;
+    for (std::vector<std::string> batch = gather_texts(reopened); !batch.empty(); batch = gather_texts(reopened))
+    {
+        texts.insert(texts.end(), batch.begin(), batch.end());
+    }
+    TEST_ASSERT_TRUE(texts.size() >= static_cast<size_t>(next_in - next_out));
+    TEST_ASSERT_EQUAL_STRING(std::to_string(next_in - 1).c_str(), texts.back().c_str());
+    // Records released inside a sector that is not yet drained come again: delivery is at least once.
+    TEST_ASSERT_TRUE(std::stoi(texts.front()) <= next_out);
+
+    ws_outbox_stats_t stats = outbox.stats();
+    printf("%u appends, %u writes, %u erases of %zu sectors\n", (unsigned)stats.appended, (unsigned)stats.writes,
+           (unsigned)stats.erases, sectors);
+    TEST_ASSERT_GREATER_THAN(5 * sectors, stats.erases);
+}
+
+TEST_CASE("a full outbox refuses appends until a sector is drained", "[outbox]")
+{
+    WSFileStorage storage;
+    WSOutbox outbox;
+    const size_t sectors = 4;
+    const size_t per_sector = (SMALL_SECTOR - 16) / 68;
+    open_storage(storage, sectors * SMALL_SECTOR, SMALL_SECTOR);
+    TEST_ASSERT_EQUAL(ESP_OK, outbox.init(&storage, 0));
+
+    size_t stored = 0;
+    while (append_text(outbox, std::to_string(stored)) == ESP_OK)
+    {
+        stored++;
+    }
+    TEST_ASSERT_EQUAL(sectors * per_sector, stored);
+    TEST_ASSERT_EQUAL(ESP_ERR_NO_MEM, append_text(outbox, "full"));
+    TEST_ASSERT_EQUAL(2, outbox.stats().rejected);
+    // Larger than a sector can hold: never stored, full or not.
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_SIZE, append_text(outbox, "huge", SMALL_SECTOR));
+
+    TEST_ASSERT_EQUAL(per_sector, gather_texts(outbox).size());
+    outbox.release();
+    for (size_t i = 0; i < per_sector; ++i)
+    {
+        TEST_ASSERT_EQUAL(ESP_OK, append_text(outbox, "again"));
+    }
+    TEST_ASSERT_EQUAL(ESP_ERR_NO_MEM, append_text(outbox, "full"));
+}
+
+TEST_CASE("append throughput and time to drain to a client", "[outbox][throughput]")
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    WSFileStorage storage;
+    WSOutbox outbox;
+    open_storage(storage, 64 * 4096);
+    TEST_ASSERT_EQUAL(ESP_OK, outbox.init(&storage, 4096));
+    ws_server_config_t config = ws_test_config();
+    config.outbox = &outbox;
+    ws_test_start_echo(config);
+
+    // Nobody is connected, so every broadcast goes to the outbox.
+    const int messages = 2000;
+    std::vector<uint8_t> payload(64, 0x33);
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < messages; ++i)
+    {
+        payload[0] = static_cast<uint8_t>(i);
+        TEST_ASSERT_EQUAL(ESP_OK, server.sendBinaryMessage(payload.data(), payload.size()));
+    }
+    TEST_ASSERT_EQUAL(ESP_OK, outbox.flush());
+    int64_t append_us = esp_timer_get_time() - start;
+
+    start = esp_timer_get_time();
+    WSTestClient client;
+    TEST_ASSERT_TRUE(client.connect());
+    uint8_t opcode;
+    std::vector<uint8_t> received;
+    for (int i = 0; i < messages; ++i)
+    {
+        TEST_ASSERT_TRUE(client.read_message(opcode, received));
+        TEST_ASSERT_EQUAL(0x2, opcode);
+        TEST_ASSERT_EQUAL(static_cast<uint8_t>(i), received[0]);
+    }
+    int64_t drain_us = esp_timer_get_time() - start;
+    TEST_ASSERT_TRUE(wait_empty(outbox));
+    client.close();
+    ws_test_stop();
+
+    uint32_t appends_per_sec = static_cast<uint32_t>(messages * 1000000LL / append_us);
+    ws_outbox_stats_t stats = outbox.stats();
+    printf("outbox: %u appends per second in %u writes, %d messages drained in %lld us\n",
+           (unsigned)appends_per_sec, (unsigned)stats.writes, messages, (long long)drain_us);
+    TEST_ASSERT_GREATER_OR_EQUAL(MIN_APPENDS_PER_SEC, appends_per_sec);
+    TEST_ASSERT_LESS_OR_EQUAL(MAX_DRAIN_US, drain_us);
+    TEST_ASSERT_EQUAL(messages, stats.drained);
+}
@@ -0,0 +1,212 @@
+/**
+ * @file test_scheduling.cpp
+ * @brief Latency of well-behaved clients while another client floods the server, and the
+ *        outbound bandwidth split between priority classes under saturation.
+ *
+ * @author Daniel Giménez
+ * @date 2024-08-05
+ * @license MIT License
+ */
+
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+#include "unity.h"
+#include "test_server.h"
+#include "ws_test_client.h"
+
+static const int64_t MAX_ECHO_LATENCY_US = 50 * 1000; /**< Worst echo a measuring client may see during the flood */
+static const double MIN_SHARE_RATIO = 0.7;            /**< Measured over configured share between two classes, at least */
+
+TEST_CASE("a flooding client does not hold back the others", "[scheduling]")
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    ws_server_config_t config = ws_test_config();
+    config.max_connections = 4;
+    config.rx_buffer_size = 16 * 1024;
+    ws_test_start_echo(config);
+
+    // The flood is consumed, not echoed, so only the inbound side is contended.
+    std::atomic<size_t> flooded(0);
+    server.onBinaryMessage([&flooded](int, const std::vector<uint8_t> &data)
+                           { flooded += data.size(); });
+
+    WSTestClient flooder;
+    WSTestClient clients[3];
+    TEST_ASSERT_TRUE(flooder.connect());
+    for (WSTestClient &client : clients)
+    {
+        TEST_ASSERT_TRUE(client.connect());
+    }
+
+    std::atomic<bool> flooding(true);
+    std::thread flood([&flooder, &flooding]()
+                      {
+        std::vector<uint8_t> frame = WSTestClient::frame(0x2, std::vector<uint8_t>(8 * 1024, 0x77));
+        while (flooding && flooder.send_raw(frame))
+        {
+        } });
+
+    // Let the flood fill the socket buffers before measuring.
+    int64_t deadline = esp_timer_get_time() + 5000 * 1000;
+    while (flooded < 1024 * 1024 && esp_timer_get_time() < deadline)
+    {
+        std::this_thread::yield();
+    }
+
+    const int rounds = 300;
+    std::vector<int64_t> latencies;
+    bool echoed = true;
+    size_t flood_start = flooded;
+    for (int i = 0; i < rounds && echoed; ++i)
+    {
+        for (WSTestClient &client : clients)
+        {
+            std::string text = std::to_string(i);
+            int64_t sent = esp_timer_get_time();
+            uint8_t opcode;
+            std::vector<uint8_t> payload;
+            echoed = client.send_raw(WSTestClient::frame(0x1, text)) && client.read_message(opcode, payload) &&
+                     std::string(payload.begin(), payload.end()) == text;
+            if (!echoed)
+            {
+                break;
+            }
+            latencies.push_back(esp_timer_get_time() - sent);
+        }
+    }
+    size_t flood_during = flooded - flood_start;
+    flooding = false;
+    flood.join();
+    flooder.close();
+
+    TEST_ASSERT_TRUE(echoed);
+    std::sort(latencies.begin(), latencies.end());
+    int64_t p50 = latencies[latencies.size() / 2];
+    int64_t p99 = latencies[latencies.size() * 99 / 100];
+    int64_t worst = latencies.back();
+    printf("echo latency under flood: p50 %lld us, p99 %lld us, max %lld us, %zu flooded bytes\n",
+           (long long)p50, (long long)p99, (long long)worst, flood_during);
+    // The flood must have kept going, or the latencies say nothing about fairness.
+    TEST_ASSERT_GREATER_THAN(1024 * 1024, flood_during);
+    TEST_ASSERT_LESS_OR_EQUAL(MAX_ECHO_LATENCY_US, worst);
+
+    for (WSTestClient &client : clients)
+    {
+        client.close();
+    }
+    ws_test_stop();
+}
+
+TEST_CASE("saturated priority classes split the bandwidth by their weights", "[scheduling]")
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    ws_server_config_t config = ws_test_config();
+    config.max_connections = 3;
+    config.scheduling.write_quantum = 1024;
+    config.socket.send_buffer = 16 * 1024;
+    config.relief_delay = 1;
+    ws_test_start_echo(config);
+
+    std::atomic<int> last_sock(-1);
+    server.onClientConnected([&last_sock](int sock)
+                             { last_sock = sock; });
+    WSTestClient clients[WS_PRIORITY_COUNT];
+    int socks[WS_PRIORITY_COUNT];
+    for (int priority = 0; priority < WS_PRIORITY_COUNT; ++priority)
+    {
+        last_sock = -1;
+        TEST_ASSERT_TRUE(clients[priority].connect());
+        int64_t deadline = esp_timer_get_time() + 1000 * 1000;
+        while (last_sock < 0 && esp_timer_get_time() < deadline)
+        {
+            vTaskDelay(1);
+        }
+        socks[priority] = last_sock;
+        TEST_ASSERT_EQUAL(ESP_OK, server.setClientPriority(socks[priority], static_cast<ws_priority_t>(priority)));
+    }
+
+    // Queue far more than the measurement sends, so every class stays backlogged throughout.
+    std::vector<uint8_t> message(4096, 0x3C);
+    for (int i = 0; i < 4096; ++i)
+    {
+        for (int sock : socks)
+        {
+            TEST_ASSERT_EQUAL(ESP_OK, server.sendBinaryMessage(sock, message.data(), message.size()));
+        }
+    }
+
+    // The readers discard raw bytes, so they keep up and the server's passes are the bottleneck.
+    std::atomic<bool> reading(true);
+    std::vector<std::thread> readers;
+    for (WSTestClient &client : clients)
+    {
+        readers.emplace_back([&client, &reading]()
+                             {
+            std::vector<uint8_t> buffer(64 * 1024);
+            while (reading && recv(client.fd(), buffer.data(), buffer.size(), 0) > 0)
+            {
+            } });
+    }
+
+    // Skip what the socket buffers held before the readers started.
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    uint64_t start_bytes[WS_PRIORITY_COUNT];
+    for (int priority = 0; priority < WS_PRIORITY_COUNT; ++priority)
+    {
+        start_bytes[priority] = server.getPriorityStats(static_cast<ws_priority_t>(priority)).bytes_sent;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    uint64_t sent[WS_PRIORITY_COUNT];
+    bool backlogged = true;
+    for (int priority = 0; priority < WS_PRIORITY_COUNT; ++priority)
+    {
+        ws_priority_stats_t stats = server.getPriorityStats(static_cast<ws_priority_t>(priority));
+        sent[priority] = stats.bytes_sent - start_bytes[priority];
+        backlogged = backlogged && stats.queued_bytes > 0;
+    }
+    reading = false;
+    for (std::thread &reader : readers)
+    {
+        reader.join();
+    }
+
+    const uint16_t *weights = config.priority.weights;
+    printf("bytes sent in 200 ms by class low/normal/high: %llu/%llu/%llu, weights %u/%u/%u\n",
+           (unsigned long long)sent[0], (unsigned long long)sent[1], (unsigned long long)sent[2],
+           weights[0], weights[1], weights[2]);
+    TEST_ASSERT_TRUE(backlogged);
+    TEST_ASSERT_GREATER_THAN(0, sent[WS_PRIORITY_LOW]);
+    for (int priority = WS_PRIORITY_NORMAL; priority < WS_PRIORITY_COUNT; ++priority)
+    {
+        double ratio = static_cast<double>(sent[priority]) / sent[WS_PRIORITY_LOW];
+        double share = static_cast<double>(weights[priority]) / weights[WS_PRIORITY_LOW];
+        TEST_ASSERT_TRUE(ratio >= share * MIN_SHARE_RATIO);
+    }
+
+    // Stop before the clients close, while the server's sends into the full sockets still succeed.
+    ws_test_reset_callbacks();
+    TEST_ASSERT_EQUAL(ESP_OK, server.stop(0));
+    TEST_ASSERT_EQUAL(0, server.getMemoryStats().used);
+}
+
+TEST_CASE("priority weights of 0 or out of range are refused", "[scheduling]")
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    ws_server_config_t config = ws_test_config();
+    config.priority.weights[WS_PRIORITY_LOW] = 0;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, server.start(config));
+
+    config = ws_test_config();
+    config.scheduling.write_quantum = SIZE_MAX / 2;
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_ARG, server.start(config));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, server.stop());
+}
@@ -0,0 +1,63 @@
+/**
+ * @file test_server.cpp
+ * @brief Server fixture shared by the host tests.
+ *
+ * @author Daniel Giménez
+ * @date 2024-08-05
+ * @license MIT License
+ */
+
+#include "test_server.h"
+#include "ws_test_client.h"
+#include "unity.h"
+
+ws_server_config_t ws_test_config()
+{
+    ws_server_config_t config;
+    config.network = WS_NETWORK_EXTERNAL;
+    config.port = WS_TEST_PORT;
+    config.enable_ping_pong = false;
+    config.relief_delay = 0;
+    return config;
+}
+
+void ws_test_reset_callbacks()
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    server.onTextMessage(nullptr);
+    server.onBinaryMessage(nullptr);
+    server.onBinaryBuffer(nullptr, nullptr);
+    server.onPingMessage(nullptr);
+    server.onPongMessage(nullptr);
+    server.onCloseMessage(nullptr);
+    server.onCloseStatus(nullptr);
+    server.onClientConnected(nullptr);
+    server.onClientDisconnected(nullptr);
+    server.onConnectionOpened(nullptr);
+    server.onConnectionText(nullptr);
+    server.onConnectionBinary(nullptr);
+    server.onConnectionMessage(nullptr);
+    server.onConnectionClosed(nullptr);
+    server.onDrain(nullptr);
+    server.onServerReady(nullptr);
+}
+
+void ws_test_start_echo(const ws_server_config_t &config)
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    // A failed test returns before ws_test_stop() and leaves its server running.
+    server.stop();
+    ws_test_reset_callbacks();
+    server.onTextMessage([&server](int sock, const std::string &text)
+                         { server.sendTextMessage(sock, text); });
+    server.onBinaryMessage([&server](int sock, const std::vector<uint8_t> &data)
+                           { server.sendBinaryMessage(sock, data.data(), data.size()); });
+    TEST_ASSERT_EQUAL(ESP_OK, server.start(config));
+}
+
+void ws_test_stop()
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    TEST_ASSERT_EQUAL(ESP_OK, server.stop());
+    TEST_ASSERT_EQUAL(0, server.getMemoryStats().used);
+}
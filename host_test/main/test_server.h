@@ -0,0 +1,32 @@
+/**
+ * @file test_server.h
+ * @brief Server fixture shared by the host tests.
+ *
+ *@author Daniel Giménez
+ *@date 2024-08-05
+ */
+
+#pragma once
+
+#include "ws_light_server.h"
+
+/**
+ * @brief Configuration of a test server on loopback: no Wi-Fi, no pings, no relief delay.
+ */
+ws_server_config_t ws_test_config();
+
+/**
+ * @brief Clear every callback a previous test may have registered.
+ */
+void ws_test_reset_callbacks();
+
+/**
+ * @brief Start a server that echoes text and binary messages to their sender.
+ * @param config Server configuration, usually from ws_test_config().
+ */
+void ws_test_start_echo(const ws_server_config_t &config);
+
+/**
+ * @brief Stop the server and check that it returned every budgeted byte.
+ */
+void ws_test_stop();
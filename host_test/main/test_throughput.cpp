@@ -0,0 +1,200 @@
+/**
+ * @file test_throughput.cpp
+ * @brief Loopback throughput floors of the receive and send paths.
+ *
+ * The floors are a fraction of what a development machine reaches, low enough for a
+ * loaded CI runner and high enough to catch a per-byte or per-frame regression.
+ *
+ * @author Daniel Giménez
+ * @date 2024-08-05
+ * @license MIT License
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "esp_timer.h"
+#include "unity.h"
+#include "test_server.h"
+#include "ws_test_client.h"
+
+static const uint32_t MIN_SMALL_MESSAGES_PER_SEC = 5000; /**< Echoed 32-byte messages, pipelined */
+static const uint32_t MIN_BULK_KB_PER_SEC = 20 * 1024;   /**< Binary upload in 16 KiB frames */
+static const uint32_t MIN_RING_MESSAGES_PER_SEC = 20000; /**< 64-byte ring messages from four producer threads */
+
+TEST_CASE("small messages are echoed at a minimum rate", "[throughput]")
+{
+    ws_test_start_echo(ws_test_config());
+
+    WSTestClient client;
+    TEST_ASSERT_TRUE(client.connect());
+    const int total = 20000;
+    const int window = 64;
+    std::vector<uint8_t> message = WSTestClient::frame(0x2, std::vector<uint8_t>(32, 0x5A));
+    uint8_t opcode;
+    std::vector<uint8_t> payload;
+
+    int64_t start = esp_timer_get_time();
+    int sent = 0;
+    for (int received = 0; received < total; ++received)
+    {
+        // Keep a bounded number of messages in flight so neither side's socket buffer fills.
+        while (sent < total && sent - received < window)
+        {
+            TEST_ASSERT_TRUE(client.send_raw(message));
+            sent++;
+        }
+        TEST_ASSERT_TRUE(client.read_message(opcode, payload, 5000));
+        TEST_ASSERT_EQUAL(32, payload.size());
+    }
+    int64_t elapsed_us = esp_timer_get_time() - start;
+
+    uint32_t rate = static_cast<uint32_t>(total * 1000000LL / elapsed_us);
+    printf("small messages: %u per second\n", (unsigned)rate);
+    TEST_ASSERT_GREATER_OR_EQUAL(MIN_SMALL_MESSAGES_PER_SEC, rate);
+    client.close();
+    ws_test_stop();
+}
+
+TEST_CASE("bulk binary upload reaches a minimum rate", "[throughput]")
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    ws_server_config_t config = ws_test_config();
+    config.rx_buffer_size = 32 * 1024;
+    ws_test_start_echo(config);
+
+    size_t received = 0;
+    server.onBinaryMessage([&received](int, const std::vector<uint8_t> &data)
+                           { received += data.size(); });
+
+    WSTestClient client;
+    TEST_ASSERT_TRUE(client.connect());
+    const size_t frame_size = 16 * 1024;
+    const int frames = 2048;
+    std::vector<uint8_t> message = WSTestClient::frame(0x2, std::vector<uint8_t>(frame_size, 0xA5));
+
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < frames; ++i)
+    {
+        TEST_ASSERT_TRUE(client.send_raw(message));
+    }
+    // The echo of a text message marks the point where every binary frame was handled.
+    TEST_ASSERT_TRUE(client.send_raw(WSTestClient::frame(0x1, "done")));
+    uint8_t opcode;
+    std::vector<uint8_t> payload;
+    TEST_ASSERT_TRUE(client.read_message(opcode, payload, 10000));
+    int64_t elapsed_us = esp_timer_get_time() - start;
+
+    TEST_ASSERT_EQUAL(0x1, opcode);
+    TEST_ASSERT_EQUAL(frame_size * frames, received);
+    uint32_t kb_per_sec = static_cast<uint32_t>(received * 1000000ULL / 1024 / elapsed_us);
+    printf("bulk upload: %u KiB per second\n", (unsigned)kb_per_sec);
+    TEST_ASSERT_GREATER_OR_EQUAL(MIN_BULK_KB_PER_SEC, kb_per_sec);
+    client.close();
+    ws_test_stop();
+}
+
+/**
+ * @brief Send @p per_producer 64-byte messages to one session from @p producers threads.
+ * @param use_ring Reserve and commit in the outbound ring, or copy with sendBinaryMessage().
+ * @return Messages per second until the client read the last one, 0 if one was lost or reordered.
+ */
+static uint32_t produce_to_one_client(bool use_ring, int producers, uint32_t per_producer)
+{
+    WSLightServer &server = WSLightServer::getInstance();
+    std::atomic<ws_conn_handle_t> session(ws_conn_handle_t{});
+    server.onConnectionOpened([&session](ws_conn_handle_t handle) -> void *
+                              { session = handle; return nullptr; });
+    WSTestClient client;
+    TEST_ASSERT_TRUE(client.connect());
+    int64_t deadline = esp_timer_get_time() + 1000 * 1000;
+    while (session.load().generation == 0 && esp_timer_get_time() < deadline)
+    {
+        std::this_thread::yield();
+    }
+    ws_conn_handle_t handle = session;
+    TEST_ASSERT_NOT_EQUAL(0, handle.generation);
+
+    // Each message carries its producer and sequence number, so the reader checks per-producer order.
+    std::vector<std::thread> threads;
+    int64_t start = esp_timer_get_time();
+    for (int id = 0; id < producers; ++id)
+    {
+        threads.emplace_back([&server, handle, use_ring, id, per_producer]()
+                             {
+            uint8_t message[64] = {};
+            for (uint32_t sequence = 0; sequence < per_producer;)
+            {
+                message[0] = static_cast<uint8_t>(id);
+                memcpy(message + 1, &sequence, sizeof(sequence));
+                esp_err_t err;
+                if (use_ring)
+                {
+                    ws_tx_reservation_t reservation;
+                    err = server.reserveMessage(handle, sizeof(message), reservation);
+                    if (err == ESP_OK)
+                    {
+                        memcpy(reservation.data, message, sizeof(message));
+                        err = server.commitMessage(reservation, sizeof(message));
+                    }
+                }
+                else
+                {
+                    err = server.sendBinaryMessage(handle, message, sizeof(message));
+                }
+                if (err == ESP_OK)
+                {
+                    sequence++;
+                }
+                else
+                {
+                    // The ring or the budget is full until the server task catches up.
+                    std::this_thread::yield();
+                }
+            } });
+    }
+
+    std::vector<uint32_t> expected(producers, 0);
+    bool ordered = true;
+    ws_test_frame_t frame;
+    for (uint32_t received = 0; ordered && received < producers * per_producer; ++received)
+    {
+        uint32_t sequence;
+        ordered = client.read_frame(frame, 5000) && frame.payload.size() == 64 && frame.payload[0] < producers;
+        if (ordered)
+        {
+            memcpy(&sequence, frame.payload.data() + 1, sizeof(sequence));
+            ordered = sequence == expected[frame.payload[0]]++;
+        }
+    }
+    int64_t elapsed_us = esp_timer_get_time() - start;
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    client.close();
+    return ordered ? static_cast<uint32_t>(producers * per_producer * 1000000LL / elapsed_us) : 0;
+}
+
+TEST_CASE("ring producers on several threads reach a minimum rate", "[throughput]")
+{
+    ws_server_config_t config = ws_test_config();
+    config.tx_ring_size = 64 * 1024;
+    // Unbounded, so the copying path queues everything instead of shedding.
+    config.memory.budget = 0;
+    ws_test_start_echo(config);
+
+    const int producers = 4;
+    const uint32_t per_producer = 50000;
+    uint32_t ring_rate = produce_to_one_client(true, producers, per_producer);
+    uint32_t copy_rate = produce_to_one_client(false, producers, per_producer);
+    printf("%d producers: %u ring messages per second, %u copied with sendBinaryMessage()\n", producers,
+           (unsigned)ring_rate, (unsigned)copy_rate);
+    TEST_ASSERT_NOT_EQUAL(0, copy_rate);
+    TEST_ASSERT_GREATER_OR_EQUAL(MIN_RING_MESSAGES_PER_SEC, ring_rate);
+    ws_test_reset_callbacks();
+    ws_test_stop();
+}
@@ -0,0 +1,293 @@
+/**
+ * @file ws_test_client.cpp
+ * @brief WSTestClient implementation.
+ *
+ * @author Daniel Giménez
+ * @date 2024-08-05
+ * @license MIT License
+ */
+
+#include "ws_test_client.h"
+#include <errno.h>
+#include <algorithm>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <esp_timer.h>
+
+/** Sample nonce of RFC 6455, section 1.3, and the accept key the server must derive from it. */
+static const char *HANDSHAKE_KEY = "dGhlIHNhbXBsZSBub25jZQ==";
+static const char *HANDSHAKE_ACCEPT = "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=";
+
+WSTestClient::~WSTestClient()
+{
+    close();
+}
+
+bool WSTestClient::connect(uint16_t port, const std::string &extra_headers)
+{
+    close();
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        return false;
+    }
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (::connect(sock, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        close();
+        return false;
+    }
+
+    std::string request = "GET / HTTP/1.1\r\n"
+                          "Host: 127.0.0.1\r\n"
+                          "Upgrade: websocket\r\n"
+                          "Connection: Upgrade\r\n"
+                          "Sec-WebSocket-Key: " +
+                          std::string(HANDSHAKE_KEY) + "\r\n"
+                                                       "Sec-WebSocket-Version: 13\r\n" +
+                          extra_headers + "\r\n";
+    if (!send_raw(std::vector<uint8_t>(request.begin(), request.end())))
+    {
+        return false;
+    }
+
+    int64_t deadline = esp_timer_get_time() + 2000 * 1000;
+    std::string response;
+    size_t end;
+    while ((end = response.find("\r\n\r\n")) == std::string::npos)
+    {
+        if (!fill(buffer.size() + 1, deadline))
+        {
+            return false;
+        }
+        response.assign(buffer.begin(), buffer.end());
+    }
+    buffer.erase(buffer.begin(), buffer.begin() + end + 4);
+    response.resize(end);
+    return response.compare(0, 12, "HTTP/1.1 101") == 0 && response.find(HANDSHAKE_ACCEPT) != std::string::npos;
+}
+
+std::vector<uint8_t> WSTestClient::frame(uint8_t opcode, const std::vector<uint8_t> &payload, bool fin, bool masked)
+{
+    std::vector<uint8_t> out;
+    size_t length = payload.size();
+    out.push_back((fin ? 0x80 : 0x00) | (opcode & 0x0F));
+    uint8_t mask_bit = masked ? 0x80 : 0x00;
+    if (length <= 125)
+    {
+        out.push_back(mask_bit | static_cast<uint8_t>(length));
+    }
+    else if (length <= 65535)
+    {
+        out.push_back(mask_bit | 126);
+        out.push_back((length >> 8) & 0xFF);
+        out.push_back(length & 0xFF);
+    }
+    else
+    {
+        out.push_back(mask_bit | 127);
+        for (int i = 7; i >= 0; --i)
+        {
+            out.push_back((static_cast<uint64_t>(length) >> (i * 8)) & 0xFF);
+        }
+    }
+
+    uint8_t key[4] = {};
+    if (masked)
+    {
+        for (int i = 0; i < 4; ++i)
+        {
+            key[i] = static_cast<uint8_t>(rand());
+            out.push_back(key[i]);
+        }
+    }
+    for (size_t i = 0; i < length; ++i)
+    {
+        out.push_back(payload[i] ^ key[i % 4]);
+    }
+    return out;
+}
+
+std::vector<uint8_t> WSTestClient::frame(uint8_t opcode, const std::string &payload, bool fin)
+{
+    return frame(opcode, std::vector<uint8_t>(payload.begin(), payload.end()), fin);
+}
+
+bool WSTestClient::send_raw(const std::vector<uint8_t> &bytes)
+{
+    size_t sent = 0;
+    while (sock >= 0 && sent < bytes.size())
+    {
+        ssize_t len = send(sock, bytes.data() + sent, bytes.size() - sent, MSG_NOSIGNAL);
+        if (len < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (len <= 0)
+        {
+            return false;
+        }
+        sent += len;
+    }
+    return sock >= 0;
+}
+
+bool WSTestClient::send_slowly(const std::vector<uint8_t> &bytes, size_t chunk, uint32_t pause_ms)
+{
+    for (size_t offset = 0; offset < bytes.size(); offset += chunk)
+    {
+        size_t end = std::min(bytes.size(), offset + chunk);
+        if (!send_raw(std::vector<uint8_t>(bytes.begin() + offset, bytes.begin() + end)))
+        {
+            return false;
+        }
+        usleep(pause_ms * 1000);
+    }
+    return true;
+}
+
+bool WSTestClient::fill(size_t length, int64_t deadline_us)
+{
+    uint8_t chunk[4096];
+    while (buffer.size() < length)
+    {
+        int64_t remaining_ms = (deadline_us - esp_timer_get_time()) / 1000;
+        pollfd pfd = {sock, POLLIN, 0};
+        if (sock < 0 || remaining_ms <= 0 || poll(&pfd, 1, static_cast<int>(remaining_ms)) <= 0)
+        {
+            return false;
+        }
+        ssize_t len = recv(sock, chunk, sizeof(chunk), 0);
+        if (len < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (len <= 0)
+        {
+            return false;
+        }
+        buffer.insert(buffer.end(), chunk, chunk + len);
+    }
+    return true;
+}
+
+bool WSTestClient::read_frame(ws_test_frame_t &frame, uint32_t timeout_ms)
+{
+    int64_t deadline = esp_timer_get_time() + static_cast<int64_t>(timeout_ms) * 1000;
+    if (!fill(2, deadline))
+    {
+        return false;
+    }
+    if (buffer[1] & 0x80)
+    {
+        // Server frames must not be masked.
+        return false;
+    }
+    uint64_t length = buffer[1] & 0x7F;
+    size_t header_len = 2;
+    if (length == 126)
+    {
+        header_len = 4;
+    }
+    else if (length == 127)
+    {
+        header_len = 10;
+    }
+    if (!fill(header_len, deadline))
+    {
+        return false;
+    }
+    if (header_len > 2)
+    {
+        length = 0;
+        for (size_t i = 2; i < header_len; ++i)
+        {
+            length = (length << 8) | buffer[i];
+        }
+    }
+    if (!fill(header_len + length, deadline))
+    {
+        return false;
+    }
+
+    frame.fin = buffer[0] & 0x80;
+    frame.opcode = buffer[0] & 0x0F;
+    frame.header_len = header_len;
+    frame.payload.assign(buffer.begin() + header_len, buffer.begin() + header_len + length);
+    buffer.erase(buffer.begin(), buffer.begin() + header_len + length);
+    return true;
+}
+
+bool WSTestClient::read_message(uint8_t &opcode, std::vector<uint8_t> &payload, uint32_t timeout_ms)
+{
+    payload.clear();
+    ws_test_frame_t frame;
+    bool fragmented = false;
+    while (read_frame(frame, timeout_ms))
+    {
+        if (frame.opcode & 0x08)
+        {
+            if (fragmented)
+            {
+                // Control frames between fragments are not expected by the callers.
+                return false;
+            }
+            opcode = frame.opcode;
+            payload = std::move(frame.payload);
+            return true;
+        }
+        if (!fragmented)
+        {
+            opcode = frame.opcode;
+        }
+        payload.insert(payload.end(), frame.payload.begin(), frame.payload.end());
+        if (frame.fin)
+        {
+            return true;
+        }
+        fragmented = true;
+    }
+    return false;
+}
+
+bool WSTestClient::wait_closed(uint32_t timeout_ms)
+{
+    int64_t deadline = esp_timer_get_time() + static_cast<int64_t>(timeout_ms) * 1000;
+    uint8_t chunk[512];
+    while (sock >= 0)
+    {
+        int64_t remaining_ms = (deadline - esp_timer_get_time()) / 1000;
+        pollfd pfd = {sock, POLLIN, 0};
+        if (remaining_ms <= 0 || poll(&pfd, 1, static_cast<int>(remaining_ms)) <= 0)
+        {
+            return false;
+        }
+        ssize_t len = recv(sock, chunk, sizeof(chunk), 0);
+        if (len == 0 || (len < 0 && errno != EINTR))
+        {
+            return true;
+        }
+    }
+    return true;
+}
+
+void WSTestClient::close()
+{
+    if (sock >= 0)
+    {
+        ::close(sock);
+        sock = -1;
+    }
+    buffer.clear();
+}
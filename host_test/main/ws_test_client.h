@@ -0,0 +1,120 @@
+/**
+ * @file ws_test_client.h
+ * @brief Minimal blocking WebSocket client driving the server in host tests.
+ *
+ *@author Daniel Giménez
+ *@date 2024-08-05
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/** Port the host tests start the server on. */
+static constexpr uint16_t WS_TEST_PORT = 18080;
+
+/**
+ * @struct ws_test_frame_t
+ * @brief A frame read from the server, header fields kept for encoding checks.
+ */
+struct ws_test_frame_t
+{
+    bool fin = false;             /**< FIN bit */
+    uint8_t opcode = 0;           /**< Opcode */
+    size_t header_len = 0;        /**< Header bytes on the wire */
+    std::vector<uint8_t> payload; /**< Payload, the server never masks it */
+};
+
+/**
+ * @class WSTestClient
+ * @brief Opens a session over loopback and exchanges raw frames with the server.
+ */
+class WSTestClient
+{
+public:
+    WSTestClient() = default;
+    ~WSTestClient();
+    WSTestClient(const WSTestClient &) = delete;
+    WSTestClient &operator=(const WSTestClient &) = delete;
+
+    /**
+     * @brief Connect and complete the upgrade.
+     * @param port Server port.
+     * @param extra_headers Header lines appended to the request, each ending in CRLF.
+     * @return true once the server answered 101 with the expected accept key.
+     */
+    bool connect(uint16_t port = WS_TEST_PORT, const std::string &extra_headers = "");
+
+    /**
+     * @brief Encode a client frame.
+     * @param opcode Frame opcode.
+     * @param payload Payload.
+     * @param fin FIN bit.
+     * @param masked Mask the payload with a random key, as RFC 6455 requires of clients.
+     * @return The frame bytes.
+     */
+    static std::vector<uint8_t> frame(uint8_t opcode, const std::vector<uint8_t> &payload, bool fin = true, bool masked = true);
+
+    /**
+     * @brief Encode a client frame carrying text.
+     */
+    static std::vector<uint8_t> frame(uint8_t opcode, const std::string &payload, bool fin = true);
+
+    /**
+     * @brief Write bytes, all of them.
+     * @return false if the connection failed.
+     */
+    bool send_raw(const std::vector<uint8_t> &bytes);
+
+    /**
+     * @brief Write bytes in chunks with a pause in between, so the server sees partial frames.
+     * @param bytes Bytes to write.
+     * @param chunk Bytes per write.
+     * @param pause_ms Pause after each write.
+     * @return false if the connection failed.
+     */
+    bool send_slowly(const std::vector<uint8_t> &bytes, size_t chunk, uint32_t pause_ms);
+
+    /**
+     * @brief Read one frame.
+     * @param frame Receives the frame.
+     * @param timeout_ms Longest wait.
+     * @return false on timeout, on a malformed frame or once the server has closed the connection.
+     */
+    bool read_frame(ws_test_frame_t &frame, uint32_t timeout_ms = 2000);
+
+    /**
+     * @brief Read one control frame or one data message, reassembling fragments.
+     * @param opcode Receives the opcode, that of the first fragment for a fragmented message.
+     * @param payload Receives the payload.
+     * @param timeout_ms Longest wait for each frame.
+     * @return false on timeout, on a malformed frame or once the server has closed the connection.
+     */
+    bool read_message(uint8_t &opcode, std::vector<uint8_t> &payload, uint32_t timeout_ms = 2000);
+
+    /**
+     * @brief Wait for the server to close the TCP connection.
+     * @param timeout_ms Longest wait, bytes received meanwhile are dropped.
+     * @return true if the connection ended.
+     */
+    bool wait_closed(uint32_t timeout_ms = 2000);
+
+    /**
+     * @brief Close the socket without a close handshake.
+     */
+    void close();
+
+    /**
+     * @brief Socket of the client, -1 when closed.
+     */
+    int fd() const { return sock; }
+
+private:
+    bool fill(size_t length, int64_t deadline_us);
+
+    int sock = -1;                 /**< Client socket */
+    std::vector<uint8_t> buffer;   /**< Bytes read and not yet parsed */
+};
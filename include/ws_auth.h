@@ -0,0 +1,63 @@
+/**
+ * @file ws_auth.h
+ * @brief Token authentication of WebSocket upgrade requests.
+ *
+ *@author Daniel Giménez
+ *@date 2024-08-05
+ */
+
+#pragma once
+
+#include <string>
+#include "ws_config.h"
+
+/**
+ * @class WSAuthenticator
+ * @brief Checks the credentials carried by an HTTP upgrade request.
+ *
+ * The credential is read from an `Authorization: Bearer` header or from a
+ * query parameter of the request line. All comparisons take the same time
+ * whatever the number of matching characters.
+ */
+class WSAuthenticator
+{
+public:
+    /**
+     * @brief Set the authentication mode and secret.
+     * @param config Authentication configuration.
+     */
+    void configure(const ws_auth_config_t &config);
+
+    /**
+     * @brief Check whether authentication is required.
+     * @return true unless the mode is WS_AUTH_NONE.
+     */
+    bool enabled() const { return mode != WS_AUTH_NONE; }
+
+    /**
+     * @brief Validate an upgrade request.
+     * @param request HTTP request line and headers.
+     * @return true if the request carries a valid credential.
+     */
+    bool authorize(const std::string &request) const;
+
+private:
+    /**
+     * @brief Extract the credential from the header or the query string.
+     * @param request HTTP request line and headers.
+     * @return The credential, empty if none was sent.
+     */
+    std::string extract_credential(const std::string &request) const;
+
+    /**
+     * @brief Validate "<unix time>.<hex HMAC-SHA256(secret, unix time)>".
+     * @param credential Credential sent by the client.
+     * @return true if the signature matches and the time is within the allowed skew.
+     */
+    bool check_hmac(const std::string &credential) const;
+
+    ws_auth_mode_t mode = WS_AUTH_NONE;
+    std::string secret;
+    std::string query_param;
+    uint32_t max_clock_skew_s = 0;
+};
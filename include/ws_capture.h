@@ -0,0 +1,102 @@
+/**
+ * @file ws_capture.h
+ * @brief Lock-free ring recording inbound WebSocket traffic for later replay.
+ *
+ *@author Daniel Giménez
+ *@date 2024-08-05
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include "esp_err.h"
+
+/** First bytes of a capture file, written by the application before the ring contents. */
+#define WS_CAPTURE_MAGIC "WSCAP1\n"
+
+/**
+ * @enum ws_capture_kind_t
+ * @brief What a capture record describes.
+ */
+typedef enum {
+    WS_CAPTURE_OPEN  = 1,  /**< A session finished its handshake; no payload. */
+    WS_CAPTURE_DATA  = 2,  /**< Bytes read from the socket, still masked. */
+    WS_CAPTURE_CLOSE = 3   /**< The session ended; no payload. */
+} ws_capture_kind_t;
+
+/**
+ * @struct ws_capture_record_t
+ * @brief Header of one record, stored little-endian and unpadded (10 bytes) in the ring.
+ */
+typedef struct {
+    uint32_t time_us;  /**< esp_timer time since the ring was initialized, wraps after about 71 minutes. */
+    uint16_t conn;     /**< Connection slot. */
+    uint8_t kind;      /**< A ws_capture_kind_t. */
+    uint8_t reserved;  /**< Always 0. */
+    uint16_t length;   /**< Payload bytes following the header. */
+} ws_capture_record_t;
+
+/**
+ * @class WSCaptureRing
+ * @brief Single-producer, single-consumer byte ring of capture records.
+ *
+ * The server task is the only producer and never blocks: a record that does not
+ * fit is dropped and counted. One application task drains the ring with read()
+ * and stores the bytes, for example to a file behind WS_CAPTURE_MAGIC, for
+ * tools/ws_replay.py.
+ */
+class WSCaptureRing
+{
+public:
+    WSCaptureRing() = default;
+    ~WSCaptureRing();
+    WSCaptureRing(const WSCaptureRing &) = delete;
+    WSCaptureRing &operator=(const WSCaptureRing &) = delete;
+
+    /**
+     * @brief Allocate the ring and start the capture clock.
+     * @param capacity Ring size in bytes, a power of two.
+     * @return ESP_OK, ESP_ERR_INVALID_ARG or ESP_ERR_NO_MEM.
+     */
+    esp_err_t init(size_t capacity);
+
+    /**
+     * @brief Append a record; called by the server task only.
+     * @param conn Connection slot.
+     * @param kind Record kind.
+     * @param data Payload, split into several records past 65535 bytes.
+     * @param length Payload length.
+     * @return false if the ring was full and the record dropped.
+     */
+    bool record(uint16_t conn, ws_capture_kind_t kind, const uint8_t *data = nullptr, size_t length = 0);
+
+    /**
+     * @brief Take recorded bytes out of the ring; called by one consumer task.
+     * @param dest Destination.
+     * @param length Room in @p dest.
+     * @return Bytes copied, records may be split across calls.
+     */
+    size_t read(uint8_t *dest, size_t length);
+
+    /**
+     * @brief Bytes waiting to be read.
+     */
+    size_t pending() const;
+
+    /**
+     * @brief Records dropped because the ring was full.
+     */
+    uint32_t dropped() const { return dropped_records.load(std::memory_order_relaxed); }
+
+private:
+    void copy_in(size_t position, const uint8_t *data, size_t length);
+
+    uint8_t *buffer = nullptr;             /**< Ring storage */
+    size_t capacity = 0;                   /**< Ring size, a power of two */
+    std::atomic<size_t> head{0};           /**< Bytes ever written, published after each record */
+    std::atomic<size_t> tail{0};           /**< Bytes ever read */
+    std::atomic<uint32_t> dropped_records{0}; /**< Records that did not fit */
+    int64_t start_us = 0;                  /**< esp_timer time of init() */
+};
@@ -0,0 +1,151 @@
+/**
+ * @file ws_config.h
+ * @brief WSLightServer configuration structures.
+ *
+ *@author Daniel Giménez
+ *@date 2024-08-05
+ *
+ * This file contains the configuration passed to WSLightServer::start().
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <functional>
+#include "ws_types.h"
+
+#define MAX_MESSAGE_SIZE 1024
+
+class WSCaptureRing;
+class WSOutbox;
+
+/**
+ * @struct ws_rate_limit_config_t
+ * @brief Per-connection token buckets applied to inbound frames.
+ *
+ * Each frame costs one message token and one byte token per payload byte.
+ * A rate of 0 disables the corresponding bucket. Close frames are never limited.
+ */
+struct ws_rate_limit_config_t
+{
+    uint32_t messages_per_sec = 0;                    /**< Sustained inbound frames per second */
+    uint32_t message_burst = 0;                       /**< Message bucket capacity (defaults to messages_per_sec) */
+    uint32_t bytes_per_sec = 0;                       /**< Sustained inbound payload bytes per second */
+    uint32_t byte_burst = 0;                          /**< Byte bucket capacity (defaults to bytes_per_sec) */
+    ws_rate_limit_action_t action = WS_RATE_LIMIT_DELAY; /**< What to do with frames over the limit */
+};
+
+/**
+ * @struct ws_memory_config_t
+ * @brief Server-wide budget for receive, reassembly and outbound buffers.
+ */
+struct ws_memory_config_t
+{
+    size_t budget = 0;               /**< Bytes all connection buffers may reserve together, 0 for unlimited */
+    uint8_t shed_threshold_pct = 90; /**< Usage above which the largest outbound queue is shed */
+};
+
+/**
+ * @struct ws_auth_config_t
+ * @brief Authentication checked during the upgrade, before any connection buffer is allocated.
+ *
+ * The credential is taken from an `Authorization: Bearer <credential>` header or from
+ * the query parameter named by @ref query_param, and must be URL safe. HMAC mode
+ * needs the system time to be set, e.g. by SNTP.
+ */
+struct ws_auth_config_t
+{
+    ws_auth_mode_t mode = WS_AUTH_NONE; /**< Authentication mode */
+    const char *token = nullptr;        /**< Shared token, or HMAC key in WS_AUTH_HMAC mode; required unless mode is WS_AUTH_NONE */
+    const char *query_param = "token";  /**< Query parameter holding the credential */
+    uint32_t max_clock_skew_s = 300;    /**< Accepted age of an HMAC timestamp in seconds */
+};
+
+/**
+ * @struct ws_socket_config_t
+ * @brief TCP options applied to the listening socket and every accepted client socket.
+ *
+ * A value of 0 leaves the lwIP default. lwIP ignores SO_SNDBUF, and honours
+ * SO_RCVBUF only with CONFIG_LWIP_SO_RCVBUF enabled.
+ */
+struct ws_socket_config_t
+{
+    bool nodelay = true;             /**< Disable Nagle so small frames are not held back waiting for an ACK */
+    int send_buffer = 0;             /**< SO_SNDBUF in bytes */
+    int recv_buffer = 0;             /**< SO_RCVBUF in bytes */
+    bool keepalive = false;          /**< Enable TCP keepalive probes */
+    int keepalive_idle_s = 7200;     /**< Idle time before the first probe */
+    int keepalive_interval_s = 75;   /**< Time between probes */
+    int keepalive_count = 9;         /**< Unanswered probes before the connection is dropped */
+    int listen_backlog = 128;        /**< Pending connections queued by listen() */
+};
+
+/**
+ * @struct ws_scheduling_config_t
+ * @brief Deficit round robin budgets shared out between ready connections.
+ *
+ * Every pass of the server loop starts at the next slot and credits each ready
+ * connection with one quantum; a connection reads or writes at most its credit,
+ * and credit left over is dropped once it runs out of work. 0 means unlimited.
+ */
+struct ws_scheduling_config_t
+{
+    size_t read_quantum = 2048;  /**< Bytes a connection may read per pass */
+    size_t write_quantum = 4096; /**< Bytes a connection may write per pass */
+};
+
+/**
+ * @struct ws_priority_config_t
+ * @brief Weighted fair queuing between outbound priority classes.
+ *
+ * Each pass the write quantum of a class is the scheduling write_quantum times its
+ * weight, split evenly between its writable connections, so a class keeps its share
+ * however many clients it has. Has no effect while write_quantum is 0, and the
+ * weights only decide the split while write_quantum is small next to the socket
+ * send buffer; otherwise TCP shares the link between full buffers evenly.
+ */
+struct ws_priority_config_t
+{
+    uint16_t weights[WS_PRIORITY_COUNT] = {1, 2, 4};          /**< Relative share of each class, indexed by ws_priority_t, at least 1 */
+    ws_priority_t default_class = WS_PRIORITY_NORMAL;      /**< Class of newly opened connections */
+};
+
+/**
+ * @struct ws_server_config_t
+ * @brief Configuration for WSLightServer::start().
+ */
+struct ws_server_config_t
+{
+    ws_network_mode_t network = WS_NETWORK_SOFTAP; /**< Whether start() brings up a SoftAP */
+    const char *ssid = "default_ssid";         /**< WiFi SSID */
+    const char *password = "default_password"; /**< WiFi password */
+    uint16_t port = 80;                        /**< Server port */
+    uint64_t ping_interval_ms = 30000;         /**< Interval for sending ping messages to client in milliseconds */
+    uint64_t max_inactivity_ms = 60000;        /**< Silence after which a client is closed, 0 to disable; open sessions only while ping/pong is enabled */
+    bool enable_ping_pong = true;              /**< Flag to enable ping messages to client */
+    std::function<void()> extra_config;        /**< Extra configuration callback */
+    ws_run_mode_t run_mode = WS_RUN_TASK;      /**< Whether start() creates the server task or the application polls */
+    uint32_t stack = 10024;                    /**< Stack size of the client handler task */
+    size_t relief_delay = 1;                   /**< Delay in milliseconds between handled messages */
+    uint32_t close_linger_ms = 1000;           /**< Time a closing connection waits for the client's close frame */
+    uint32_t timer_slack_ms = 10;              /**< Deadlines are rounded up to this grid so nearby ones share a wakeup */
+    uint8_t max_connections = 1;               /**< Maximum simultaneous clients, further upgrades get HTTP 503 */
+    size_t rx_buffer_size = MAX_MESSAGE_SIZE;  /**< Largest receive buffer of a connection, bounds the inbound frame size */
+    size_t rx_message_max = 0;                 /**< Largest message reassembled from inbound fragments, larger ones close with 1009; 0 for rx_buffer_size */
+    size_t rx_buffer_initial = 256;            /**< Receive buffer of a new connection, doubled up to rx_buffer_size when reads fill it */
+    uint32_t rx_buffer_shrink_ms = 5000;       /**< Quiet time after which a grown receive buffer returns to rx_buffer_initial */
+    uint8_t rx_digest = WS_DIGEST_NONE;        /**< ws_rx_digest_t flags computed over binary messages in the unmasking pass, see getMessageDigest() */
+    size_t tx_fragment_size = MAX_MESSAGE_SIZE; /**< Outbound messages above this go out as fragments of this size, 0 sends them whole up to MAX_MESSAGE_SIZE */
+    size_t tx_ring_size = 0;                   /**< Outbound ring of each slot for reserveMessage(), a power of two of at least 64, 0 to disable */
+    bool isr_submission = false;               /**< Open the eventfd sendBinaryMessageFromISR() wakes the server task with; needs tx_ring_size */
+    size_t tx_low_watermark = 1024;            /**< onDrain fires when a connection's unsent bytes fall from above this to at most this */
+    ws_rate_limit_config_t rate_limit;         /**< Inbound rate limiting */
+    ws_memory_config_t memory;                 /**< Connection buffers budget */
+    ws_auth_config_t auth;                     /**< Upgrade authentication */
+    ws_socket_config_t socket;                 /**< TCP options of the listening and client sockets */
+    ws_scheduling_config_t scheduling;         /**< Per-connection read and write budgets */
+    ws_priority_config_t priority;             /**< Outbound bandwidth shares of the priority classes */
+    WSCaptureRing *capture = nullptr;          /**< Ring recording inbound traffic after the handshake, must outlive the server; nullptr to disable */
+    WSOutbox *outbox = nullptr;                /**< Keeps broadcasts while no client is connected and drains them to the next one, must outlive the server; nullptr to disable */
+};
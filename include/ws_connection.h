@@ -0,0 +1,100 @@
+/**
+ * @file ws_connection.h
+ * @brief Per-connection state of WSLightServer.
+ *
+ *@author Daniel Giménez
+ *@date 2024-08-05
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+#include <mbedtls/sha256.h>
+#include "ws_types.h"
+#include "ws_token_bucket.h"
+
+/**
+ * @enum ws_conn_state_t
+ * @brief Lifecycle of a connection slot.
+ */
+typedef enum {
+    WS_CONN_FREE      = 0,  /**< Slot unused. */
+    WS_CONN_HANDSHAKE = 1,  /**< Waiting for the HTTP upgrade request. */
+    WS_CONN_OPEN      = 2,  /**< WebSocket session established. */
+    WS_CONN_CLOSING   = 3   /**< Close frame queued, waiting for the other side or the linger deadline. */
+} ws_conn_state_t;
+
+/**
+ * @enum ws_frame_route_t
+ * @brief Where the payload of an inbound frame goes, decided from its header alone.
+ */
+typedef enum {
+    WS_ROUTE_BUFFER  = 0,  /**< The frame fits the receive buffer and is decoded from there. */
+    WS_ROUTE_DIRECT  = 1,  /**< The payload is read from the socket straight into its message buffer. */
+    WS_ROUTE_DISCARD = 2,  /**< The payload is skipped without being stored. */
+    WS_ROUTE_CLOSE   = 3   /**< The header breaks the protocol or a limit; the connection is closed. */
+} ws_frame_route_t;
+
+/**
+ * @struct ws_connection_t
+ * @brief Buffers and bookkeeping of one client connection.
+ */
+struct ws_connection_t
+{
+    int sock = -1;                         /**< Client socket */
+    ws_conn_state_t state = WS_CONN_FREE;  /**< Slot state */
+    uint16_t generation = 0;               /**< Generation of the handle of the open session, 0 otherwise */
+    void *user_data = nullptr;             /**< Application pointer attached to the session */
+
+    uint8_t *rx_buffer = nullptr;          /**< Receive buffer */
+    size_t rx_capacity = 0;                /**< Receive buffer size */
+    size_t rx_len = 0;                     /**< Bytes waiting in the receive buffer */
+    int64_t rx_last_busy_us = 0;           /**< esp_timer time a read last filled the buffer */
+    int64_t rx_last_activity_us = 0;       /**< esp_timer time the client was last heard from */
+    uint64_t discard_remaining = 0;        /**< Bytes of a dropped frame still to skip */
+    bool frame_admitted = false;           /**< Frame at the head of the buffer passed rate limiting */
+    bool rx_drop_message = false;          /**< The rest of a message dropped by rate limiting is skipped */
+
+    uint8_t *sink_message = nullptr;       /**< Message buffer of the frame being read directly, nullptr for fragments */
+    uint8_t *sink_dest = nullptr;          /**< Payload destination of the frame being read directly, nullptr if none */
+    uint64_t sink_length = 0;              /**< Payload length of that frame */
+    uint64_t sink_received = 0;            /**< Payload bytes of that frame received so far */
+    uint8_t sink_mask[4] = {};             /**< Masking key of that frame */
+    ws_type_t sink_type = HTTPD_WS_TYPE_CONTINUE; /**< Opcode of that frame */
+    bool sink_fin = false;                 /**< FIN bit of that frame */
+    bool sink_app = false;                 /**< sink_dest was provided by the application */
+    bool frame_delayed = false;            /**< Frame at the head of the buffer waited for tokens */
+    int64_t rx_paused_until_us = 0;        /**< Reads suspended until this esp_timer time */
+    int64_t close_deadline_us = 0;         /**< Linger deadline of a closing connection */
+    bool close_received = false;           /**< The client's close frame has arrived */
+
+    uint32_t rx_crc32 = 0;                 /**< CRC-32 of the binary message being received */
+    mbedtls_sha256_context *rx_sha256 = nullptr; /**< SHA-256 of it, allocated when rx_digest asks for one */
+    uint8_t rx_sha256_result[32] = {};     /**< SHA-256 of the last binary message once it has ended */
+    uint64_t rx_digest_length = 0;         /**< Payload bytes covered by the checksums */
+    bool rx_digest_complete = false;       /**< The checksummed message has ended */
+
+    uint8_t *fragment_data = nullptr;      /**< Reassembly buffer of a fragmented message */
+    size_t fragment_length = 0;            /**< Bytes in the reassembly buffer */
+    size_t fragment_capacity = 0;          /**< Size of the reassembly buffer, reserved against the memory budget */
+    ws_type_t fragment_type = HTTPD_WS_TYPE_CONTINUE; /**< Type of the message being reassembled */
+
+    std::deque<std::vector<uint8_t>> tx_queue; /**< Encoded frames waiting to be sent */
+    size_t tx_offset = 0;                  /**< Bytes of the head frame already sent */
+    size_t tx_queued_bytes = 0;            /**< Bytes reserved by tx_queue */
+    size_t tx_ring_offset = 0;             /**< Bytes of the outbound ring's head frame already sent */
+    size_t tx_urgent = 0;                  /**< Pings and pongs queued right behind the head frame */
+    size_t tx_fragment_size = 0;           /**< Largest outbound frame payload, 0 to send messages whole */
+    bool tx_drain_pending = false;         /**< Unsent bytes went above tx_low_watermark since the last onDrain */
+
+    ws_priority_t priority = WS_PRIORITY_NORMAL; /**< Outbound traffic class */
+
+    size_t rx_deficit = 0;                 /**< Bytes this connection may still read in the current round */
+    size_t tx_deficit = 0;                 /**< Bytes this connection may still write in the current round */
+
+    WSTokenBucket message_bucket;          /**< Inbound frames bucket */
+    WSTokenBucket byte_bucket;             /**< Inbound payload bytes bucket */
+};
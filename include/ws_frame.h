@@ -0,0 +1,64 @@
+/**
+ * @file ws_frame.h
+ * @brief Encoding of outbound WebSocket frame headers.
+ *
+ *@author Daniel Giménez
+ *@date 2024-08-05
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "ws_types.h"
+
+/** Longest header of an unmasked frame, with a 64-bit payload length. */
+static constexpr size_t WS_FRAME_HEADER_MAX = 10;
+
+/**
+ * @brief Get the header length of an unmasked frame.
+ * @param length Payload length.
+ * @return 2, 4 or 10 bytes for the 7-bit, 16-bit and 64-bit length encodings.
+ */
+inline size_t ws_frame_header_size(size_t length)
+{
+    return length <= 125 ? 2 : (length <= 65535 ? 4 : WS_FRAME_HEADER_MAX);
+}
+
+/**
+ * @brief Write an unmasked frame header ending right before its payload.
+ *
+ * Every outbound frame is encoded here, whether into a new vector, a receive
+ * buffer being forwarded or an outbound ring record.
+ *
+ * @param end Where the payload starts; ws_frame_header_size() bytes before it are written.
+ * @param length Payload length.
+ * @param type Frame opcode.
+ * @param fin Whether this is the last frame of the message.
+ * @return Header length.
+ */
+inline size_t ws_write_frame_header(uint8_t *end, size_t length, ws_type_t type, bool fin = true)
+{
+    size_t header_len = ws_frame_header_size(length);
+    uint8_t *header = end - header_len;
+    header[0] = (fin ? 0x80 : 0x00) | (type & 0x0F);
+    if (length <= 125)
+    {
+        header[1] = static_cast<uint8_t>(length);
+    }
+    else if (length <= 65535)
+    {
+        header[1] = 126;
+        header[2] = (length >> 8) & 0xFF;
+        header[3] = length & 0xFF;
+    }
+    else
+    {
+        header[1] = 127;
+        for (int i = 0; i < 8; ++i)
+        {
+            header[2 + i] = (static_cast<uint64_t>(length) >> ((7 - i) * 8)) & 0xFF;
+        }
+    }
+    return header_len;
+}
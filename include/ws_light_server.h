@@ -37,15 +37,21 @@
 
 #include <esp_event.h>
 #include <esp_log.h>
-#include <esp_wifi.h>
 #include <lwip/sockets.h>
 #include <string>
 #include <vector>
 #include <functional>
+#include <atomic>
 #include "ws_types.h"
-#include "freertos/timers.h"
-
-#define MAX_MESSAGE_SIZE 1024
+#include "ws_config.h"
+#include "ws_connection.h"
+#include "ws_memory_governor.h"
+#include "ws_auth.h"
+#include "ws_capture.h"
+#include "ws_outbox.h"
+#include "ws_tx_ring.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
 
 /**
  * @struct ws_message_t
@@ -94,6 +100,74 @@ public:
                     uint32_t stack = 10024,
                     size_t relief_delay = 1);
 
+    /**
+     * @brief Start the WebSocket server from a configuration structure.
+     *
+     * With WS_NETWORK_SOFTAP the socket is bound before the access point is
+     * started, so the server listens while Wi-Fi comes up. With
+     * WS_NETWORK_EXTERNAL the application must have called esp_netif_init()
+     * and brings up station, Ethernet or its own AP whenever it likes.
+     * Returns once the server is listening.
+     * @param config Server configuration.
+     * @return ESP_OK on success, an error code otherwise.
+     */
+    esp_err_t start(const ws_server_config_t &config);
+
+    /**
+     * @brief Stop the server and free every buffer, timer and task it owns.
+     *
+     * Open connections receive a close frame with status 1001 and queued frames
+     * are flushed until @p drain_timeout_ms elapses. The network stays up.
+     * Must not be called from a server callback. In WS_RUN_POLLED mode the drain
+     * runs in the caller, which must be the task that polls.
+     * @param drain_timeout_ms Time allowed for queued frames to be sent.
+     * @return ESP_OK on success, ESP_ERR_INVALID_STATE if the server is not running.
+     */
+    esp_err_t stop(uint32_t drain_timeout_ms = 1000);
+
+    /**
+     * @brief Stop the server and start it again with a new configuration.
+     *
+     * The network brought up by the first start() is reused, so only the
+     * listening socket is rebound. Returns once the server is listening.
+     * @param config New server configuration; network fields are ignored.
+     * @param drain_timeout_ms Time allowed for queued frames to be sent before stopping.
+     * @return ESP_OK on success, an error code otherwise.
+     */
+    esp_err_t restart(const ws_server_config_t &config, uint32_t drain_timeout_ms = 1000);
+
+    /**
+     * @brief Serve the server once in WS_RUN_POLLED mode.
+     *
+     * Waits up to @p timeout_ms for socket activity, then does all accept, read,
+     * dispatch, write and timer work that is due, callbacks included, in the
+     * caller. Call it from one task only, in a loop, at least every ping or close
+     * deadline; a shorter wait is used when a deadline comes sooner.
+     * @param timeout_ms Longest wait in milliseconds, 0 to only serve what is ready.
+     * @return ESP_OK, or ESP_ERR_INVALID_STATE if the server is not running polled.
+     */
+    esp_err_t poll(uint32_t timeout_ms);
+
+    /**
+     * @brief Add the server's descriptors to the application's own select() sets.
+     *
+     * For loops that already wait in select(): call this, wait, then pass the
+     * resulting sets to pollDispatch(). Neither set is cleared.
+     * @param read_fds Read set to add to.
+     * @param write_fds Write set to add to.
+     * @param timeout_ms Lowered to the time left until the server's next deadline.
+     * @return Highest descriptor added, -1 if the server is not running polled.
+     */
+    int pollPrepare(fd_set *read_fds, fd_set *write_fds, uint32_t *timeout_ms);
+
+    /**
+     * @brief Serve the descriptors select() reported after pollPrepare().
+     * @param read_fds Read set returned by select().
+     * @param write_fds Write set returned by select().
+     * @return ESP_OK, or ESP_ERR_INVALID_STATE if the server is not running polled.
+     */
+    esp_err_t pollDispatch(const fd_set *read_fds, const fd_set *write_fds);
+
     /**
      * @brief Set the callback for handling text messages.
      * @param callback Function to handle text messages.
@@ -106,6 +180,24 @@ public:
      */
     void onBinaryMessage(std::function<void(int, const std::vector<uint8_t> &)> callback);
 
+    /**
+     * @brief Let the application receive whole binary messages into its own buffers.
+     *
+     * For every unfragmented binary frame, @p provider is called with the client socket and the
+     * payload length: as soon as the header has arrived for frames larger than the receive buffer,
+     * once the frame is buffered for the others. A buffer it returns receives the payload straight
+     * from the socket, bypassing rx_buffer_size and the memory budget, and is handed back through
+     * @p complete instead of onBinaryMessage. Returning nullptr keeps the normal path, where small
+     * messages are unmasked in place and can be lent to onConnectionMessage.
+     *
+     * @param provider Returns a buffer of at least the given length, or nullptr.
+     * @param complete Called with the client socket, the buffer, the bytes received and ESP_OK,
+     *                 or ESP_FAIL if the connection ended before the payload was complete. Required
+     *                 with a provider; without it neither is registered.
+     */
+    void onBinaryBuffer(std::function<uint8_t *(int, size_t)> provider,
+                        std::function<void(int, uint8_t *, size_t, esp_err_t)> complete);
+
     /**
      * @brief Set the callback for handling ping messages.
      * @param callback Function to handle ping messages.
@@ -124,6 +216,12 @@ public:
      */
     void onCloseMessage(std::function<void(int)> callback);
 
+    /**
+     * @brief Set the callback receiving the status of client close frames.
+     * @param callback Function taking the client socket, the close code (1005 if none) and the reason.
+     */
+    void onCloseStatus(std::function<void(int, uint16_t, const std::string &)> callback);
+
     /**
      * @brief Set the callback for handling client connections.
      * @param callback Function to handle client connections.
@@ -137,20 +235,306 @@ public:
     void onClientDisconnected(std::function<void(int)> callback);
 
     /**
-     * @brief Send a text message to the client.
+     * @brief Set the callback opening a session, called after onClientConnected.
+     * @param callback Function taking the handle of the new session and returning the user data
+     *                 attached to it, passed back to the other handle callbacks (may be nullptr).
+     */
+    void onConnectionOpened(std::function<void *(ws_conn_handle_t)> callback);
+
+    /**
+     * @brief Set the callback for text messages of a session.
+     * @param callback Function taking the session handle, its user data and the message.
+     */
+    void onConnectionText(std::function<void(ws_conn_handle_t, void *, const std::string &)> callback);
+
+    /**
+     * @brief Set the callback for binary messages of a session.
+     * @param callback Function taking the session handle, its user data and the message.
+     */
+    void onConnectionBinary(std::function<void(ws_conn_handle_t, void *, const std::vector<uint8_t> &)> callback);
+
+    /**
+     * @brief Set the callback lending text and binary messages of a session without copying them.
+     *
+     * The message points into the receive buffer and is valid until the callback returns;
+     * pass it to forwardMessage() to echo or relay it. Called after onConnectionText and
+     * onConnectionBinary, which copy the message, so set only this one to avoid copies.
+     *
+     * @param callback Function taking the session handle, its user data and the message.
+     */
+    void onConnectionMessage(std::function<void(ws_conn_handle_t, void *, const ws_message_view_t &)> callback);
+
+    /**
+     * @brief Set the callback ending a session, the last chance to release its user data.
+     * @param callback Function taking the session handle and its user data.
+     */
+    void onConnectionClosed(std::function<void(ws_conn_handle_t, void *)> callback);
+
+    /**
+     * @brief Set the callback pacing producers on the outbound queues.
+     *
+     * Called from the server task with the client socket when its unsent bytes drop to
+     * ws_server_config_t::tx_low_watermark or less, once per crossing from above.
+     *
+     * @param callback Function taking the client socket.
+     */
+    void onDrain(std::function<void(int)> callback);
+
+    /**
+     * @brief Set the callback invoked from the server task once the socket is listening.
+     * @param callback Function to call when the server is ready.
+     */
+    void onServerReady(std::function<void()> callback);
+
+    /**
+     * @brief Send a text message to every connected client.
+     *
+     * With an outbox configured, the message is stored while no client is connected, or
+     * while the outbox is draining to a client, which then gets it behind the stored ones.
+     * A message no client could take is refused rather than stored.
+     *
      * @param text The text message to send.
-     * @return ESP_OK on success, an error code otherwise.
+     * @return ESP_OK on success, ESP_ERR_INVALID_SIZE if a message to store is over MAX_MESSAGE_SIZE
+     *         with tx_fragment_size 0 or over the memory budget, an error code otherwise.
      */
     esp_err_t sendTextMessage(const std::string &text);
 
     /**
-     * @brief Send a binary message to the client.
+     * @brief Send a text message to one client.
+     * @param client_sock Socket of the client.
+     * @param text The text message to send.
+     * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the client is gone, an error code otherwise.
+     */
+    esp_err_t sendTextMessage(int client_sock, const std::string &text);
+
+    /**
+     * @brief Send a binary message to every connected client, stored like sendTextMessage() with an outbox.
      * @param data The binary data to send.
      * @param length The length of the binary data.
      * @return ESP_OK on success, an error code otherwise.
      */
     esp_err_t sendBinaryMessage(const uint8_t *data, size_t length);
 
+    /**
+     * @brief Send a binary message to one client.
+     * @param client_sock Socket of the client.
+     * @param data The binary data to send.
+     * @param length The length of the binary data.
+     * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the client is gone, an error code otherwise.
+     */
+    esp_err_t sendBinaryMessage(int client_sock, const uint8_t *data, size_t length);
+
+    /**
+     * @brief Send a text message to one session.
+     * @param handle Session handle.
+     * @param text The text message to send.
+     * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the session has ended, an error code otherwise.
+     */
+    esp_err_t sendTextMessage(ws_conn_handle_t handle, const std::string &text);
+
+    /**
+     * @brief Send a binary message to one session.
+     * @param handle Session handle.
+     * @param data The binary data to send.
+     * @param length The length of the binary data.
+     * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the session has ended, an error code otherwise.
+     */
+    esp_err_t sendBinaryMessage(ws_conn_handle_t handle, const uint8_t *data, size_t length);
+
+    /**
+     * @brief Get the bytes queued for one client and not yet handed to the socket.
+     * @param client_sock Socket of the client.
+     * @return Unsent bytes, 0 if the client is not connected.
+     */
+    size_t bufferedAmount(int client_sock);
+
+    /**
+     * @brief Get the bytes queued for one session and not yet handed to the socket.
+     * @param handle Session handle.
+     * @return Unsent bytes, 0 if the session has ended.
+     */
+    size_t bufferedAmount(ws_conn_handle_t handle);
+
+    /**
+     * @brief Get the unsent bytes of the most backed-up client, for pacing broadcasts.
+     * @return Largest bufferedAmount() over the open connections.
+     */
+    size_t bufferedAmount();
+
+    /**
+     * @brief Send a received message to a session, for echo and relay.
+     *
+     * Called from onConnectionMessage with the message it was lent, the payload is sent
+     * from the receive buffer behind a header written in place of the client's, with
+     * no copy or allocation, when the destination has nothing queued. Whatever the
+     * socket does not take is queued as a copy. Otherwise, or for a message that is
+     * not being delivered, or one that must be fragmented, it behaves like
+     * sendTextMessage() or sendBinaryMessage().
+     *
+     * @param message Message from onConnectionMessage.
+     * @param handle Destination session, the sender or any other.
+     * @return ESP_OK, ESP_ERR_NOT_FOUND if the session has ended, an error code otherwise.
+     */
+    esp_err_t forwardMessage(const ws_message_view_t &message, ws_conn_handle_t handle);
+
+    /**
+     * @brief Reserve room for a message inside the outbound ring of a session.
+     *
+     * The payload is written in place at reservation.data and sent from there after
+     * commitMessage(), without being copied. Reserving and committing take no lock, so
+     * any number of tasks may produce for the same session between start() and stop().
+     * Ring messages keep their order among themselves but not against sendTextMessage()
+     * or sendBinaryMessage(); a reservation left open holds back later ring messages,
+     * and stop() or restart() until it is committed or cancelled.
+     *
+     * @param handle Session handle.
+     * @param length Payload bytes to reserve.
+     * @param reservation Filled with the reserved room.
+     * @return ESP_OK, ESP_ERR_NOT_SUPPORTED if ws_server_config_t::tx_ring_size is 0 or the server is stopped,
+     *         ESP_ERR_NOT_FOUND if the session has ended, ESP_ERR_INVALID_SIZE if the message
+     *         can never fit the ring, ESP_ERR_NO_MEM if the ring is full for now.
+     */
+    esp_err_t reserveMessage(ws_conn_handle_t handle, size_t length, ws_tx_reservation_t &reservation);
+
+    /**
+     * @brief Hand a reserved message to the server task for sending.
+     * @param reservation Reservation from reserveMessage().
+     * @param length Payload bytes written, at most reservation.length.
+     * @param type HTTPD_WS_TYPE_TEXT or HTTPD_WS_TYPE_BINARY.
+     * @return ESP_OK, or ESP_ERR_INVALID_ARG for a bad length, type or reservation.
+     */
+    esp_err_t commitMessage(ws_tx_reservation_t &reservation, size_t length, ws_type_t type = HTTPD_WS_TYPE_BINARY);
+
+    /**
+     * @brief Give a reservation back without sending it.
+     * @param reservation Reservation from reserveMessage().
+     */
+    void cancelMessage(ws_tx_reservation_t &reservation);
+
+    /**
+     * @brief Send a binary message from an interrupt handler.
+     *
+     * The payload is copied into the session's outbound ring, which is allocated at
+     * start(), and the server task is woken through an eventfd written from the ISR and a
+     * task notification that cuts its relief delay short, so no relay queue or task sits
+     * between the interrupt and the socket. Nothing here
+     * blocks, allocates or logs; keep payloads short, as the copy runs in the ISR.
+     * Requires ws_server_config_t::isr_submission. Not for ISRs registered with
+     * ESP_INTR_FLAG_IRAM, since the code runs from flash. On a host build it may be
+     * called from a signal handler.
+     *
+     * @param handle Session handle.
+     * @param data Payload.
+     * @param length Payload length.
+     * @return ESP_OK, ESP_ERR_INVALID_STATE if ISR submission is not running,
+     *         ESP_ERR_NOT_FOUND if the session has ended, ESP_ERR_INVALID_SIZE if the
+     *         message can never fit the ring, ESP_ERR_NO_MEM if the ring is full for now.
+     */
+    esp_err_t sendBinaryMessageFromISR(ws_conn_handle_t handle, const uint8_t *data, size_t length);
+
+    /**
+     * @brief Get the handle of the session on a socket.
+     * @param client_sock Socket of the client.
+     * @return The handle, zero-initialized if the socket has no open session.
+     */
+    ws_conn_handle_t getConnectionHandle(int client_sock);
+
+    /**
+     * @brief Replace the user data of a session.
+     * @param handle Session handle.
+     * @param user_data New pointer, owned by the application.
+     * @return ESP_OK, or ESP_ERR_NOT_FOUND if the session has ended.
+     */
+    esp_err_t setUserData(ws_conn_handle_t handle, void *user_data);
+
+    /**
+     * @brief Get the user data of a session in constant time.
+     * @param handle Session handle.
+     * @return The pointer, or nullptr if the session has ended.
+     */
+    void *getUserData(ws_conn_handle_t handle);
+
+    /**
+     * @brief Get the checksums selected by rx_digest for the binary message of a client.
+     *
+     * They are computed while the payload is unmasked, so the application needs no second
+     * pass over it. Inside onBinaryMessage, onConnectionBinary, onConnectionMessage or the
+     * complete callback of onBinaryBuffer they cover the whole message just received; while
+     * a message is still arriving they cover the bytes received so far.
+     *
+     * @param client_sock Socket of the client.
+     * @param digest Receives the checksums.
+     * @return ESP_OK, ESP_ERR_NOT_SUPPORTED if rx_digest is WS_DIGEST_NONE or ESP_ERR_NOT_FOUND if the client is not connected.
+     */
+    esp_err_t getMessageDigest(int client_sock, ws_message_digest_t &digest);
+
+    /**
+     * @brief Get the checksums selected by rx_digest for the binary message of a session.
+     * @param handle Session handle.
+     * @param digest Receives the checksums.
+     * @return ESP_OK, ESP_ERR_NOT_SUPPORTED if rx_digest is WS_DIGEST_NONE or ESP_ERR_NOT_FOUND if the session has ended.
+     */
+    esp_err_t getMessageDigest(ws_conn_handle_t handle, ws_message_digest_t &digest);
+
+    /**
+     * @brief Move a client to another outbound priority class.
+     * @param client_sock Socket of the client, as passed to onClientConnected.
+     * @param priority New class.
+     * @return ESP_OK, ESP_ERR_INVALID_ARG for an unknown class or ESP_ERR_NOT_FOUND if the client is not connected.
+     */
+    esp_err_t setClientPriority(int client_sock, ws_priority_t priority);
+
+    /**
+     * @brief Change the outbound fragment size of a client.
+     * @param client_sock Socket of the client, as passed to onClientConnected.
+     * @param fragment_size Largest frame payload of later messages, 0 to send them whole.
+     * @return ESP_OK, or ESP_ERR_NOT_FOUND if the client is not connected.
+     */
+    esp_err_t setFragmentSize(int client_sock, size_t fragment_size);
+
+    /**
+     * @brief Get the outbound counters of a priority class.
+     * @param priority Class to report.
+     * @return Snapshot of the counters since start.
+     */
+    ws_priority_stats_t getPriorityStats(ws_priority_t priority);
+
+    /**
+     * @brief Get the server loop wakeup counters.
+     * @return Snapshot of the counters since start.
+     */
+    ws_wakeup_stats_t getWakeupStats() const;
+
+    /**
+     * @brief Get the close handshake and slot reclamation counters.
+     * @return Snapshot of the counters since start.
+     */
+    ws_close_stats_t getCloseStats() const;
+
+    /**
+     * @brief Get the inbound rate limiting counters.
+     * @return Snapshot of the counters since start.
+     */
+    ws_rate_limit_stats_t getRateLimitStats() const;
+
+    /**
+     * @brief Get the connection buffers budget counters.
+     * @return Snapshot of the counters since start.
+     */
+    ws_memory_stats_t getMemoryStats() const;
+
+    /**
+     * @brief Get the upgrade authentication counters.
+     * @return Snapshot of the counters since start.
+     */
+    ws_auth_stats_t getAuthStats() const;
+
+    /**
+     * @brief Get the receive buffer sizes.
+     * @return Snapshot of the current sizes and resize counters.
+     */
+    ws_rx_buffer_stats_t getRxBufferStats();
+
 private:
     /**
      * @struct DecodedMessage
@@ -160,6 +544,7 @@ private:
     {
         void *data;      /**< Pointer to the message data */
         uint64_t length; /**< Length of the message data */
+        size_t headroom = 0; /**< Bytes before data free to overwrite when it lies in the receive buffer, 0 if data is owned */
     };
 
     /**
@@ -167,6 +552,12 @@ private:
      */
     WSLightServer();
 
+    /**
+     * @brief Initialize NVS, esp_netif and the default event loop, tolerating an existing loop.
+     * @return ESP_OK on success, an error code otherwise.
+     */
+    esp_err_t network_init();
+
     /**
      * @brief Initialize WiFi.
      * @param ssid WiFi SSID.
@@ -178,27 +569,182 @@ private:
                         const char *password,
                         std::function<void()> extra_config = nullptr);
 
+    /**
+     * @brief Create the server task and wait until it is listening.
+     * @param config Server configuration.
+     * @return ESP_OK on success, an error code otherwise.
+     */
+    esp_err_t start_server(const ws_server_config_t &config);
+
     /**
      * @brief Handle client connections.
      */
     void handle_client();
 
-   
+    /**
+     * @brief Close every connection after draining queued frames, then release the server resources.
+     *
+     * Also undoes a start that failed part way, so nothing of it stays reserved or reachable.
+     */
+    void shutdown_server();
+
+    /**
+     * @brief Free the outbound rings once no producer holds a reservation or is inside a ring call.
+     *
+     * The rings must be closed and tx_rings_open cleared first, so the wait ends.
+     */
+    void release_tx_rings();
+
+    /**
+     * @brief Wait for socket activity and serve it once.
+     * @param timeout_ms Maximum time to wait in milliseconds.
+     * @return true if any socket was served.
+     */
+    bool run_once(uint32_t timeout_ms);
+
+    /**
+     * @brief Run due timers and add the descriptors the server waits on to select() sets.
+     * @param read_fds Read set to add to.
+     * @param write_fds Write set to add to.
+     * @param timeout_ms Lowered to the time left until the next deadline.
+     * @return Highest descriptor added.
+     */
+    int prepare_poll(fd_set &read_fds, fd_set &write_fds, uint32_t &timeout_ms);
+
+    /**
+     * @brief Serve the descriptors select() reported ready.
+     * @param read_fds Readable descriptors.
+     * @param write_fds Writable descriptors.
+     * @return true if any socket was served.
+     */
+    bool dispatch_poll(const fd_set &read_fds, const fd_set &write_fds);
+
+    /**
+     * @brief Check whether the server runs, in a task or polled.
+     */
+    bool running() const { return server_task != nullptr || polled; }
+
+    /**
+     * @brief Accept a pending connection or reject it when the server is full.
+     */
+    void accept_client();
+
+    /**
+     * @brief Answer an upgrade with an HTTP error. The caller closes the socket.
+     * @param sock Client socket.
+     * @param status HTTP status, e.g. "503 Service Unavailable".
+     */
+    void send_http_error(int sock, const char *status);
+
+    /**
+     * @brief Apply the configured TCP options to a socket.
+     * @param sock Listening or client socket.
+     * @param listening true for the listening socket, which only takes buffer sizes.
+     */
+    void apply_socket_options(int sock, bool listening);
 
     /**
      * @brief Send handshake to the client.
      * @param client_sock Client socket.
      * @param request Handshake request.
+     * @return true if the upgrade was accepted.
      */
-    void send_handshake(int client_sock, const std::string &request);
+    bool send_handshake(int client_sock, const std::string &request);
 
     /**
-     * @brief Decode a WebSocket frame.
-     * @param frame The WebSocket frame.
+     * @brief Decode one complete WebSocket frame.
+     * @param conn Connection the frame belongs to.
+     * @param frame Start of the frame; an unfragmented data message is unmasked in place.
+     * @param len Length of the frame.
      * @param type The type of WebSocket message.
-     * @return DecodedMessage containing the decoded message.
+     * @param decoded Decoded message, owned by the caller when true is returned unless it has headroom.
+     * @return true if a message or control frame is ready to be processed.
+     */
+    bool decode_frame(ws_connection_t &conn, uint8_t *frame, size_t len, ws_type_t &type, DecodedMessage &decoded);
+
+    /**
+     * @brief Decide from the frame header alone where the payload goes.
+     * @param conn Connection the frame belongs to.
+     * @param frame Start of the frame; only the header has to be present.
+     * @param frame_len Header plus payload length.
+     * @param close_code Status to close with when WS_ROUTE_CLOSE is returned.
+     * @return Destination of the payload.
+     */
+    ws_frame_route_t route_frame(ws_connection_t &conn, const uint8_t *frame, uint64_t frame_len, uint16_t &close_code);
+
+    /**
+     * @brief Allocate the final buffer of a payload: a new message, or the tail of the fragment buffer.
+     * @param conn Connection the frame belongs to.
+     * @param type Opcode of the frame.
+     * @param fin FIN bit of the frame.
+     * @param length Payload length.
+     * @param message Set to the message buffer, nullptr when the payload extends the fragment buffer.
+     * @param dest Set to where the payload goes.
+     * @return false if the budget or the heap cannot provide it; the connection is then closing.
+     */
+    bool begin_payload(ws_connection_t &conn, ws_type_t type, bool fin, uint64_t length, uint8_t *&message, uint8_t *&dest);
+
+    /**
+     * @brief Free the reassembly buffer of a fragmented message and return its memory to the budget.
+     * @param conn Connection the message belongs to.
+     */
+    void discard_fragments(ws_connection_t &conn);
+
+    /**
+     * @brief Complete a payload written by begin_payload().
+     * @param conn Connection the frame belongs to.
+     * @param type Opcode of the frame, replaced by the message type when fragments complete.
+     * @param fin FIN bit of the frame.
+     * @param message Message buffer from begin_payload().
+     * @param length Payload length.
+     * @param decoded Decoded message, owned by the caller when true is returned.
+     * @return true if a message or control frame is ready to be processed.
+     */
+    bool end_payload(ws_connection_t &conn, ws_type_t &type, bool fin, uint8_t *message, uint64_t length, DecodedMessage &decoded);
+
+    /**
+     * @brief Read the rest of a directly routed payload from the socket.
+     * @param conn Client connection with an active sink.
+     */
+    void receive_direct_payload(ws_connection_t &conn);
+
+    /**
+     * @brief Deliver a directly routed payload once all of it has arrived.
+     * @param conn Client connection with an active sink.
+     */
+    void complete_direct_payload(ws_connection_t &conn);
+
+    /**
+     * @brief Drop a partly received direct payload, skipping whatever of it is still to come.
+     * @param conn Client connection with an active sink.
+     */
+    void abort_direct_payload(ws_connection_t &conn);
+
+    /**
+     * @brief Unmask payload bytes, updating the rx_digest checksums if they belong to a binary message.
+     * @param conn Client connection.
+     * @param type Opcode of the frame the bytes come from.
+     * @param dest Destination, may equal src.
+     * @param src Masked bytes.
+     * @param len Number of bytes.
+     * @param mask Masking key of the frame.
+     * @param position Offset of the first byte within the frame payload.
+     */
+    void unmask_data(ws_connection_t &conn, ws_type_t type, uint8_t *dest, const uint8_t *src, size_t len,
+                     const uint8_t *mask, uint64_t position);
+
+    /**
+     * @brief Seal the checksums of a binary message that has ended.
+     * @param conn Client connection.
+     */
+    void finish_digest(ws_connection_t &conn);
+
+    /**
+     * @brief Copy the checksums of a connection.
+     * @param conn Client connection.
+     * @param digest Receives the checksums.
      */
-    DecodedMessage decode_frame(const std::vector<uint8_t> &frame, ws_type_t &type);
+    void read_digest(ws_connection_t &conn, ws_message_digest_t &digest);
 
     /**
      * @brief Encode a message into a WebSocket frame.
@@ -217,10 +763,52 @@ private:
     std::vector<uint8_t> encode_frame(const std::vector<uint8_t> &message, ws_type_t type);
 
     /**
-     * @brief Send a ping message.
-     * @param xTimer The timer handle.
+     * @brief Encode one frame of a possibly fragmented message.
+     * @param data Payload.
+     * @param length Payload length.
+     * @param type Opcode, HTTPD_WS_TYPE_CONTINUE after the first fragment.
+     * @param fin Whether this is the last frame of the message.
+     * @return Vector containing the encoded WebSocket frame.
+     */
+    std::vector<uint8_t> encode_frame(const uint8_t *data, size_t length, ws_type_t type, bool fin);
+
+    /**
+     * @brief Create the loopback socket other tasks use to interrupt select().
+     * @return false if it could not be created; the loop then polls instead.
+     */
+    bool open_wake_socket();
+
+    /**
+     * @brief Interrupt the server task's wait, unless called from the server task.
+     *
+     * Call with conn_lock held, or registered in ring_callers while the rings are live.
+     */
+    void wake_server_task();
+
+    /**
+     * @brief Create the eventfd interrupt handlers use to interrupt select().
+     * @return false if it could not be created.
+     */
+    bool open_isr_wake_fd();
+
+    /**
+     * @brief Stop interrupt handlers from submitting and close their eventfd.
      */
-    static void send_ping(TimerHandle_t xTimer);
+    void close_isr_wake_fd();
+
+    /**
+     * @brief Send pings and close silent clients whose deadline has passed.
+     * @param now Current esp_timer time.
+     */
+    void service_timers(int64_t now);
+
+    /**
+     * @brief Time until the next ping, inactivity or buffer deadline, rounded up to the timer slack.
+     * @param now Current esp_timer time.
+     * @param limit Longest wait the caller allows.
+     * @return Milliseconds select() may block.
+     */
+    uint32_t next_timeout_ms(int64_t now, uint32_t limit);
 
     /**
      * @brief Wrapper for handling client connections.
@@ -235,31 +823,324 @@ private:
      */
     ws_client_info_t get_client_info(const std::string &request);
 
-    uint16_t port;              /**< Server port */
+    /**
+     * @brief Charge an inbound frame against the connection's token buckets.
+     * @param frame Received bytes, starting at the frame header.
+     * @param len Number of received bytes.
+     * @param close_connection Set when the policy requires closing the connection.
+     * @return true if the frame may be decoded, false if it must be skipped.
+     */
+    bool admit_inbound_frame(ws_connection_t &conn, const uint8_t *frame, size_t len, bool &close_connection);
+
+    /**
+     * @brief Send a close frame carrying a status code.
+     * @param conn Client connection.
+     * @param code Close status code.
+     */
+    void send_close_frame(ws_connection_t &conn, uint16_t code);
+
+    /**
+     * @brief Start the closing handshake: queue a close frame and linger for the answer.
+     * @param conn Client connection; a connection that is not open is released at once.
+     * @param code Close status code.
+     */
+    void close_client_connection(ws_connection_t &conn, uint16_t code);
+
+    /**
+     * @brief Answer a client close frame and release the connection once the echo is sent.
+     * @param conn Client connection.
+     * @param decoded Close frame payload.
+     */
+    void handle_close(ws_connection_t &conn, DecodedMessage &decoded);
+
+    /**
+     * @brief Add a record for the connection to the capture ring, if one is configured.
+     * @param conn Client connection.
+     * @param kind Record kind.
+     * @param data Bytes read from the socket.
+     * @param length Number of bytes.
+     */
+    void capture(ws_connection_t &conn, ws_capture_kind_t kind, const uint8_t *data = nullptr, size_t length = 0);
+
+    /**
+     * @brief Check whether the outbox is draining to a connection.
+     * @param conn Client connection.
+     */
+    bool is_outbox_target(const ws_connection_t &conn) const;
+
+    /**
+     * @brief Pick an open session to drain the outbox to, if it holds messages and none is draining.
+     */
+    void select_outbox_target();
+
+    /**
+     * @brief Release what the outbox target has sent and queue the next batch of stored messages.
+     * @param conn Client connection, with conn_lock held.
+     */
+    void drain_outbox(ws_connection_t &conn);
+
+    /**
+     * @brief Release a closing connection whose handshake is over.
+     * @param conn Client connection.
+     */
+    void finish_close(ws_connection_t &conn);
+
+    /**
+     * @brief Find the open connection using a socket.
+     * @param client_sock Client socket.
+     * @return The connection, or nullptr. Call with conn_lock held.
+     */
+    ws_connection_t *find_connection(int client_sock);
+
+    /**
+     * @brief Find the open connection of a session handle.
+     * @param handle Session handle.
+     * @return The connection, or nullptr if the handle is stale. Call with conn_lock held.
+     */
+    ws_connection_t *find_connection(ws_conn_handle_t handle);
+
+    /**
+     * @brief Build the handle of the session open on a connection.
+     * @param conn Client connection.
+     * @return Slot and generation of the connection.
+     */
+    ws_conn_handle_t connection_handle(const ws_connection_t &conn) const;
+
+    /**
+     * @brief Get the outbound ring of a connection slot.
+     * @param conn Client connection.
+     * @return The ring, or nullptr if tx_ring_size is 0.
+     */
+    WSTxRing *tx_ring(const ws_connection_t &conn);
+
+    /**
+     * @brief Stop producers from reserving in the outbound ring of a connection.
+     * @param conn Client connection.
+     */
+    void close_tx_ring(ws_connection_t &conn);
+
+    /**
+     * @brief Get the bytes waiting to be sent to a connection.
+     * @param conn Client connection.
+     * @return Unsent queued bytes plus the outbound ring's pending bytes. Call with conn_lock held.
+     */
+    size_t buffered_bytes(ws_connection_t &conn);
+
+    /**
+     * @brief Queue an encoded frame, sending as much as possible right away.
+     * @param conn Client connection.
+     * @param frame Encoded frame.
+     * @param reserved The caller already reserved the frame's size from the memory budget; it is
+     *                 released if the frame does not end up queued.
+     * @return ESP_OK on success, ESP_ERR_NO_MEM if the budget is exhausted. Call with conn_lock held.
+     */
+    esp_err_t enqueue_frame(ws_connection_t &conn, std::vector<uint8_t> &&frame, bool reserved = false);
+
+    /**
+     * @brief Send as much of a frame as the socket takes; only when nothing is queued ahead of it.
+     * @param conn Client connection.
+     * @param frame Encoded frame.
+     * @param length Frame length.
+     * @return Bytes sent, or -1 on a socket error. Call with conn_lock held.
+     */
+    int send_frame_now(ws_connection_t &conn, const uint8_t *frame, size_t length);
+
+    /**
+     * @brief Queue the rest of a frame that send_frame_now() could not finish.
+     * @param conn Client connection.
+     * @param frame Encoded frame.
+     * @param sent Bytes of the frame already sent.
+     * @param reserved The caller already reserved the frame's size, nothing is shed to make room.
+     * @return ESP_OK on success, ESP_ERR_NO_MEM if the budget is exhausted. Call with conn_lock held.
+     */
+    esp_err_t queue_frame(ws_connection_t &conn, std::vector<uint8_t> &&frame, size_t sent, bool reserved = false);
+
+    /**
+     * @brief Lend a text or binary message to onConnectionMessage, allowing forwardMessage() to reuse its buffer.
+     * @param conn Client connection.
+     * @param decoded Decoded message.
+     * @param type HTTPD_WS_TYPE_TEXT or HTTPD_WS_TYPE_BINARY.
+     */
+    void lend_message(ws_connection_t &conn, DecodedMessage &decoded, ws_type_t type);
+
+    /**
+     * @brief Send queued frames until the socket would block or the budget is spent.
+     * @param conn Client connection.
+     * @param budget Maximum bytes to send.
+     * @return Bytes sent, or -1 if the connection failed. Call with conn_lock held.
+     */
+    int flush_client_connection(ws_connection_t &conn, size_t budget = SIZE_MAX);
+
+    /**
+     * @brief Discard queued frames of the connection with the largest outbound queue.
+     * @return true if anything was discarded. Call with conn_lock held.
+     */
+    bool shed_largest_queue();
+
+    /**
+     * @brief Send an encoded frame to one client or to all of them.
+     * @param client_sock Client socket, or -1 for every open connection.
+     * @param frame Encoded frame.
+     * @return ESP_OK on success, an error code otherwise.
+     */
+    esp_err_t send_frame(int client_sock, std::vector<uint8_t> &&frame);
+
+    /**
+     * @brief Queue a message, split into fragments of the connection's fragment size.
+     *
+     * A fragmented message reserves the budget for all of its frames first, so it is queued
+     * whole or not at all and shedding never leaves part of it behind.
+     *
+     * @param conn Client connection.
+     * @param data Payload.
+     * @param length Payload length.
+     * @param type HTTPD_WS_TYPE_TEXT or HTTPD_WS_TYPE_BINARY.
+     * @return ESP_OK on success, ESP_ERR_INVALID_SIZE if an unfragmented message is over
+     *         MAX_MESSAGE_SIZE, ESP_ERR_NO_MEM if the budget cannot hold the message. Call with conn_lock held.
+     */
+    esp_err_t enqueue_message(ws_connection_t &conn, const uint8_t *data, size_t length, ws_type_t type);
+
+    /**
+     * @brief Bytes the frames of a message take on the wire.
+     * @param length Payload length.
+     * @param fragment Largest frame payload, 0 to send the message whole.
+     */
+    static size_t message_wire_size(size_t length, size_t fragment);
+
+    /**
+     * @brief Check whether enqueue_message() can ever take a message, however empty the queues.
+     * @param length Payload length.
+     * @param fragment Fragment size of the connection, 0 to send the message whole.
+     * @return false if it is over MAX_MESSAGE_SIZE unfragmented, or its frames exceed the whole budget.
+     */
+    bool message_deliverable(size_t length, size_t fragment) const;
+
+    /**
+     * @brief Send a message to one client or to all of them.
+     * @param client_sock Client socket, or -1 for every open connection.
+     * @param data Payload.
+     * @param length Payload length.
+     * @param type HTTPD_WS_TYPE_TEXT or HTTPD_WS_TYPE_BINARY.
+     * @return ESP_OK on success, an error code otherwise.
+     */
+    esp_err_t send_message(int client_sock, const uint8_t *data, size_t length, ws_type_t type);
+
+    /**
+     * @brief Send a message to one session.
+     * @param handle Session handle.
+     * @param data Payload.
+     * @param length Payload length.
+     * @param type HTTPD_WS_TYPE_TEXT or HTTPD_WS_TYPE_BINARY.
+     * @return ESP_OK on success, ESP_ERR_NOT_FOUND if the handle is stale, an error code otherwise.
+     */
+    esp_err_t send_message(ws_conn_handle_t handle, const uint8_t *data, size_t length, ws_type_t type);
+
+    /**
+     * @brief Read from a client and process every complete frame.
+     * @param conn Client connection.
+     */
+    void handle_client_connection(ws_connection_t &conn);
+
+    /**
+     * @brief Move the receive buffer of a connection to a new size.
+     * @param conn Client connection.
+     * @param capacity New size, at least conn.rx_len.
+     * @return false if the budget or the heap cannot provide it.
+     */
+    bool resize_rx_buffer(ws_connection_t &conn, size_t capacity);
+
+    /**
+     * @brief Return a grown receive buffer to its initial size after a quiet period.
+     * @param conn Client connection.
+     * @param now Current esp_timer time.
+     */
+    void shrink_idle_rx_buffer(ws_connection_t &conn, int64_t now);
+
+    /**
+     * @brief Process the frames buffered for a client.
+     * @param conn Client connection.
+     */
+    void process_rx_buffer(ws_connection_t &conn);
+
+    /**
+     * @brief Authorize and complete the HTTP upgrade once the request has arrived.
+     * @param conn Client connection.
+     */
+    void process_handshake(ws_connection_t &conn);
+
+    /**
+     * @brief Close a client connection and release its buffers.
+     * @param conn Client connection.
+     */
+    void cleanup_client_connection(ws_connection_t &conn);
+
+    ws_server_config_t config;  /**< Active server configuration */
     int server_sock;            /**< Server socket */
-    int client_sock;            /**< Client socket */
-    TimerHandle_t ping_timer;   /**< Timer handle for ping messages */
-    uint64_t max_inactivity_ms; /**< Maximum inactivity period in milliseconds */
-    bool ping_pong_enabled;     /**< Flag to enable ping messages to client */
-    size_t ping_interval_ms;    /**< Interval for sending ping messages in milliseconds */
-    char *user;                 /**< Username */
-    char *pwd;                  /**< Password */
-    size_t relief_delay;
+    int wake_sock;              /**< Loopback UDP socket that wakes the server task, -1 if unavailable */
+    std::atomic<bool> wake_pending; /**< A wakeup datagram is already in flight */
+    std::atomic<int> isr_wake_fd; /**< eventfd written by sendBinaryMessageFromISR(), -1 when ISR submission is off */
+    std::atomic<bool> isr_wake_pending; /**< The eventfd has been written since the server task last read it */
+    std::atomic<int> isr_senders; /**< Interrupt handlers inside sendBinaryMessageFromISR() */
+    std::atomic<bool> tx_rings_open; /**< reserveMessage() may hand out reservations */
+    std::atomic<bool> tx_rings_live; /**< tx_rings may be used by commitMessage() and cancelMessage() */
+    std::atomic<int> ring_callers; /**< Tasks inside reserveMessage(), commitMessage() or cancelMessage() */
+    int64_t next_ping_us;       /**< esp_timer time of the next ping */
+    TaskHandle_t server_task;   /**< Task running handle_client(), nullptr when stopped */
+    TaskHandle_t notify_task;   /**< Task waiting in start() or stop() */
+    bool polled;                /**< Running in WS_RUN_POLLED mode, without a server task */
+    uint8_t *lent_message;      /**< Payload lent to onConnectionMessage with headroom to forward it, nullptr otherwise */
+    bool in_poll;               /**< A poll() or pollDispatch() call is serving, callbacks included */
+    volatile bool stop_requested; /**< Asks the server task to shut down */
+    uint32_t drain_timeout_ms;  /**< Drain time of the pending stop() */
+    esp_err_t listen_result;    /**< Outcome of setup_server() reported to start() */
+    bool network_initialized;   /**< Network brought up, or left to the application, by a previous start() */
+
+    std::vector<ws_connection_t> connections; /**< Connection slots, one per allowed client */
+    std::vector<WSTxRing> tx_rings;           /**< Outbound rings, one per slot, kept from start() to stop() */
+    SemaphoreHandle_t conn_lock;              /**< Guards connections against sender tasks */
+    WSMemoryGovernor memory;                  /**< Budget shared by all connection buffers */
+    WSAuthenticator authenticator;            /**< Upgrade credential check */
+    ws_rate_limit_stats_t rate_limit_stats;   /**< Inbound rate limiting counters */
+    ws_auth_stats_t auth_stats;               /**< Upgrade authentication counters */
+    uint32_t rejected_connections;            /**< Upgrades answered with HTTP 503 */
+    size_t next_slot;                         /**< Slot served first in the next pass */
+    ws_priority_stats_t priority_stats[WS_PRIORITY_COUNT]; /**< Outbound counters per class */
+    uint32_t rx_grows;                        /**< Receive buffers grown */
+    uint32_t rx_shrinks;                      /**< Receive buffers shrunk */
+    uint64_t rx_buffered_bytes;               /**< Payload bytes copied out of receive buffers */
+    uint64_t rx_direct_bytes;                 /**< Payload bytes received into their final buffer */
+    uint32_t shed_frames;                     /**< Outbound frames discarded under pressure */
+    size_t shed_bytes;                        /**< Outbound bytes discarded under pressure */
+    ws_wakeup_stats_t wakeup_stats;           /**< Server loop wakeup counters */
+    ws_close_stats_t close_stats;             /**< Close handshake counters */
+    int64_t wakeup_window_us;                 /**< Start of the second counted by wakeup_window_count */
+    uint32_t wakeup_window_count;             /**< Passes so far in the current second */
+    uint16_t session_generation;              /**< Generation of the last session opened, kept across restarts */
+    ws_conn_handle_t outbox_target;           /**< Session the outbox is draining to, generation 0 if none */
+    uint32_t outbox_appends;                  /**< Broadcasts being stored outside conn_lock; the drain waits for them */
+    size_t outbox_wait_bytes;                 /**< Budget the next stored message needs before the drain resumes, 0 if none */
 
     std::function<void(int, const std::string &)> text_message_callback;            /**< Callback for text messages */
     std::function<void(int, const std::vector<uint8_t> &)> binary_message_callback; /**< Callback for binary messages */
+    std::function<uint8_t *(int, size_t)> binary_buffer_provider;                   /**< Supplies buffers for direct binary receives */
+    std::function<void(int, uint8_t *, size_t, esp_err_t)> binary_buffer_complete; /**< Returns buffers of direct binary receives */
     std::function<void(int)> ping_message_callback;                                 /**< Callback for ping messages */
     std::function<void(int)> pong_message_callback;                                 /**< Callback for pong messages */
     std::function<void(int)> close_message_callback;                                /**< Callback for close messages */
+    std::function<void(int, uint16_t, const std::string &)> close_status_callback;  /**< Callback for close status and reason */
     std::function<void(int)> client_connected_callback;                             /**< Callback for client connections */
     std::function<void(int)> client_disconnected_callback;                          /**< Callback for client disconnections */
+    std::function<void()> server_ready_callback;                                    /**< Callback for the server listening */
+    std::function<void(int)> drain_callback;                                        /**< Callback for outbound queues falling to the low watermark */
+    std::function<void *(ws_conn_handle_t)> connection_opened_callback;             /**< Callback opening a session */
+    std::function<void(ws_conn_handle_t, void *, const std::string &)> connection_text_callback;            /**< Callback for session text messages */
+    std::function<void(ws_conn_handle_t, void *, const std::vector<uint8_t> &)> connection_binary_callback; /**< Callback for session binary messages */
+    std::function<void(ws_conn_handle_t, void *, const ws_message_view_t &)> connection_message_callback;        /**< Callback lending session messages */
+    std::function<void(ws_conn_handle_t, void *)> connection_closed_callback;       /**< Callback ending a session */
 
     static WSLightServer *instance;            /**< Singleton instance */
     static const constexpr bool debug = false; /**< Debug flag */
-    static DecodedMessage accumulated_message;
-    void handle_ping(int client_sock, DecodedMessage &decoded);
-    void process_message(int client_sock, DecodedMessage &decoded, ws_type_t type);
-    void handle_client_connection();
+    void handle_ping(ws_connection_t &conn, DecodedMessage &decoded);
+    void process_message(ws_connection_t &conn, DecodedMessage &decoded, ws_type_t type);
     bool setup_server();
-    void cleanup_client_connection();
 };
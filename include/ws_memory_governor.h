@@ -0,0 +1,71 @@
+/**
+ * @file ws_memory_governor.h
+ * @brief Server-wide memory budget shared by all connection buffers.
+ *
+ *@author Daniel Giménez
+ *@date 2024-08-05
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <freertos/FreeRTOS.h>
+
+/**
+ * @class WSMemoryGovernor
+ * @brief Tracks bytes reserved by receive, reassembly and outbound buffers.
+ *
+ * Buffers reserve their size before allocating and release it after freeing,
+ * so running out of budget is detected before the heap is exhausted.
+ * Safe to call from any task.
+ */
+class WSMemoryGovernor
+{
+public:
+    /**
+     * @brief Set the budget and clear the counters.
+     * @param budget Maximum reserved bytes, 0 for unlimited.
+     * @param shed_threshold_pct Usage percentage above which the budget is under pressure.
+     */
+    void configure(size_t budget, uint8_t shed_threshold_pct);
+
+    /**
+     * @brief Reserve bytes against the budget.
+     * @param bytes Number of bytes to reserve.
+     * @return true if the bytes fit in the budget.
+     */
+    bool reserve(size_t bytes);
+
+    /**
+     * @brief Return previously reserved bytes.
+     * @param bytes Number of bytes to release.
+     */
+    void release(size_t bytes);
+
+    /**
+     * @brief Check whether @p bytes could be reserved without reserving them.
+     * @param bytes Number of bytes.
+     * @return true if the bytes fit in the budget.
+     */
+    bool fits(size_t bytes) const;
+
+    /**
+     * @brief Check whether usage is above the shedding threshold.
+     * @return true if outbound queues should be shed.
+     */
+    bool underPressure() const;
+
+    size_t used() const { return used_bytes; }            /**< Currently reserved bytes */
+    size_t peak() const { return peak_bytes; }            /**< Highest reserved bytes */
+    size_t budget() const { return budget_bytes; }        /**< Configured budget, 0 for unlimited */
+    uint32_t failures() const { return failed_reservations; } /**< Reservations refused */
+
+private:
+    size_t budget_bytes = 0;
+    size_t threshold_bytes = 0;
+    size_t used_bytes = 0;
+    size_t peak_bytes = 0;
+    uint32_t failed_reservations = 0;
+    mutable portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+};
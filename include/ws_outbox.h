@@ -0,0 +1,259 @@
+/**
+ * @file ws_outbox.h
+ * @brief Store-and-forward outbox keeping broadcasts on flash while no client is connected.
+ *
+ *@author Daniel Giménez
+ *@date 2024-08-05
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <functional>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include "esp_err.h"
+#include "esp_partition.h"
+#include "ws_types.h"
+
+/**
+ * @struct ws_outbox_stats_t
+ * @brief Counters of an outbox since init().
+ */
+typedef struct {
+    uint32_t appended;  /**< Messages stored. */
+    uint32_t rejected;  /**< Messages refused: the outbox was full, or a message does not fit a sector. */
+    uint32_t drained;   /**< Messages handed to a client and released. */
+    uint32_t dropped;   /**< Messages released without delivery because the client can never take them. */
+    uint32_t writes;    /**< Write operations on the storage. */
+    uint32_t erases;    /**< Sectors erased. */
+} ws_outbox_stats_t;
+
+/**
+ * @class WSOutboxStorage
+ * @brief Storage an outbox lives on, with the semantics of NOR flash.
+ *
+ * The outbox only writes bytes erased since, or turns written bits from 1 to 0,
+ * so a flash partition needs no translation layer underneath.
+ */
+class WSOutboxStorage
+{
+public:
+    virtual ~WSOutboxStorage() = default;
+
+    /**
+     * @brief Usable bytes, a multiple of sector_size().
+     */
+    virtual size_t size() const = 0;
+
+    /**
+     * @brief Erase unit in bytes.
+     */
+    virtual size_t sector_size() const = 0;
+
+    /**
+     * @brief Read bytes.
+     * @return ESP_OK or an error of the backend.
+     */
+    virtual esp_err_t read(size_t offset, void *data, size_t length) = 0;
+
+    /**
+     * @brief Write bytes that are erased, or only clear bits of written ones.
+     * @return ESP_OK or an error of the backend.
+     */
+    virtual esp_err_t write(size_t offset, const void *data, size_t length) = 0;
+
+    /**
+     * @brief Set a whole sector to 0xFF.
+     * @param offset Start of the sector.
+     * @return ESP_OK or an error of the backend.
+     */
+    virtual esp_err_t erase(size_t offset) = 0;
+};
+
+/**
+ * @class WSPartitionStorage
+ * @brief Outbox storage on a data partition of the SPI flash.
+ */
+class WSPartitionStorage : public WSOutboxStorage
+{
+public:
+    /**
+     * @brief Find the partition.
+     * @param label Label of a data partition in the partition table.
+     * @return ESP_OK or ESP_ERR_NOT_FOUND.
+     */
+    esp_err_t init(const char *label);
+
+    size_t size() const override;
+    size_t sector_size() const override;
+    esp_err_t read(size_t offset, void *data, size_t length) override;
+    esp_err_t write(size_t offset, const void *data, size_t length) override;
+    esp_err_t erase(size_t offset) override;
+
+private:
+    const esp_partition_t *partition = nullptr; /**< Partition found by init() */
+};
+
+/**
+ * @class WSFileStorage
+ * @brief Outbox storage in a file, for host builds or a file system on an SD card.
+ *
+ * Every write is flushed and synced, so batching in the outbox is what keeps
+ * the number of syncs down.
+ */
+class WSFileStorage : public WSOutboxStorage
+{
+public:
+    WSFileStorage() = default;
+    ~WSFileStorage();
+    WSFileStorage(const WSFileStorage &) = delete;
+    WSFileStorage &operator=(const WSFileStorage &) = delete;
+
+    /**
+     * @brief Open the file, creating it or growing it to @p size with erased bytes.
+     * @param path File path.
+     * @param size Usable bytes, a multiple of @p sector_size.
+     * @param sector_size Erase unit to emulate.
+     * @return ESP_OK, ESP_ERR_INVALID_ARG or ESP_FAIL if the file cannot be opened or grown.
+     */
+    esp_err_t init(const char *path, size_t size, size_t sector_size = 4096);
+
+    size_t size() const override { return file_size; }
+    size_t sector_size() const override { return sector; }
+    esp_err_t read(size_t offset, void *data, size_t length) override;
+    esp_err_t write(size_t offset, const void *data, size_t length) override;
+    esp_err_t erase(size_t offset) override;
+
+private:
+    esp_err_t sync();
+
+    FILE *file = nullptr;      /**< Open file */
+    size_t file_size = 0;      /**< Usable bytes */
+    size_t sector = 0;         /**< Emulated erase unit */
+};
+
+/**
+ * @class WSOutbox
+ * @brief Log-structured ring of outbound messages on a WSOutboxStorage.
+ *
+ * Messages are appended as CRC-checked records to the current sector, behind a
+ * sector header carrying a sequence number. Appends collect in a RAM batch that
+ * is written in one operation when it fills, when flush_interval_ms passes or on
+ * flush(); a power loss loses at most the batch. Sectors are used round robin
+ * and erased only right before they are reused, so wear spreads over the whole
+ * storage. Once all records of a sector are released, a word of its header is
+ * cleared to mark it drained, without an erase.
+ *
+ * Records are read back a sector at a time with gather() and confirmed with
+ * release(). Delivery is at least once: after a reset, or a rewind() when a
+ * client drops, the records gathered but not released are read again. When the
+ * outbox empties, the current sector is closed so its records are not sent again
+ * after a reset; the next append starts a new sector.
+ *
+ * init() finds the newest sector and the oldest undrained one, so messages
+ * survive a reset. Safe to call from any task.
+ */
+class WSOutbox
+{
+public:
+    WSOutbox() = default;
+    ~WSOutbox();
+    WSOutbox(const WSOutbox &) = delete;
+    WSOutbox &operator=(const WSOutbox &) = delete;
+
+    /**
+     * @brief Attach the storage and recover the records it holds.
+     * @param storage Backend with at least two sectors, must outlive the outbox.
+     * @param batch_size Bytes of appends collected in RAM before they are written, 0 to write each one.
+     * @param flush_interval_ms Longest time an append waits in the batch.
+     * @return ESP_OK, ESP_ERR_INVALID_ARG, ESP_ERR_NO_MEM or an error of the backend.
+     */
+    esp_err_t init(WSOutboxStorage *storage, size_t batch_size = 512, uint32_t flush_interval_ms = 1000);
+
+    /**
+     * @brief Store a message.
+     * @param data Payload.
+     * @param length Payload length.
+     * @param type HTTPD_WS_TYPE_TEXT or HTTPD_WS_TYPE_BINARY.
+     * @return ESP_OK, ESP_ERR_INVALID_SIZE if it does not fit a sector, ESP_ERR_NO_MEM if the
+     *         outbox is full, ESP_ERR_INVALID_STATE before init() or an error of the backend.
+     */
+    esp_err_t append(const uint8_t *data, size_t length, ws_type_t type);
+
+    /**
+     * @brief Write the batched appends to the storage.
+     * @return ESP_OK or an error of the backend.
+     */
+    esp_err_t flush();
+
+    /**
+     * @brief esp_timer time by which the batch must be written, 0 if it is empty.
+     */
+    int64_t flush_deadline() const;
+
+    /**
+     * @brief Read the next sector's worth of records after the gathered ones.
+     * @param deliver Called with each payload, its length and type. ESP_ERR_INVALID_SIZE skips
+     *                the record, which release() then drops for good; any other error stops
+     *                the batch before that record.
+     * @return Records delivered.
+     */
+    size_t gather(const std::function<esp_err_t(const uint8_t *, size_t, ws_type_t)> &deliver);
+
+    /**
+     * @brief Drop the gathered records for good, marking the sectors left behind as drained.
+     */
+    void release();
+
+    /**
+     * @brief Forget the gathered records so the next gather() reads them again.
+     */
+    void rewind();
+
+    /**
+     * @brief Check whether every stored record has been released.
+     */
+    bool empty() const;
+
+    /**
+     * @brief Snapshot of the counters.
+     */
+    ws_outbox_stats_t stats() const;
+
+private:
+    esp_err_t mount();
+    esp_err_t write_storage(size_t offset, const void *data, size_t length);
+    esp_err_t flush_batch();
+    esp_err_t open_sector();
+    void mark_drained(size_t sector);
+    size_t sector_end(size_t sector) const;
+    void skip_finished(size_t &sector, size_t &offset);
+
+    WSOutboxStorage *storage = nullptr;    /**< Backend */
+    size_t sector_size = 0;                /**< Erase unit of the backend */
+    size_t sector_count = 0;               /**< Sectors in the ring */
+    uint8_t *sector_buffer = nullptr;      /**< One sector, for recovery and gather() */
+    uint8_t *batch = nullptr;              /**< Appends not yet written */
+    size_t batch_capacity = 0;             /**< Size of batch */
+    size_t batch_len = 0;                  /**< Bytes in batch */
+    size_t batch_start = 0;                /**< Sector offset the batch is written at */
+    int64_t batch_started_us = 0;          /**< esp_timer time of the first append in the batch */
+    int64_t flush_interval_us = 0;         /**< Longest wait of an append in the batch */
+
+    uint32_t sequence = 0;                 /**< Sequence number of the newest sector */
+    size_t write_sector = 0;               /**< Sector appends go to */
+    size_t write_offset = 0;               /**< Offset of the next append in it, batch included */
+    bool write_drained = false;            /**< The write sector is marked drained and takes no more appends */
+    size_t read_sector = 0;                /**< Sector of the oldest record not released */
+    size_t read_offset = 0;                /**< Offset of that record */
+    size_t gather_sector = 0;              /**< Sector of the next record to gather */
+    size_t gather_offset = 0;              /**< Offset of that record */
+    uint32_t gathered = 0;                 /**< Records gathered and not yet released */
+    uint32_t skipped = 0;                  /**< Records gathered as undeliverable, counted as dropped on release() */
+
+    ws_outbox_stats_t counters = {};       /**< Counters since init() */
+    SemaphoreHandle_t lock = nullptr;      /**< Serializes producers and the server task */
+};
@@ -0,0 +1,62 @@
+/**
+ * @file ws_token_bucket.h
+ * @brief Token bucket used to rate limit inbound traffic.
+ *
+ *@author Daniel Giménez
+ *@date 2024-08-05
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * @class WSTokenBucket
+ * @brief Integer token bucket refilled from esp_timer.
+ *
+ * Tokens are kept in millionths so refilling never needs floating point,
+ * which matters on targets without an FPU such as the ESP32-C3.
+ */
+class WSTokenBucket
+{
+public:
+    /**
+     * @brief Set the refill rate and capacity, and fill the bucket.
+     * @param rate_per_sec Tokens added per second, 0 disables the bucket.
+     * @param burst Bucket capacity, 0 uses @p rate_per_sec.
+     */
+    void configure(uint32_t rate_per_sec, uint32_t burst);
+
+    /**
+     * @brief Fill the bucket to capacity.
+     */
+    void reset();
+
+    /**
+     * @brief Check whether the bucket limits anything.
+     * @return true if a rate is configured.
+     */
+    bool enabled() const { return rate != 0; }
+
+    /**
+     * @brief Take tokens if they are available.
+     * @param count Tokens to take, clamped to the capacity.
+     * @return true if the tokens were taken.
+     */
+    bool tryConsume(uint32_t count);
+
+    /**
+     * @brief Time until @p count tokens will be available.
+     * @param count Tokens needed, clamped to the capacity.
+     * @return Wait time in microseconds, 0 if available now.
+     */
+    uint64_t waitTimeUs(uint32_t count);
+
+private:
+    void refill();
+
+    uint32_t rate = 0;        /**< Tokens per second */
+    uint32_t burst = 0;       /**< Capacity in tokens */
+    uint64_t micro_tokens = 0; /**< Current level in millionths of a token */
+    int64_t last_refill_us = 0; /**< esp_timer time of the last refill */
+};
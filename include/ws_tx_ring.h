@@ -0,0 +1,128 @@
+/**
+ * @file ws_tx_ring.h
+ * @brief Multi-producer outbound ring that messages are written into in place.
+ *
+ *@author Daniel Giménez
+ *@date 2024-08-05
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include "esp_err.h"
+#include "ws_types.h"
+
+/**
+ * @class WSTxRing
+ * @brief Lock-free ring of outbound messages for one connection slot.
+ *
+ * Producer tasks reserve room for a payload with a compare-and-swap on the
+ * write position, fill it in place and commit it. Each record keeps room for
+ * the frame header in front of the payload, so the server task writes the
+ * header there and hands several frames straight from the ring to one sendmsg().
+ *
+ * Records go out in reservation order; one that is reserved but not yet
+ * committed holds back those behind it. A record never wraps: when the end of
+ * the buffer is too short, the producer pads it and starts at the beginning.
+ * Consumed bytes are zeroed so a new record reads as uncommitted until its
+ * producer publishes it.
+ *
+ * The ring is opened for one session generation at a time. Producers register
+ * in a writer count while they hold a reservation, so the server task never
+ * resets the ring under a producer of the previous session.
+ */
+class WSTxRing
+{
+public:
+    WSTxRing() = default;
+    ~WSTxRing();
+    WSTxRing(const WSTxRing &) = delete;
+    WSTxRing &operator=(const WSTxRing &) = delete;
+
+    /**
+     * @brief Allocate the ring, closed.
+     * @param capacity Ring size in bytes, a power of two of at least 64.
+     * @return ESP_OK, ESP_ERR_INVALID_ARG or ESP_ERR_NO_MEM.
+     */
+    esp_err_t init(size_t capacity);
+
+    /**
+     * @brief Empty the ring and accept reservations for a session; server task only.
+     * @param generation Generation of the session handle.
+     * @return false if a producer of the previous session still holds a reservation.
+     */
+    bool open(uint16_t generation);
+
+    /**
+     * @brief Refuse further reservations; committed records stay until the next open().
+     */
+    void close();
+
+    /**
+     * @brief Producers holding a reservation, which keeps the buffer in use.
+     */
+    uint32_t writers() const;
+
+    /**
+     * @brief Reserve room for a payload; any task.
+     * @param generation Generation of the caller's session handle.
+     * @param length Payload bytes to reserve.
+     * @param data Receives the payload pointer.
+     * @return ESP_OK, ESP_ERR_NOT_FOUND if the ring is not open for @p generation,
+     *         ESP_ERR_INVALID_SIZE if the record can never fit, ESP_ERR_NO_MEM if it does not fit now.
+     */
+    esp_err_t reserve(uint16_t generation, size_t length, uint8_t **data);
+
+    /**
+     * @brief Publish a reserved payload.
+     * @param data Pointer returned by reserve().
+     * @param length Bytes written, at most the reserved length.
+     * @param type HTTPD_WS_TYPE_TEXT or HTTPD_WS_TYPE_BINARY.
+     */
+    void commit(uint8_t *data, size_t length, ws_type_t type);
+
+    /**
+     * @brief Give a reservation back without sending anything.
+     * @param data Pointer returned by reserve().
+     */
+    void cancel(uint8_t *data);
+
+    /**
+     * @brief Check whether the record at the read position can be consumed; server task only.
+     */
+    bool ready() const;
+
+    /**
+     * @brief Encode the headers of the committed records at the read position; server task only.
+     * @param frames Receives the start of each encoded frame, header in front of the payload.
+     * @param lengths Receives the length of each frame.
+     * @param max Room in @p frames and @p lengths.
+     * @return Frames found, stopping at the first record not yet committed.
+     */
+    size_t gather(const uint8_t **frames, size_t *lengths, size_t max);
+
+    /**
+     * @brief Drop frames returned by gather() once they are sent; server task only.
+     * @param frames Number of frames, from the read position.
+     */
+    void release(size_t frames);
+
+    /**
+     * @brief Bytes reserved or committed and not yet released.
+     */
+    size_t pending() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+
+    /**
+     * @brief Ring size in bytes, 0 before init().
+     */
+    size_t size() const { return capacity; }
+
+private:
+    uint8_t *buffer = nullptr;             /**< Ring storage */
+    size_t capacity = 0;                   /**< Ring size, a power of two */
+    std::atomic<size_t> head{0};           /**< Bytes ever reserved */
+    std::atomic<size_t> tail{0};           /**< Bytes ever released */
+    std::atomic<uint32_t> state{0};        /**< Session generation, open flag and writer count */
+};
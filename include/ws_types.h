@@ -10,6 +10,9 @@
 
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 /**
  * @enum ws_type_t
  * @brief Enumeration of WebSocket frame types.
@@ -32,3 +35,203 @@ typedef enum {
     HTTPD_WS_CLIENT_HTTP           = 0x1,  /**< HTTP client. */
     HTTPD_WS_CLIENT_WEBSOCKET      = 0x2   /**< WebSocket client. */
 } ws_client_info_t;
+
+/**
+ * @enum ws_close_code_t
+ * @brief Status codes carried by a WebSocket close frame (RFC 6455, section 7.4.1).
+ */
+typedef enum {
+    WS_CLOSE_NORMAL            = 1000,  /**< Normal closure. */
+    WS_CLOSE_GOING_AWAY        = 1001,  /**< Endpoint is going away. */
+    WS_CLOSE_PROTOCOL_ERROR    = 1002,  /**< Protocol error. */
+    WS_CLOSE_UNSUPPORTED_DATA  = 1003,  /**< Data type cannot be accepted. */
+    WS_CLOSE_NO_STATUS         = 1005,  /**< Reported when a close frame carries no code; never sent. */
+    WS_CLOSE_INVALID_PAYLOAD   = 1007,  /**< Payload inconsistent with message type. */
+    WS_CLOSE_POLICY_VIOLATION  = 1008,  /**< Message violates a server policy. */
+    WS_CLOSE_MESSAGE_TOO_BIG   = 1009,  /**< Message too big to process. */
+    WS_CLOSE_INTERNAL_ERROR    = 1011   /**< Unexpected server condition. */
+} ws_close_code_t;
+
+/**
+ * @enum ws_rate_limit_action_t
+ * @brief What the server does with an inbound frame that exceeds its rate limit.
+ */
+typedef enum {
+    WS_RATE_LIMIT_DELAY = 0,  /**< Stop reading until tokens refill, letting TCP push back on the client. */
+    WS_RATE_LIMIT_DROP  = 1,  /**< Skip the frame without decoding it; a fragment drops its whole message. */
+    WS_RATE_LIMIT_CLOSE = 2   /**< Close the connection with status 1008. */
+} ws_rate_limit_action_t;
+
+/**
+ * @struct ws_rate_limit_stats_t
+ * @brief Counters for the outcome of inbound rate limiting.
+ */
+typedef struct {
+    uint32_t accepted;  /**< Frames admitted without waiting. */
+    uint32_t delayed;   /**< Frames admitted after waiting for tokens. */
+    uint32_t dropped;   /**< Frames skipped because of the limit. */
+    uint32_t closed;    /**< Connections closed because of the limit. */
+} ws_rate_limit_stats_t;
+
+/**
+ * @struct ws_memory_stats_t
+ * @brief Counters of the connection buffers budget.
+ */
+typedef struct {
+    size_t used;                    /**< Bytes currently reserved. */
+    size_t peak;                    /**< Highest reserved bytes since start. */
+    size_t budget;                  /**< Configured budget, 0 for unlimited. */
+    uint32_t failed_reservations;   /**< Buffer reservations refused. */
+    uint32_t rejected_connections;  /**< Upgrades answered with HTTP 503. */
+    uint32_t shed_frames;           /**< Outbound frames discarded under pressure. */
+    size_t shed_bytes;              /**< Outbound bytes discarded under pressure. */
+} ws_memory_stats_t;
+
+/**
+ * @enum ws_auth_mode_t
+ * @brief How clients prove they may open a session.
+ */
+typedef enum {
+    WS_AUTH_NONE  = 0,  /**< Every upgrade is accepted. */
+    WS_AUTH_TOKEN = 1,  /**< The client sends the shared token itself. */
+    WS_AUTH_HMAC  = 2   /**< The client sends "<unix time>.<hex HMAC-SHA256(token, unix time)>". */
+} ws_auth_mode_t;
+
+/**
+ * @struct ws_auth_stats_t
+ * @brief Counters of upgrade authentication.
+ */
+typedef struct {
+    uint32_t authorized;      /**< Upgrades with a valid credential. */
+    uint32_t rejected;        /**< Upgrades answered with HTTP 401. */
+    uint64_t reject_time_us;  /**< Total time spent rejecting, from reading the request to closing the socket. */
+} ws_auth_stats_t;
+
+/**
+ * @enum ws_network_mode_t
+ * @brief Who brings up the network interface the server listens on.
+ */
+typedef enum {
+    WS_NETWORK_SOFTAP   = 0,  /**< The server starts its own access point. */
+    WS_NETWORK_EXTERNAL = 1   /**< The application configures station, Ethernet or an AP itself. */
+} ws_network_mode_t;
+
+/**
+ * @enum ws_run_mode_t
+ * @brief What drives the server loop.
+ */
+typedef enum {
+    WS_RUN_TASK   = 0,  /**< start() creates the ws_client_handler task. */
+    WS_RUN_POLLED = 1   /**< No task or timer; the application calls poll() or pollPrepare()/pollDispatch(). */
+} ws_run_mode_t;
+
+/**
+ * @struct ws_rx_buffer_stats_t
+ * @brief Receive buffer sizes across connections.
+ */
+typedef struct {
+    size_t total;     /**< Bytes held by all receive buffers. */
+    size_t largest;   /**< Largest receive buffer. */
+    uint32_t grows;   /**< Buffers grown since start. */
+    uint32_t shrinks; /**< Buffers shrunk since start. */
+    uint64_t buffered_bytes; /**< Payload bytes copied out of a receive buffer into their message. */
+    uint64_t direct_bytes;   /**< Payload bytes received straight into their final buffer. */
+} ws_rx_buffer_stats_t;
+
+/**
+ * @enum ws_priority_t
+ * @brief Outbound traffic class of a connection.
+ */
+typedef enum {
+    WS_PRIORITY_LOW    = 0,  /**< Passive consumers such as monitors. */
+    WS_PRIORITY_NORMAL = 1,  /**< Default class of new connections. */
+    WS_PRIORITY_HIGH   = 2,  /**< Interactive clients such as an operator console. */
+    WS_PRIORITY_COUNT  = 3   /**< Number of classes. */
+} ws_priority_t;
+
+/**
+ * @struct ws_priority_stats_t
+ * @brief Outbound counters of one priority class.
+ */
+typedef struct {
+    uint32_t connections;  /**< Open connections in the class. */
+    uint32_t frames_sent;  /**< Frames fully written since start. */
+    uint64_t bytes_sent;   /**< Bytes written since start. */
+    size_t queued_bytes;   /**< Bytes waiting in the outbound queues. */
+} ws_priority_stats_t;
+
+/**
+ * @struct ws_wakeup_stats_t
+ * @brief How often the server task left its wait.
+ */
+typedef struct {
+    uint32_t wakeups;          /**< Passes of the server loop since start. */
+    uint32_t timer_wakeups;    /**< Passes started by a deadline rather than socket activity. */
+    uint32_t wake_requests;    /**< Wakeups asked for by other tasks, such as a queued send. */
+    uint32_t wakeups_per_sec;  /**< Passes per second over the most recent window of at least one second. */
+} ws_wakeup_stats_t;
+
+/**
+ * @struct ws_conn_handle_t
+ * @brief Identifies one WebSocket session, unlike the socket number which lwIP reuses at once.
+ *
+ * A zero-initialized handle never matches a session.
+ */
+typedef struct {
+    uint16_t slot;        /**< Connection slot. */
+    uint16_t generation;  /**< Session counter stamped when the slot opened, never 0. */
+} ws_conn_handle_t;
+
+/**
+ * @struct ws_message_view_t
+ * @brief A received text or binary message, lent to WSLightServer::onConnectionMessage().
+ */
+typedef struct {
+    const uint8_t *data;  /**< Unmasked payload, valid until the callback returns. */
+    size_t length;        /**< Payload length. */
+    ws_type_t type;       /**< HTTPD_WS_TYPE_TEXT or HTTPD_WS_TYPE_BINARY. */
+} ws_message_view_t;
+
+/**
+ * @enum ws_rx_digest_t
+ * @brief Checksums computed over inbound binary messages while they are unmasked, combinable as flags.
+ */
+typedef enum {
+    WS_DIGEST_NONE   = 0x0,  /**< No checksum. */
+    WS_DIGEST_CRC32  = 0x1,  /**< CRC-32 as computed by esp_rom_crc32_le() and zlib. */
+    WS_DIGEST_SHA256 = 0x2   /**< SHA-256 through mbedTLS. */
+} ws_rx_digest_t;
+
+/**
+ * @struct ws_message_digest_t
+ * @brief Checksums of the binary message being received, or of the last one.
+ */
+typedef struct {
+    uint64_t length;     /**< Payload bytes covered so far. */
+    uint32_t crc32;      /**< CRC-32 of those bytes, if WS_DIGEST_CRC32 is set. */
+    uint8_t sha256[32];  /**< SHA-256 of those bytes, if WS_DIGEST_SHA256 is set. */
+    bool complete;       /**< The message has ended; otherwise more bytes are still to come. */
+} ws_message_digest_t;
+
+/**
+ * @struct ws_tx_reservation_t
+ * @brief Room reserved by WSLightServer::reserveMessage() in the outbound ring of a session.
+ */
+typedef struct {
+    ws_conn_handle_t handle;  /**< Session the message goes to. */
+    uint8_t *data;            /**< Where the payload is written, nullptr once committed or cancelled. */
+    size_t length;            /**< Bytes reserved. */
+} ws_tx_reservation_t;
+
+/**
+ * @struct ws_close_stats_t
+ * @brief Outcome of connection closes and slot reclamation.
+ */
+typedef struct {
+    uint32_t initiated;        /**< Closing handshakes started by the server. */
+    uint32_t received;         /**< Closing handshakes started by a client. */
+    uint32_t completed;        /**< Handshakes where both close frames were exchanged. */
+    uint32_t linger_timeouts;  /**< Server closes given up after close_linger_ms without an answer. */
+    uint32_t aborted;          /**< Sessions lost without a close frame. */
+    uint32_t reclaimed;        /**< Connection slots freed, handshakes included. */
+} ws_close_stats_t;
@@ -0,0 +1,139 @@
+/**
+ * @file ws_auth.cpp
+ * @brief WSAuthenticator implementation.
+ *
+ * @author Daniel Giménez
+ * @date 2024-08-05
+ * @license MIT License
+ */
+
+#include "ws_auth.h"
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include <mbedtls/md.h>
+
+/**
+ * @brief Compare two strings in a time that only depends on their lengths.
+ */
+static bool constant_time_equals(const std::string &a, const std::string &b)
+{
+    if (a.size() != b.size())
+    {
+        return false;
+    }
+    uint8_t diff = 0;
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        diff |= static_cast<uint8_t>(a[i] ^ b[i]);
+    }
+    return diff == 0;
+}
+
+void WSAuthenticator::configure(const ws_auth_config_t &config)
+{
+    mode = config.mode;
+    secret = config.token != nullptr ? config.token : "";
+    query_param = config.query_param != nullptr ? config.query_param : "";
+    max_clock_skew_s = config.max_clock_skew_s;
+}
+
+bool WSAuthenticator::authorize(const std::string &request) const
+{
+    if (mode == WS_AUTH_NONE)
+    {
+        return true;
+    }
+
+    std::string credential = extract_credential(request);
+    if (credential.empty())
+    {
+        return false;
+    }
+    if (mode == WS_AUTH_HMAC)
+    {
+        return check_hmac(credential);
+    }
+    return constant_time_equals(credential, secret);
+}
+
+std::string WSAuthenticator::extract_credential(const std::string &request) const
+{
+    size_t line_end = request.find("\r\n");
+    std::string request_line = request.substr(0, line_end);
+
+    std::string request_lower = request;
+    std::transform(request_lower.begin(), request_lower.end(), request_lower.begin(), ::tolower);
+    size_t start = request_lower.find("\r\nauthorization: bearer ");
+    if (start != std::string::npos)
+    {
+        start += 24;
+        size_t end = request.find("\r\n", start);
+        return request.substr(start, end == std::string::npos ? std::string::npos : end - start);
+    }
+
+    if (query_param.empty())
+    {
+        return "";
+    }
+    size_t query = request_line.find('?');
+    size_t path_end = request_line.find(' ', query);
+    while (query != std::string::npos && query < path_end)
+    {
+        size_t name_start = query + 1;
+        size_t next = request_line.find('&', name_start);
+        if (next == std::string::npos || next > path_end)
+        {
+            next = path_end;
+        }
+        if (request_line.compare(name_start, query_param.size(), query_param) == 0 &&
+            request_line[name_start + query_param.size()] == '=')
+        {
+            size_t value_start = name_start + query_param.size() + 1;
+            return request_line.substr(value_start, next - value_start);
+        }
+        query = next < path_end ? next : std::string::npos;
+    }
+    return "";
+}
+
+bool WSAuthenticator::check_hmac(const std::string &credential) const
+{
+    size_t dot = credential.find('.');
+    if (dot == std::string::npos || dot == 0)
+    {
+        return false;
+    }
+    std::string timestamp = credential.substr(0, dot);
+    if (timestamp.find_first_not_of("0123456789") != std::string::npos)
+    {
+        return false;
+    }
+
+    int64_t sent = strtoll(timestamp.c_str(), nullptr, 10);
+    int64_t now = static_cast<int64_t>(time(nullptr));
+    if (llabs(now - sent) > static_cast<int64_t>(max_clock_skew_s))
+    {
+        return false;
+    }
+
+    unsigned char mac[32];
+    if (mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256),
+                        reinterpret_cast<const unsigned char *>(secret.data()), secret.size(),
+                        reinterpret_cast<const unsigned char *>(timestamp.data()), timestamp.size(), mac) != 0)
+    {
+        return false;
+    }
+
+    static const char hex[] = "0123456789abcdef";
+    std::string expected(sizeof(mac) * 2, '0');
+    for (size_t i = 0; i < sizeof(mac); ++i)
+    {
+        expected[2 * i] = hex[mac[i] >> 4];
+        expected[2 * i + 1] = hex[mac[i] & 0x0F];
+    }
+
+    std::string signature = credential.substr(dot + 1);
+    std::transform(signature.begin(), signature.end(), signature.begin(), ::tolower);
+    return constant_time_equals(signature, expected);
+}
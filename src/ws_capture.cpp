@@ -0,0 +1,112 @@
+/**
+ * @file ws_capture.cpp
+ * @brief WSCaptureRing implementation.
+ *
+ * @author Daniel Giménez
+ * @date 2024-08-05
+ * @license MIT License
+ */
+
+#include "ws_capture.h"
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <esp_timer.h>
+
+/** Size of a ws_capture_record_t once serialized. */
+static constexpr size_t RECORD_HEADER_SIZE = 10;
+
+WSCaptureRing::~WSCaptureRing()
+{
+    vPortFree(buffer);
+}
+
+esp_err_t WSCaptureRing::init(size_t capacity)
+{
+    if (capacity < 64 || (capacity & (capacity - 1)) != 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    vPortFree(buffer);
+    buffer = static_cast<uint8_t *>(pvPortMalloc(capacity));
+    if (buffer == nullptr)
+    {
+        this->capacity = 0;
+        return ESP_ERR_NO_MEM;
+    }
+    this->capacity = capacity;
+    head.store(0);
+    tail.store(0);
+    dropped_records.store(0);
+    start_us = esp_timer_get_time();
+    return ESP_OK;
+}
+
+void WSCaptureRing::copy_in(size_t position, const uint8_t *data, size_t length)
+{
+    size_t index = position & (capacity - 1);
+    size_t first = length < capacity - index ? length : capacity - index;
+    memcpy(buffer + index, data, first);
+    memcpy(buffer, data + first, length - first);
+}
+
+bool WSCaptureRing::record(uint16_t conn, ws_capture_kind_t kind, const uint8_t *data, size_t length)
+{
+    if (buffer == nullptr)
+    {
+        return false;
+    }
+
+    uint32_t time_us = static_cast<uint32_t>(esp_timer_get_time() - start_us);
+    do
+    {
+        uint16_t chunk = length > UINT16_MAX ? UINT16_MAX : static_cast<uint16_t>(length);
+        size_t position = head.load(std::memory_order_relaxed);
+        size_t used = position - tail.load(std::memory_order_acquire);
+        if (capacity - used < RECORD_HEADER_SIZE + chunk)
+        {
+            dropped_records.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        uint8_t header[RECORD_HEADER_SIZE] = {
+            static_cast<uint8_t>(time_us), static_cast<uint8_t>(time_us >> 8),
+            static_cast<uint8_t>(time_us >> 16), static_cast<uint8_t>(time_us >> 24),
+            static_cast<uint8_t>(conn), static_cast<uint8_t>(conn >> 8),
+            static_cast<uint8_t>(kind), 0,
+            static_cast<uint8_t>(chunk), static_cast<uint8_t>(chunk >> 8)};
+        copy_in(position, header, RECORD_HEADER_SIZE);
+        if (chunk > 0)
+        {
+            copy_in(position + RECORD_HEADER_SIZE, data, chunk);
+        }
+        // Publish the whole record at once so the consumer never sees half of it.
+        head.store(position + RECORD_HEADER_SIZE + chunk, std::memory_order_release);
+
+        data += chunk;
+        length -= chunk;
+    } while (length > 0);
+    return true;
+}
+
+size_t WSCaptureRing::read(uint8_t *dest, size_t length)
+{
+    if (buffer == nullptr)
+    {
+        return 0;
+    }
+
+    size_t position = tail.load(std::memory_order_relaxed);
+    size_t available = head.load(std::memory_order_acquire) - position;
+    size_t count = length < available ? length : available;
+    size_t index = position & (capacity - 1);
+    size_t first = count < capacity - index ? count : capacity - index;
+    memcpy(dest, buffer + index, first);
+    memcpy(dest + first, buffer, count - first);
+    tail.store(position + count, std::memory_order_release);
+    return count;
+}
+
+size_t WSCaptureRing::pending() const
+{
+    return head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed);
+}
@@ -32,28 +32,220 @@
  */
 
 #include "ws_light_server.h"
+#include "ws_frame.h"
+#include <algorithm>
 #include <cstring>
 #include <lwip/netdb.h>
 #include <mbedtls/base64.h>
 #include <mbedtls/sha1.h>
+#include <sdkconfig.h>
+#include <esp_check.h>
+#include <esp_rom_crc.h>
+#if !CONFIG_IDF_TARGET_LINUX
+#include <esp_wifi.h>
 #include <nvs_flash.h>
+#endif
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <esp_log.h>
 #include <esp_timer.h>
+#if CONFIG_IDF_TARGET_LINUX
+#include <sys/eventfd.h>
+#else
+#include <esp_vfs_eventfd.h>
+#endif
 
 WSLightServer *WSLightServer::instance = nullptr;
-WSLightServer::DecodedMessage WSLightServer::accumulated_message = {nullptr, 0};
 
-void log_frame_details(const std::vector<uint8_t> &frame)
+/** Longest select() wait, so frames queued by other tasks are flushed promptly. */
+static constexpr uint32_t POLL_INTERVAL_MS = 10;
+
+/** Most ring frames handed to one sendmsg(). */
+static constexpr size_t TX_RING_BATCH = 8;
+
+/**
+ * @brief Find the first queued frame that may be shed.
+ *
+ * The head frame may be partly sent and the pings and pongs behind it are kept, so
+ * shedding starts at the first later frame opening a message; a fragmented message
+ * is never cut short.
+ *
+ * @param conn Client connection.
+ * @return Queue index, tx_queue.size() if nothing can be shed.
+ */
+static size_t shed_start(const ws_connection_t &conn)
+{
+    for (size_t i = 1 + conn.tx_urgent; i < conn.tx_queue.size(); ++i)
+    {
+        if ((conn.tx_queue[i][0] & 0x0F) != HTTPD_WS_TYPE_CONTINUE)
+        {
+            return i;
+        }
+    }
+    return conn.tx_queue.size();
+}
+
+/**
+ * @brief Check that a close code may appear on the wire (RFC 6455, section 7.4).
+ */
+static bool valid_close_code(uint16_t code)
+{
+    return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1014) || (code >= 3000 && code <= 4999);
+}
+
+/**
+ * @brief Check that text messages and close reasons are well-formed UTF-8.
+ */
+static bool valid_utf8(const uint8_t *data, size_t len)
+{
+    size_t i = 0;
+    while (i < len)
+    {
+        uint8_t c = data[i];
+        size_t extra;
+        uint32_t cp;
+        if (c < 0x80)
+        {
+            i++;
+            continue;
+        }
+        else if ((c & 0xE0) == 0xC0)
+        {
+            extra = 1;
+            cp = c & 0x1F;
+        }
+        else if ((c & 0xF0) == 0xE0)
+        {
+            extra = 2;
+            cp = c & 0x0F;
+        }
+        else if ((c & 0xF8) == 0xF0)
+        {
+            extra = 3;
+            cp = c & 0x07;
+        }
+        else
+        {
+            return false;
+        }
+        if (i + extra >= len)
+        {
+            return false;
+        }
+        for (size_t k = 1; k <= extra; ++k)
+        {
+            if ((data[i + k] & 0xC0) != 0x80)
+            {
+                return false;
+            }
+            cp = (cp << 6) | (data[i + k] & 0x3F);
+        }
+        // Reject overlong forms, UTF-16 surrogates and code points past U+10FFFF.
+        static const uint32_t min_cp[] = {0, 0x80, 0x800, 0x10000};
+        if (cp < min_cp[extra] || (cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF)
+        {
+            return false;
+        }
+        i += extra + 1;
+    }
+    return true;
+}
+
+/**
+ * @brief Unmask payload bytes into their destination.
+ * @param dest Destination, may equal src.
+ * @param src Masked bytes.
+ * @param len Number of bytes.
+ * @param mask Masking key of the frame.
+ * @param position Offset of the first byte within the payload.
+ */
+static void unmask_payload(uint8_t *dest, const uint8_t *src, size_t len, const uint8_t *mask, uint64_t position)
+{
+    size_t i = 0;
+    for (; i < len && (reinterpret_cast<uintptr_t>(dest + i) & 3) != 0; ++i)
+    {
+        dest[i] = src[i] ^ mask[(position + i) % 4];
+    }
+
+    // A word at a time from the first aligned destination byte, with the key rotated to match.
+    uint8_t rotated[4];
+    for (size_t k = 0; k < 4; ++k)
+    {
+        rotated[k] = mask[(position + i + k) % 4];
+    }
+    uint32_t key;
+    memcpy(&key, rotated, sizeof(key));
+    for (; i + 4 <= len; i += 4)
+    {
+        uint32_t word;
+        memcpy(&word, src + i, sizeof(word));
+        word ^= key;
+        memcpy(dest + i, &word, sizeof(word));
+    }
+
+    for (; i < len; ++i)
+    {
+        dest[i] = src[i] ^ mask[(position + i) % 4];
+    }
+}
+
+/** Bytes unmasked before the rx_digest checksums catch up, well within the PSRAM cache. */
+static constexpr size_t DIGEST_BLOCK_SIZE = 4096;
+
+void log_frame_details(const uint8_t *frame, size_t len)
 {
-    ESP_LOGW("WSLightServer", "Frame Size: %zu", frame.size());
+    ESP_LOGW("WSLightServer", "Frame Size: %zu", len);
     ESP_LOGW("WSLightServer", "Frame Data:");
-    esp_log_buffer_hex("WSLightServer", frame.data(), frame.size());
+    esp_log_buffer_hex("WSLightServer", frame, len);
 
     ESP_LOGW("WSLightServer", "");
 }
 
+/**
+ * @brief Parse the length fields of a frame header.
+ * @param frame Start of the frame.
+ * @param len Bytes available.
+ * @param header_len Header length including the mask key.
+ * @param payload_len Payload length.
+ * @return false if more bytes are needed to know the lengths.
+ */
+static bool parse_frame_lengths(const uint8_t *frame, size_t len, size_t &header_len, uint64_t &payload_len)
+{
+    if (len < 2)
+    {
+        return false;
+    }
+    payload_len = frame[1] & 0x7F;
+    header_len = 2;
+    if (payload_len == 126)
+    {
+        if (len < 4)
+        {
+            return false;
+        }
+        payload_len = (frame[2] << 8) | frame[3];
+        header_len = 4;
+    }
+    else if (payload_len == 127)
+    {
+        if (len < 10)
+        {
+            return false;
+        }
+        payload_len = 0;
+        for (int i = 0; i < 8; ++i)
+        {
+            payload_len = (payload_len << 8) | frame[2 + i];
+        }
+        header_len = 10;
+    }
+    if (frame[1] & 0x80)
+    {
+        header_len += 4;
+    }
+    return true;
+}
+
 WSLightServer &WSLightServer::getInstance()
 {
     if (instance == nullptr)
@@ -64,7 +256,12 @@ WSLightServer &WSLightServer::getInstance()
 }
 
 WSLightServer::WSLightServer()
-    : server_sock(-1), client_sock(-1), ping_pong_enabled(true)
+    : server_sock(-1), wake_sock(-1), wake_pending(false), isr_wake_fd(-1), isr_wake_pending(false), isr_senders(0), tx_rings_open(false), tx_rings_live(false), ring_callers(0), next_ping_us(0), server_task(nullptr), notify_task(nullptr), polled(false), lent_message(nullptr), in_poll(false),
+      stop_requested(false), drain_timeout_ms(0), listen_result(ESP_FAIL), network_initialized(false),
+      conn_lock(xSemaphoreCreateRecursiveMutex()),
+      rate_limit_stats{}, auth_stats{}, rejected_connections(0), next_slot(0), priority_stats{}, rx_grows(0), rx_shrinks(0), rx_buffered_bytes(0), rx_direct_bytes(0), shed_frames(0), shed_bytes(0),
+      wakeup_stats{}, close_stats{}, wakeup_window_us(0), wakeup_window_count(0),
+      session_generation(0), outbox_target{}, outbox_appends(0), outbox_wait_bytes(0)
 {
 }
 
@@ -79,28 +276,268 @@ esp_err_t WSLightServer::start(const char *ssid,
                                uint32_t stack,
                                size_t relief_delay)
 {
-    this->max_inactivity_ms = max_inactivity_ms;
-    this->ping_pong_enabled = enable_ping_pong;
-    this->ping_interval_ms = ping_interval_ms;
-    this->port = port;
-    this->relief_delay = relief_delay;
+    ws_server_config_t config;
+    config.ssid = ssid;
+    config.password = password;
+    config.port = port;
+    config.ping_interval_ms = ping_interval_ms;
+    config.max_inactivity_ms = max_inactivity_ms;
+    config.enable_ping_pong = enable_ping_pong;
+    config.extra_config = extra_config;
+    config.stack = stack;
+    config.relief_delay = relief_delay;
+    return start(config);
+}
+
+esp_err_t WSLightServer::start(const ws_server_config_t &config)
+{
+    if (running())
+    {
+        ESP_LOGE("WSLightServer", "Server already running");
+        return ESP_ERR_INVALID_STATE;
+    }
 
-    if (wifi_init(ssid, password, extra_config) == ESP_OK)
+    bool bring_up_ap = config.network == WS_NETWORK_SOFTAP && !network_initialized;
+    if (bring_up_ap)
     {
-        xTaskCreatePinnedToCore(&WSLightServer::handle_client_wrapper, "ws_client_handler", stack, this, 8, NULL, tskNO_AFFINITY);
+        ESP_RETURN_ON_ERROR(network_init(), "WSLightServer", "Network initialization failed");
     }
-    else
+
+    // Listen first; the socket is bound to every interface and serves the AP as soon as it is up.
+    esp_err_t err = start_server(config);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    if (bring_up_ap)
+    {
+        err = wifi_init(config.ssid, config.password, config.extra_config);
+        if (err != ESP_OK)
+        {
+            stop(0);
+            return err;
+        }
+    }
+    network_initialized = true;
+    return ESP_OK;
+}
+
+esp_err_t WSLightServer::restart(const ws_server_config_t &config, uint32_t drain_timeout_ms)
+{
+    if (!network_initialized)
     {
-        return ESP_FAIL;
+        return start(config);
     }
 
+    if (running())
+    {
+        esp_err_t err = stop(drain_timeout_ms);
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+    }
+    return start_server(config);
+}
+
+esp_err_t WSLightServer::stop(uint32_t drain_timeout_ms)
+{
+    if (!running())
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (xTaskGetCurrentTaskHandle() == server_task || in_poll)
+    {
+        ESP_LOGE("WSLightServer", "stop() cannot be called from a server callback");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    this->drain_timeout_ms = drain_timeout_ms;
+    if (polled)
+    {
+        shutdown_server();
+        polled = false;
+        ESP_LOGI("WSLightServer", "Server stopped");
+        return ESP_OK;
+    }
+    notify_task = xTaskGetCurrentTaskHandle();
+    stop_requested = true;
+    wake_server_task();
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    ESP_LOGI("WSLightServer", "Server stopped");
     return ESP_OK;
 }
 
+esp_err_t WSLightServer::start_server(const ws_server_config_t &config)
+{
+    if (config.max_connections == 0)
+    {
+        ESP_LOGE("WSLightServer", "max_connections must be at least 1");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (config.rx_buffer_initial < 14 || config.rx_buffer_initial > config.rx_buffer_size)
+    {
+        ESP_LOGE("WSLightServer", "rx_buffer_initial must hold a frame header and not exceed rx_buffer_size");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (config.priority.default_class < 0 || config.priority.default_class >= WS_PRIORITY_COUNT)
+    {
+        ESP_LOGE("WSLightServer", "priority.default_class is not a valid class");
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (uint16_t weight : config.priority.weights)
+    {
+        // A weight of 0 would serve its class a byte per pass; the quantum of a class must not wrap.
+        if (weight == 0 || config.scheduling.write_quantum > SIZE_MAX / weight)
+        {
+            ESP_LOGE("WSLightServer", "priority.weights must be at least 1 and keep write_quantum times a weight in range");
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    if (config.tx_ring_size != 0 && (config.tx_ring_size < 64 || (config.tx_ring_size & (config.tx_ring_size - 1)) != 0))
+    {
+        ESP_LOGE("WSLightServer", "tx_ring_size must be 0 or a power of two of at least 64");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (config.isr_submission && config.tx_ring_size == 0)
+    {
+        ESP_LOGE("WSLightServer", "isr_submission needs tx_ring_size");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (config.auth.mode != WS_AUTH_NONE && config.auth.mode != WS_AUTH_TOKEN && config.auth.mode != WS_AUTH_HMAC)
+    {
+        ESP_LOGE("WSLightServer", "auth.mode is not a valid mode");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (config.auth.mode != WS_AUTH_NONE && (config.auth.token == nullptr || config.auth.token[0] == '\0'))
+    {
+        // Refuse to start open to everyone when the secret is missing.
+        ESP_LOGE("WSLightServer", "auth.mode needs auth.token");
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (config.rx_digest & ~(WS_DIGEST_CRC32 | WS_DIGEST_SHA256))
+    {
+        ESP_LOGE("WSLightServer", "rx_digest has unknown flags");
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    this->config = config;
+    rate_limit_stats = {};
+    auth_stats = {};
+    rejected_connections = 0;
+    rx_grows = 0;
+    rx_shrinks = 0;
+    rx_buffered_bytes = 0;
+    rx_direct_bytes = 0;
+    shed_frames = 0;
+    shed_bytes = 0;
+    memset(priority_stats, 0, sizeof(priority_stats));
+    wakeup_stats = {};
+    close_stats = {};
+    wakeup_window_us = esp_timer_get_time();
+    wakeup_window_count = 0;
+    memory.configure(config.memory.budget, config.memory.shed_threshold_pct);
+    authenticator.configure(config.auth);
+    connections.assign(config.max_connections, ws_connection_t());
+    tx_rings = std::vector<WSTxRing>(config.tx_ring_size != 0 ? config.max_connections : 0);
+    if (!tx_rings.empty())
+    {
+        size_t ring_bytes = config.tx_ring_size * tx_rings.size();
+        bool allocated = memory.reserve(ring_bytes);
+        for (size_t i = 0; allocated && i < tx_rings.size(); ++i)
+        {
+            allocated = tx_rings[i].init(config.tx_ring_size) == ESP_OK;
+        }
+        if (!allocated)
+        {
+            ESP_LOGE("WSLightServer", "No memory for %zu bytes of outbound rings", ring_bytes);
+            memory.release(ring_bytes);
+            std::vector<WSTxRing>().swap(tx_rings);
+            return ESP_ERR_NO_MEM;
+        }
+        tx_rings_live = true;
+        tx_rings_open = true;
+    }
+
+    stop_requested = false;
+    listen_result = ESP_FAIL;
+    if (config.run_mode == WS_RUN_POLLED)
+    {
+        if (!setup_server())
+        {
+            ESP_LOGE("WSLightServer", "Server setup failed");
+            shutdown_server();
+            return listen_result;
+        }
+        polled = true;
+        listen_result = ESP_OK;
+        if (server_ready_callback)
+        {
+            server_ready_callback();
+        }
+        return ESP_OK;
+    }
+
+    notify_task = xTaskGetCurrentTaskHandle();
+    if (xTaskCreatePinnedToCore(&WSLightServer::handle_client_wrapper, "ws_client_handler", config.stack, this, 8, &server_task, tskNO_AFFINITY) != pdPASS)
+    {
+        ESP_LOGE("WSLightServer", "Failed to create server task");
+        server_task = nullptr;
+        shutdown_server();
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Wait until the socket is listening so the result can be reported.
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    return listen_result;
+}
+
 void WSLightServer::handle_client_wrapper(void *arg)
 {
     WSLightServer *server = static_cast<WSLightServer *>(arg);
     server->handle_client();
+
+    TaskHandle_t waiting = server->notify_task;
+    server->server_task = nullptr;
+    xTaskNotifyGive(waiting);
+    vTaskDelete(nullptr);
+}
+
+esp_err_t WSLightServer::poll(uint32_t timeout_ms)
+{
+    if (!polled || in_poll)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    in_poll = true;
+    run_once(timeout_ms);
+    in_poll = false;
+    return ESP_OK;
+}
+
+int WSLightServer::pollPrepare(fd_set *read_fds, fd_set *write_fds, uint32_t *timeout_ms)
+{
+    if (!polled || in_poll)
+    {
+        return -1;
+    }
+    in_poll = true;
+    int max_fd = prepare_poll(*read_fds, *write_fds, *timeout_ms);
+    in_poll = false;
+    return max_fd;
+}
+
+esp_err_t WSLightServer::pollDispatch(const fd_set *read_fds, const fd_set *write_fds)
+{
+    if (!polled || in_poll)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    in_poll = true;
+    dispatch_poll(*read_fds, *write_fds);
+    in_poll = false;
+    return ESP_OK;
 }
 
 void WSLightServer::onTextMessage(std::function<void(int, const std::string &)> callback)
@@ -113,6 +550,18 @@ void WSLightServer::onBinaryMessage(std::function<void(int, const std::vector<ui
     binary_message_callback = callback;
 }
 
+void WSLightServer::onBinaryBuffer(std::function<uint8_t *(int, size_t)> provider,
+                                   std::function<void(int, uint8_t *, size_t, esp_err_t)> complete)
+{
+    if (provider && !complete)
+    {
+        ESP_LOGE("WSLightServer", "onBinaryBuffer needs a complete callback");
+        provider = nullptr;
+    }
+    binary_buffer_provider = provider;
+    binary_buffer_complete = provider ? complete : nullptr;
+}
+
 void WSLightServer::onPingMessage(std::function<void(int)> callback)
 {
     ping_message_callback = callback;
@@ -128,6 +577,11 @@ void WSLightServer::onCloseMessage(std::function<void(int)> callback)
     close_message_callback = callback;
 }
 
+void WSLightServer::onCloseStatus(std::function<void(int, uint16_t, const std::string &)> callback)
+{
+    close_status_callback = callback;
+}
+
 void WSLightServer::onClientConnected(std::function<void(int)> callback)
 {
     client_connected_callback = callback;
@@ -136,26 +590,77 @@ void WSLightServer::onClientConnected(std::function<void(int)> callback)
 void WSLightServer::onClientDisconnected(std::function<void(int)> callback)
 {
     client_disconnected_callback = callback;
-    client_sock = -1;
 }
 
-esp_err_t WSLightServer::wifi_init(const char *ssid, const char *password, std::function<void()> extra_config)
+void WSLightServer::onConnectionOpened(std::function<void *(ws_conn_handle_t)> callback)
+{
+    connection_opened_callback = callback;
+}
+
+void WSLightServer::onConnectionText(std::function<void(ws_conn_handle_t, void *, const std::string &)> callback)
+{
+    connection_text_callback = callback;
+}
+
+void WSLightServer::onConnectionBinary(std::function<void(ws_conn_handle_t, void *, const std::vector<uint8_t> &)> callback)
+{
+    connection_binary_callback = callback;
+}
+
+void WSLightServer::onConnectionMessage(std::function<void(ws_conn_handle_t, void *, const ws_message_view_t &)> callback)
+{
+    connection_message_callback = callback;
+}
+
+void WSLightServer::onConnectionClosed(std::function<void(ws_conn_handle_t, void *)> callback)
 {
+    connection_closed_callback = callback;
+}
+
+void WSLightServer::onDrain(std::function<void(int)> callback)
+{
+    drain_callback = callback;
+}
+
+void WSLightServer::onServerReady(std::function<void()> callback)
+{
+    server_ready_callback = callback;
+}
+
+esp_err_t WSLightServer::network_init()
+{
+#if CONFIG_IDF_TARGET_LINUX
+    return ESP_OK;
+#else
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND)
     {
-        ESP_ERROR_CHECK(nvs_flash_erase());
+        ESP_RETURN_ON_ERROR(nvs_flash_erase(), "WSLightServer", "Failed to erase NVS");
         ret = nvs_flash_init();
     }
-    ESP_ERROR_CHECK(ret);
+    ESP_RETURN_ON_ERROR(ret, "WSLightServer", "Failed to initialize NVS");
+    ESP_RETURN_ON_ERROR(esp_netif_init(), "WSLightServer", "Failed to initialize esp_netif");
 
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    // The application may already own the default event loop.
+    ret = esp_event_loop_create_default();
+    if (ret != ESP_ERR_INVALID_STATE)
+    {
+        ESP_RETURN_ON_ERROR(ret, "WSLightServer", "Failed to create the default event loop");
+    }
+    return ESP_OK;
+#endif
+}
 
+esp_err_t WSLightServer::wifi_init(const char *ssid, const char *password, std::function<void()> extra_config)
+{
+#if CONFIG_IDF_TARGET_LINUX
+    ESP_LOGI("WSLightServer", "Host build, Wi-Fi bring-up skipped");
+    return ESP_OK;
+#else
     esp_netif_create_default_wifi_ap();
 
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
-    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    ESP_RETURN_ON_ERROR(esp_wifi_init(&cfg), "WSLightServer", "Failed to initialize Wi-Fi");
 
     wifi_config_t ap_config = {};
     strncpy((char *)ap_config.ap.ssid, ssid, sizeof(ap_config.ap.ssid) - 1);
@@ -163,7 +668,13 @@ esp_err_t WSLightServer::wifi_init(const char *ssid, const char *password, std::
 
     strncpy((char *)ap_config.ap.password, password, sizeof(ap_config.ap.password) - 1);
     ap_config.ap.password[sizeof(ap_config.ap.password) - 1] = '\0';
-    ap_config.ap.max_connection = 1;
+    ap_config.ap.max_connection = config.max_connections;
+#ifdef ESP_WIFI_MAX_CONN_NUM
+    if (ap_config.ap.max_connection > ESP_WIFI_MAX_CONN_NUM)
+    {
+        ap_config.ap.max_connection = ESP_WIFI_MAX_CONN_NUM;
+    }
+#endif
     ap_config.ap.authmode = WIFI_AUTH_WPA_WPA2_PSK;
 
     if (strlen(password) == 0)
@@ -171,265 +682,2248 @@ esp_err_t WSLightServer::wifi_init(const char *ssid, const char *password, std::
         ap_config.ap.authmode = WIFI_AUTH_OPEN;
     }
 
-    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_AP));
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_AP, &ap_config));
+    ESP_RETURN_ON_ERROR(esp_wifi_set_mode(WIFI_MODE_AP), "WSLightServer", "Failed to set Wi-Fi mode");
+    ESP_RETURN_ON_ERROR(esp_wifi_set_config(WIFI_IF_AP, &ap_config), "WSLightServer", "Failed to configure the access point");
     if (extra_config)
     {
         extra_config();
     }
-    ESP_ERROR_CHECK(esp_wifi_start());
+    ESP_RETURN_ON_ERROR(esp_wifi_start(), "WSLightServer", "Failed to start Wi-Fi");
 
     ESP_LOGI("WSLightServer", "Wi-Fi initialized. SSID:%s password:%s", ssid, password);
     return ESP_OK;
+#endif
 }
 
-void WSLightServer::send_ping(TimerHandle_t xTimer)
+void WSLightServer::service_timers(int64_t now)
 {
-    WSLightServer *server = static_cast<WSLightServer *>(pvTimerGetTimerID(xTimer));
-    if (server->client_sock > 0)
+    if (config.enable_ping_pong && now >= next_ping_us)
     {
-        std::vector<uint8_t> ping_frame = server->encode_frame("", HTTPD_WS_TYPE_PING);
-        send(server->client_sock, ping_frame.data(), ping_frame.size(), 0);
-        if (debug)
+        next_ping_us = now + static_cast<int64_t>(config.ping_interval_ms) * 1000;
+        if (send_frame(-1, encode_frame("", HTTPD_WS_TYPE_PING)) == ESP_OK && debug)
         {
-            ESP_LOGI("WSLightServer", "Sending ping to client: %d", server->client_sock);
+            ESP_LOGI("WSLightServer", "Sending ping to clients");
         }
     }
-}
 
-esp_err_t WSLightServer::sendBinaryMessage(const uint8_t *data, size_t length)
-{
-    if (length > MAX_MESSAGE_SIZE)
+    if (config.outbox != nullptr)
     {
-        ESP_LOGE("WSLightServer", "Message too large to send");
-        return ESP_FAIL;
+        int64_t flush_us = config.outbox->flush_deadline();
+        if (flush_us != 0 && now >= flush_us)
+        {
+            config.outbox->flush();
+        }
     }
 
-    if (client_sock > 0)
+    for (auto &conn : connections)
     {
-        std::vector<uint8_t> data_vec(data, data + length);
-        std::vector<uint8_t> frame = encode_frame(data_vec, HTTPD_WS_TYPE_BINARY);
-
-        if (send(client_sock, frame.data(), frame.size(), 0) < 0)
+        if (conn.state == WS_CONN_CLOSING && now >= conn.close_deadline_us)
         {
-            ESP_LOGE("WSLightServer", "Failed to send binary message: errno %d", errno);
-            return ESP_FAIL;
+            ESP_LOGW("WSLightServer", "Client %d did not answer the close frame", conn.sock);
+            close_stats.linger_timeouts++;
+            cleanup_client_connection(conn);
         }
     }
 
-    return ESP_OK;
-}
-
-esp_err_t WSLightServer::sendTextMessage(const std::string &text)
-{
-    size_t length = text.size();
-    if (length > MAX_MESSAGE_SIZE)
+    if (config.max_inactivity_ms == 0)
     {
-        ESP_LOGE("WSLightServer", "Message too large to send");
-        return ESP_FAIL;
+        return;
     }
-
-    if (client_sock > 0)
+    int64_t limit_us = static_cast<int64_t>(config.max_inactivity_ms) * 1000;
+    for (auto &conn : connections)
     {
-        std::vector<uint8_t> frame = encode_frame(text, HTTPD_WS_TYPE_TEXT);
-        if (send(client_sock, frame.data(), frame.size(), 0) < 0)
+        // Pongs prove an open session alive, so silence only counts while pings are sent.
+        bool watched = conn.state == WS_CONN_HANDSHAKE || (conn.state == WS_CONN_OPEN && config.enable_ping_pong);
+        if (!watched || now - conn.rx_last_activity_us < limit_us)
         {
-            ESP_LOGE("WSLightServer", "Failed to send text message: errno %d", errno);
-            return ESP_FAIL;
+            continue;
         }
+        ESP_LOGW("WSLightServer", "Client %d inactive for %llu ms, closing", conn.sock, (unsigned long long)config.max_inactivity_ms);
+        close_client_connection(conn, WS_CLOSE_GOING_AWAY);
     }
-    return ESP_OK;
 }
 
-void WSLightServer::handle_client()
+uint32_t WSLightServer::next_timeout_ms(int64_t now, uint32_t limit)
 {
-    while (true)
+    if (wake_sock < 0)
     {
-        if (!setup_server())
-        {
-            ESP_LOGE("WSLightServer", "Server setup failed");
-            return;
-        }
-
-        while (true)
-        {
-            handle_client_connection();
-            vTaskDelay(pdMS_TO_TICKS(relief_delay));
-        }
+        // Without a wake socket, sends and stop() from other tasks are only noticed by polling.
+        limit = std::min(limit, POLL_INTERVAL_MS);
+    }
 
-        close(server_sock);
-        vTaskDelay(pdMS_TO_TICKS(relief_delay));
+    int64_t deadline = now + static_cast<int64_t>(limit) * 1000;
+    if (config.enable_ping_pong)
+    {
+        deadline = std::min(deadline, next_ping_us);
+    }
+    int64_t flush_us = config.outbox != nullptr ? config.outbox->flush_deadline() : 0;
+    if (flush_us != 0)
+    {
+        deadline = std::min(deadline, flush_us);
+    }
+    int64_t inactivity_us = static_cast<int64_t>(config.max_inactivity_ms) * 1000;
+    int64_t shrink_us = static_cast<int64_t>(config.rx_buffer_shrink_ms) * 1000;
+    for (auto &conn : connections)
+    {
+        if (conn.state == WS_CONN_FREE)
+        {
+            continue;
+        }
+        if (conn.rx_paused_until_us != 0)
+        {
+            deadline = std::min(deadline, conn.rx_paused_until_us);
+        }
+        if (conn.state == WS_CONN_CLOSING)
+        {
+            deadline = std::min(deadline, conn.close_deadline_us);
+            continue;
+        }
+        if (inactivity_us != 0 && (conn.state == WS_CONN_HANDSHAKE || config.enable_ping_pong))
+        {
+            deadline = std::min(deadline, conn.rx_last_activity_us + inactivity_us);
+        }
+        if (conn.rx_capacity > config.rx_buffer_initial)
+        {
+            deadline = std::min(deadline, conn.rx_last_busy_us + shrink_us);
+        }
+    }
+
+    if (deadline <= now)
+    {
+        return 0;
+    }
+    if (config.timer_slack_ms != 0)
+    {
+        // Round up to the slack grid so deadlines that fall close together share one wakeup.
+        int64_t slack_us = static_cast<int64_t>(config.timer_slack_ms) * 1000;
+        deadline = (deadline + slack_us - 1) / slack_us * slack_us;
     }
+    return std::min<int64_t>((deadline - now + 999) / 1000, limit);
 }
 
-bool WSLightServer::setup_server()
+bool WSLightServer::open_wake_socket()
 {
-    server_sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_sock < 0)
+    wake_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (wake_sock < 0)
     {
-        ESP_LOGE("WSLightServer", "Unable to create socket: errno %d", errno);
-        vTaskDelete(nullptr);
         return false;
     }
 
-    int opt = 1;
-    if (setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+    // Bound and connected to itself, so a send() lands in its own receive queue.
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(wake_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        getsockname(wake_sock, (struct sockaddr *)&addr, &addr_len) != 0 ||
+        connect(wake_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0)
     {
-        ESP_LOGE("WSLightServer", "Failed to set socket options: errno %d", errno);
-        close(server_sock);
-        vTaskDelete(nullptr);
+        close(wake_sock);
+        wake_sock = -1;
         return false;
     }
+    fcntl(wake_sock, F_SETFL, fcntl(wake_sock, F_GETFL, 0) | O_NONBLOCK);
+    wake_pending = false;
+    return true;
+}
 
-    struct sockaddr_in server_addr = {};
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-
-    if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) != 0)
+bool WSLightServer::open_isr_wake_fd()
+{
+#if !CONFIG_IDF_TARGET_LINUX
+    esp_vfs_eventfd_config_t eventfd_config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+    esp_err_t err = esp_vfs_eventfd_register(&eventfd_config);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE)
+    {
+        return false;
+    }
+    int fd = eventfd(0, EFD_SUPPORT_ISR);
+#else
+    int fd = eventfd(0, 0);
+#endif
+    if (fd < 0)
     {
-        ESP_LOGE("WSLightServer", "Socket unable to bind: errno %d", errno);
-        close(server_sock);
-        vTaskDelete(nullptr);
         return false;
     }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    isr_wake_pending = false;
+    isr_wake_fd = fd;
+    return true;
+}
+
+void WSLightServer::close_isr_wake_fd()
+{
+    int fd = isr_wake_fd.exchange(-1);
+    // A handler past the check still uses the descriptor and the rings; it finishes in microseconds.
+    while (isr_senders.load() > 0)
+    {
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+void WSLightServer::wake_server_task()
+{
+    // Only the caller that sets the flag sends, so a burst of requests costs one datagram.
+    if (wake_sock < 0 || xTaskGetCurrentTaskHandle() == server_task || wake_pending.exchange(true))
+    {
+        return;
+    }
+    // Serialized by the flag: no other caller gets here until the server task clears it.
+    wakeup_stats.wake_requests++;
+    uint8_t byte = 0;
+    send(wake_sock, &byte, 1, MSG_DONTWAIT);
+}
+
+esp_err_t WSLightServer::sendBinaryMessage(const uint8_t *data, size_t length)
+{
+    return sendBinaryMessage(-1, data, length);
+}
+
+esp_err_t WSLightServer::sendBinaryMessage(int client_sock, const uint8_t *data, size_t length)
+{
+    esp_err_t err = send_message(client_sock, data, length, HTTPD_WS_TYPE_BINARY);
+    if (err == ESP_ERR_INVALID_SIZE)
+    {
+        ESP_LOGE("WSLightServer", "Message too large to send");
+    }
+    else if (err != ESP_OK && err != ESP_ERR_NOT_FOUND)
+    {
+        ESP_LOGE("WSLightServer", "Failed to send binary message: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+esp_err_t WSLightServer::sendTextMessage(const std::string &text)
+{
+    return sendTextMessage(-1, text);
+}
+
+esp_err_t WSLightServer::sendTextMessage(int client_sock, const std::string &text)
+{
+    esp_err_t err = send_message(client_sock, reinterpret_cast<const uint8_t *>(text.data()), text.size(), HTTPD_WS_TYPE_TEXT);
+    if (err == ESP_ERR_INVALID_SIZE)
+    {
+        ESP_LOGE("WSLightServer", "Message too large to send");
+    }
+    else if (err != ESP_OK && err != ESP_ERR_NOT_FOUND)
+    {
+        ESP_LOGE("WSLightServer", "Failed to send text message: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+esp_err_t WSLightServer::sendBinaryMessage(ws_conn_handle_t handle, const uint8_t *data, size_t length)
+{
+    esp_err_t err = send_message(handle, data, length, HTTPD_WS_TYPE_BINARY);
+    if (err == ESP_ERR_INVALID_SIZE)
+    {
+        ESP_LOGE("WSLightServer", "Message too large to send");
+    }
+    else if (err != ESP_OK && err != ESP_ERR_NOT_FOUND)
+    {
+        ESP_LOGE("WSLightServer", "Failed to send binary message: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+esp_err_t WSLightServer::sendTextMessage(ws_conn_handle_t handle, const std::string &text)
+{
+    esp_err_t err = send_message(handle, reinterpret_cast<const uint8_t *>(text.data()), text.size(), HTTPD_WS_TYPE_TEXT);
+    if (err == ESP_ERR_INVALID_SIZE)
+    {
+        ESP_LOGE("WSLightServer", "Message too large to send");
+    }
+    else if (err != ESP_OK && err != ESP_ERR_NOT_FOUND)
+    {
+        ESP_LOGE("WSLightServer", "Failed to send text message: %s", esp_err_to_name(err));
+    }
+    return err;
+}
+
+size_t WSLightServer::bufferedAmount(int client_sock)
+{
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    ws_connection_t *conn = find_connection(client_sock);
+    size_t buffered = conn != nullptr ? buffered_bytes(*conn) : 0;
+    xSemaphoreGiveRecursive(conn_lock);
+    return buffered;
+}
+
+size_t WSLightServer::bufferedAmount(ws_conn_handle_t handle)
+{
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    ws_connection_t *conn = find_connection(handle);
+    size_t buffered = conn != nullptr ? buffered_bytes(*conn) : 0;
+    xSemaphoreGiveRecursive(conn_lock);
+    return buffered;
+}
+
+size_t WSLightServer::bufferedAmount()
+{
+    size_t largest = 0;
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    for (auto &conn : connections)
+    {
+        if (conn.state == WS_CONN_OPEN)
+        {
+            largest = std::max(largest, buffered_bytes(conn));
+        }
+    }
+    xSemaphoreGiveRecursive(conn_lock);
+    return largest;
+}
+
+esp_err_t WSLightServer::forwardMessage(const ws_message_view_t &message, ws_conn_handle_t handle)
+{
+    if (message.data != lent_message || message.data == nullptr)
+    {
+        return send_message(handle, message.data, message.length, message.type);
+    }
+
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    ws_connection_t *conn = find_connection(handle);
+    esp_err_t result = ESP_ERR_NOT_FOUND;
+    size_t fragment = conn != nullptr && conn->tx_fragment_size != 0 ? conn->tx_fragment_size : MAX_MESSAGE_SIZE;
+    if (conn != nullptr && (!conn->tx_queue.empty() || conn->tx_ring_offset > 0 || message.length > fragment))
+    {
+        result = enqueue_message(*conn, message.data, message.length, message.type);
+    }
+    else if (conn != nullptr)
+    {
+        // The client's header, mask included, is always longer than ours for the same length.
+        size_t header_len = ws_write_frame_header(lent_message, message.length, message.type);
+        uint8_t *frame = lent_message - header_len;
+        size_t frame_len = header_len + message.length;
+        int sent = send_frame_now(*conn, frame, frame_len);
+        if (sent < 0)
+        {
+            result = ESP_FAIL;
+        }
+        else if (static_cast<size_t>(sent) == frame_len)
+        {
+            result = ESP_OK;
+        }
+        else
+        {
+            // The receive buffer is reused once the callback returns, so the rest is queued as a copy.
+            result = queue_frame(*conn, std::vector<uint8_t>(frame, frame + frame_len), sent);
+        }
+    }
+    xSemaphoreGiveRecursive(conn_lock);
+    return result;
+}
+
+esp_err_t WSLightServer::reserveMessage(ws_conn_handle_t handle, size_t length, ws_tx_reservation_t &reservation)
+{
+    reservation = {};
+    // Registered before the flag is read, so shutdown_server() keeps tx_rings until this returns.
+    ring_callers.fetch_add(1);
+    esp_err_t err = ESP_ERR_NOT_SUPPORTED;
+    if (tx_rings_open.load())
+    {
+        err = handle.slot < tx_rings.size() && handle.generation != 0
+                  ? tx_rings[handle.slot].reserve(handle.generation, length, &reservation.data)
+                  : ESP_ERR_NOT_FOUND;
+    }
+    ring_callers.fetch_sub(1);
+    if (err == ESP_OK)
+    {
+        reservation.handle = handle;
+        reservation.length = length;
+    }
+    return err;
+}
+
+esp_err_t WSLightServer::commitMessage(ws_tx_reservation_t &reservation, size_t length, ws_type_t type)
+{
+    if (reservation.data == nullptr || length > reservation.length || (type != HTTPD_WS_TYPE_TEXT && type != HTTPD_WS_TYPE_BINARY))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    ring_callers.fetch_add(1);
+    bool live = tx_rings_live.load() && reservation.handle.slot < tx_rings.size();
+    if (live)
+    {
+        tx_rings[reservation.handle.slot].commit(reservation.data, length, type);
+        // No conn_lock: the wake socket stays open while this call is registered in ring_callers.
+        wake_server_task();
+    }
+    ring_callers.fetch_sub(1);
+    if (!live)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    reservation.data = nullptr;
+    return ESP_OK;
+}
+
+void WSLightServer::cancelMessage(ws_tx_reservation_t &reservation)
+{
+    ring_callers.fetch_add(1);
+    if (reservation.data != nullptr && tx_rings_live.load() && reservation.handle.slot < tx_rings.size())
+    {
+        tx_rings[reservation.handle.slot].cancel(reservation.data);
+        reservation.data = nullptr;
+    }
+    ring_callers.fetch_sub(1);
+}
+
+esp_err_t WSLightServer::sendBinaryMessageFromISR(ws_conn_handle_t handle, const uint8_t *data, size_t length)
+{
+    // Registered before the descriptor is read, so close_isr_wake_fd() waits for this call.
+    isr_senders.fetch_add(1);
+    int fd = isr_wake_fd.load();
+    esp_err_t err = ESP_ERR_INVALID_STATE;
+    if (fd >= 0)
+    {
+        uint8_t *payload = nullptr;
+        err = handle.slot < tx_rings.size() ? tx_rings[handle.slot].reserve(handle.generation, length, &payload)
+                                            : ESP_ERR_NOT_FOUND;
+        if (err == ESP_OK)
+        {
+            memcpy(payload, data, length);
+            tx_rings[handle.slot].commit(payload, length, HTTPD_WS_TYPE_BINARY);
+            if (!isr_wake_pending.exchange(true))
+            {
+                // The eventfd ends select(), the notification ends the relief delay.
+                uint64_t one = 1;
+                write(fd, &one, sizeof(one));
+                TaskHandle_t task = server_task;
+                if (task != nullptr)
+                {
+                    BaseType_t woken = pdFALSE;
+                    vTaskNotifyGiveFromISR(task, &woken);
+                    portYIELD_FROM_ISR(woken);
+                }
+            }
+        }
+    }
+    isr_senders.fetch_sub(1);
+    return err;
+}
+
+ws_conn_handle_t WSLightServer::getConnectionHandle(int client_sock)
+{
+    ws_conn_handle_t handle = {};
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    ws_connection_t *conn = find_connection(client_sock);
+    if (conn != nullptr)
+    {
+        handle = connection_handle(*conn);
+    }
+    xSemaphoreGiveRecursive(conn_lock);
+    return handle;
+}
+
+esp_err_t WSLightServer::setUserData(ws_conn_handle_t handle, void *user_data)
+{
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    ws_connection_t *conn = find_connection(handle);
+    if (conn != nullptr)
+    {
+        conn->user_data = user_data;
+    }
+    xSemaphoreGiveRecursive(conn_lock);
+    return conn != nullptr ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+void *WSLightServer::getUserData(ws_conn_handle_t handle)
+{
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    ws_connection_t *conn = find_connection(handle);
+    void *user_data = conn != nullptr ? conn->user_data : nullptr;
+    xSemaphoreGiveRecursive(conn_lock);
+    return user_data;
+}
+
+esp_err_t WSLightServer::getMessageDigest(int client_sock, ws_message_digest_t &digest)
+{
+    if (config.rx_digest == WS_DIGEST_NONE)
+    {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    ws_connection_t *conn = find_connection(client_sock);
+    if (conn != nullptr)
+    {
+        read_digest(*conn, digest);
+    }
+    xSemaphoreGiveRecursive(conn_lock);
+    return conn != nullptr ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t WSLightServer::getMessageDigest(ws_conn_handle_t handle, ws_message_digest_t &digest)
+{
+    if (config.rx_digest == WS_DIGEST_NONE)
+    {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    ws_connection_t *conn = find_connection(handle);
+    if (conn != nullptr)
+    {
+        read_digest(*conn, digest);
+    }
+    xSemaphoreGiveRecursive(conn_lock);
+    return conn != nullptr ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t WSLightServer::send_message(ws_conn_handle_t handle, const uint8_t *data, size_t length, ws_type_t type)
+{
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    ws_connection_t *conn = find_connection(handle);
+    esp_err_t result = conn != nullptr ? enqueue_message(*conn, data, length, type) : ESP_ERR_NOT_FOUND;
+    xSemaphoreGiveRecursive(conn_lock);
+    return result;
+}
+
+esp_err_t WSLightServer::send_message(int client_sock, const uint8_t *data, size_t length, ws_type_t type)
+{
+    esp_err_t result = client_sock < 0 ? ESP_OK : ESP_ERR_NOT_FOUND;
+    bool open_session = false;
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    for (auto &conn : connections)
+    {
+        if (conn.state != WS_CONN_OPEN || (client_sock >= 0 && conn.sock != client_sock))
+        {
+            continue;
+        }
+        open_session = true;
+        if (client_sock < 0 && is_outbox_target(conn))
+        {
+            // It gets the broadcast from the outbox, behind the messages stored before it.
+            continue;
+        }
+        esp_err_t err = enqueue_message(conn, data, length, type);
+        if (client_sock >= 0 || err != ESP_OK)
+        {
+            result = err;
+        }
+        if (client_sock >= 0)
+        {
+            break;
+        }
+    }
+    bool store = client_sock < 0 && config.outbox != nullptr && (!open_session || outbox_target.generation != 0);
+    if (store && !message_deliverable(length, config.tx_fragment_size))
+    {
+        // Stored, it would stop the drain for good.
+        result = ESP_ERR_INVALID_SIZE;
+        store = false;
+    }
+    if (store)
+    {
+        outbox_appends++;
+    }
+    xSemaphoreGiveRecursive(conn_lock);
+    if (!store)
+    {
+        return result;
+    }
+
+    // A flash write can take milliseconds; the server task keeps serving meanwhile.
+    bool batched = config.outbox->flush_deadline() != 0;
+    esp_err_t err = config.outbox->append(data, length, type);
+    if (err != ESP_OK)
+    {
+        result = err;
+    }
+
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    outbox_appends--;
+    if (err == ESP_OK)
+    {
+        // A client may have connected while the message was stored.
+        select_outbox_target();
+    }
+    if (outbox_target.generation != 0 || (!batched && config.outbox->flush_deadline() != 0))
+    {
+        // Resume the drain, or let the server task time the flush of the batch just started.
+        wake_server_task();
+    }
+    xSemaphoreGiveRecursive(conn_lock);
+    return result;
+}
+
+esp_err_t WSLightServer::enqueue_message(ws_connection_t &conn, const uint8_t *data, size_t length, ws_type_t type)
+{
+    size_t fragment = conn.tx_fragment_size;
+    if (fragment == 0)
+    {
+        if (length > MAX_MESSAGE_SIZE)
+        {
+            return ESP_ERR_INVALID_SIZE;
+        }
+        fragment = length;
+    }
+
+    bool fragmented = length > fragment;
+    size_t reserved = 0;
+    if (fragmented)
+    {
+        reserved = message_wire_size(length, fragment);
+        while (!memory.reserve(reserved))
+        {
+            if (!shed_largest_queue())
+            {
+                return ESP_ERR_NO_MEM;
+            }
+        }
+    }
+
+    size_t offset = 0;
+    do
+    {
+        size_t chunk = std::min(fragment, length - offset);
+        bool fin = offset + chunk == length;
+        std::vector<uint8_t> frame = encode_frame(data + offset, chunk, offset == 0 ? type : HTTPD_WS_TYPE_CONTINUE, fin);
+        reserved -= fragmented ? frame.size() : 0;
+        esp_err_t err = enqueue_frame(conn, std::move(frame), fragmented);
+        if (err != ESP_OK)
+        {
+            memory.release(reserved);
+            if (offset > 0)
+            {
+                // Earlier fragments are queued or sent; the next message would break the stream.
+                shutdown(conn.sock, SHUT_RDWR);
+            }
+            return err;
+        }
+        offset += chunk;
+    } while (offset < length);
+
+    if (fragmented && memory.underPressure())
+    {
+        shed_largest_queue();
+    }
+    return ESP_OK;
+}
+
+size_t WSLightServer::message_wire_size(size_t length, size_t fragment)
+{
+    if (fragment == 0 || length <= fragment)
+    {
+        return ws_frame_header_size(length) + length;
+    }
+    size_t size = 0;
+    for (size_t offset = 0; offset < length; offset += fragment)
+    {
+        size_t chunk = std::min(fragment, length - offset);
+        size += ws_frame_header_size(chunk) + chunk;
+    }
+    return size;
+}
+
+bool WSLightServer::message_deliverable(size_t length, size_t fragment) const
+{
+    if (fragment == 0)
+    {
+        return length <= MAX_MESSAGE_SIZE;
+    }
+    // A fragmented message reserves all of its frames at once, however many queues are shed.
+    return length <= fragment || memory.budget() == 0 || message_wire_size(length, fragment) <= memory.budget();
+}
+
+esp_err_t WSLightServer::send_frame(int client_sock, std::vector<uint8_t> &&frame)
+{
+    esp_err_t result = client_sock < 0 ? ESP_OK : ESP_ERR_NOT_FOUND;
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    for (auto &conn : connections)
+    {
+        if (conn.state != WS_CONN_OPEN || (client_sock >= 0 && conn.sock != client_sock))
+        {
+            continue;
+        }
+        std::vector<uint8_t> copy = client_sock < 0 ? frame : std::move(frame);
+        esp_err_t err = enqueue_frame(conn, std::move(copy));
+        if (client_sock >= 0 || err != ESP_OK)
+        {
+            result = err;
+        }
+        if (client_sock >= 0)
+        {
+            break;
+        }
+    }
+    xSemaphoreGiveRecursive(conn_lock);
+    return result;
+}
+
+esp_err_t WSLightServer::enqueue_frame(ws_connection_t &conn, std::vector<uint8_t> &&frame, bool reserved)
+{
+    size_t offset = 0;
+    if (conn.tx_queue.empty() && conn.tx_ring_offset == 0)
+    {
+        int sent = send_frame_now(conn, frame.data(), frame.size());
+        if (sent < 0 || static_cast<size_t>(sent) == frame.size())
+        {
+            if (reserved)
+            {
+                memory.release(frame.size());
+            }
+            return sent < 0 ? ESP_FAIL : ESP_OK;
+        }
+        offset = sent;
+    }
+    return queue_frame(conn, std::move(frame), offset, reserved);
+}
+
+int WSLightServer::send_frame_now(ws_connection_t &conn, const uint8_t *frame, size_t length)
+{
+    int sent = send(conn.sock, frame, length, MSG_DONTWAIT);
+    if (sent < 0)
+    {
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    }
+    priority_stats[conn.priority].bytes_sent += sent;
+    if (static_cast<size_t>(sent) == length)
+    {
+        priority_stats[conn.priority].frames_sent++;
+    }
+    return sent;
+}
+
+esp_err_t WSLightServer::queue_frame(ws_connection_t &conn, std::vector<uint8_t> &&frame, size_t sent, bool reserved)
+{
+    size_t offset = sent;
+    size_t size = frame.size();
+    while (!reserved && !memory.reserve(size))
+    {
+        if (!shed_largest_queue())
+        {
+            if (offset > 0)
+            {
+                // Part of the frame is already on the wire; the stream is unusable without the rest.
+                send_close_frame(conn, WS_CLOSE_INTERNAL_ERROR);
+                shutdown(conn.sock, SHUT_RDWR);
+            }
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    bool was_empty = conn.tx_queue.empty();
+    uint8_t opcode = frame[0] & 0x0F;
+    if (was_empty)
+    {
+        conn.tx_offset = offset;
+        conn.tx_queue.push_back(std::move(frame));
+    }
+    else if (opcode == HTTPD_WS_TYPE_PING || opcode == HTTPD_WS_TYPE_PONG)
+    {
+        // Overtake queued data at the next frame boundary; RFC 6455 allows it between fragments.
+        conn.tx_queue.insert(conn.tx_queue.begin() + 1 + conn.tx_urgent, std::move(frame));
+        conn.tx_urgent++;
+    }
+    else
+    {
+        conn.tx_queue.push_back(std::move(frame));
+    }
+    conn.tx_queued_bytes += size;
+    if (conn.tx_queued_bytes - conn.tx_offset > config.tx_low_watermark)
+    {
+        conn.tx_drain_pending = true;
+    }
+    if (was_empty)
+    {
+        // The server task has to add the socket to its write set.
+        wake_server_task();
+    }
+
+    if (!reserved && memory.underPressure())
+    {
+        shed_largest_queue();
+    }
+    return ESP_OK;
+}
+
+int WSLightServer::flush_client_connection(ws_connection_t &conn, size_t budget)
+{
+    WSTxRing *ring = tx_ring(conn);
+    size_t total = 0;
+    while (total < budget)
+    {
+        // A ring frame that has started goes out whole; new ones only while the queue is empty,
+        // so they never land inside a fragmented message or after a close frame.
+        bool ring_open = conn.tx_queue.empty() && conn.state == WS_CONN_OPEN;
+        if (ring != nullptr && (conn.tx_ring_offset > 0 || ring_open))
+        {
+            const uint8_t *frames[TX_RING_BATCH];
+            size_t lengths[TX_RING_BATCH];
+            size_t count = ring->gather(frames, lengths, ring_open ? TX_RING_BATCH : 1);
+            if (count > 0)
+            {
+                struct iovec iov[TX_RING_BATCH];
+                size_t iov_count = 0;
+                size_t chunk = 0;
+                size_t skip = conn.tx_ring_offset;
+                while (iov_count < count && chunk < budget - total)
+                {
+                    iov[iov_count].iov_base = const_cast<uint8_t *>(frames[iov_count]) + skip;
+                    iov[iov_count].iov_len = std::min(lengths[iov_count] - skip, budget - total - chunk);
+                    chunk += iov[iov_count].iov_len;
+                    skip = 0;
+                    iov_count++;
+                }
+
+                struct msghdr msg = {};
+                msg.msg_iov = iov;
+                msg.msg_iovlen = iov_count;
+                int sent = sendmsg(conn.sock, &msg, MSG_DONTWAIT);
+                if (sent < 0)
+                {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    {
+                        break;
+                    }
+                    ESP_LOGE("WSLightServer", "send failed: errno %d", errno);
+                    return -1;
+                }
+                total += sent;
+                priority_stats[conn.priority].bytes_sent += sent;
+
+                size_t done = 0;
+                size_t position = conn.tx_ring_offset + sent;
+                while (done < count && position >= lengths[done])
+                {
+                    position -= lengths[done];
+                    done++;
+                }
+                conn.tx_ring_offset = position;
+                if (done > 0)
+                {
+                    ring->release(done);
+                    priority_stats[conn.priority].frames_sent += done;
+                }
+                if (static_cast<size_t>(sent) < chunk)
+                {
+                    break;
+                }
+                continue;
+            }
+        }
+
+        if (conn.tx_queue.empty())
+        {
+            break;
+        }
+        std::vector<uint8_t> &head = conn.tx_queue.front();
+        size_t chunk = std::min(head.size() - conn.tx_offset, budget - total);
+        int sent = send(conn.sock, head.data() + conn.tx_offset, chunk, MSG_DONTWAIT);
+        if (sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            ESP_LOGE("WSLightServer", "send failed: errno %d", errno);
+            return -1;
+        }
+        total += sent;
+        conn.tx_offset += sent;
+        priority_stats[conn.priority].bytes_sent += sent;
+        if (conn.tx_offset < head.size())
+        {
+            if (static_cast<size_t>(sent) < chunk)
+            {
+                break;
+            }
+            continue;
+        }
+        memory.release(head.size());
+        conn.tx_queued_bytes -= head.size();
+        conn.tx_queue.pop_front();
+        conn.tx_offset = 0;
+        if (conn.tx_urgent > 0)
+        {
+            conn.tx_urgent--;
+        }
+        priority_stats[conn.priority].frames_sent++;
+    }
+    return total;
+}
+
+bool WSLightServer::shed_largest_queue()
+{
+    ws_connection_t *largest = nullptr;
+    size_t largest_start = 0;
+    for (auto &conn : connections)
+    {
+        size_t start = shed_start(conn);
+        if (start < conn.tx_queue.size() && (largest == nullptr || conn.tx_queued_bytes > largest->tx_queued_bytes))
+        {
+            largest = &conn;
+            largest_start = start;
+        }
+    }
+    if (largest == nullptr)
+    {
+        return false;
+    }
+
+    size_t dropped = 0;
+    while (largest->tx_queue.size() > largest_start)
+    {
+        dropped += largest->tx_queue.back().size();
+        largest->tx_queue.pop_back();
+        shed_frames++;
+    }
+    largest->tx_queued_bytes -= dropped;
+    shed_bytes += dropped;
+    memory.release(dropped);
+    ESP_LOGW("WSLightServer", "Memory pressure, shed %zu queued bytes of client %d", dropped, largest->sock);
+    return true;
+}
+
+void WSLightServer::handle_client()
+{
+    if (!setup_server())
+    {
+        ESP_LOGE("WSLightServer", "Server setup failed");
+        shutdown_server();
+        return;
+    }
+
+    listen_result = ESP_OK;
+    if (server_ready_callback)
+    {
+        server_ready_callback();
+    }
+    xTaskNotifyGive(notify_task);
+
+    while (!stop_requested)
+    {
+        if (run_once(UINT32_MAX))
+        {
+            if (config.isr_submission)
+            {
+                ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(config.relief_delay));
+            }
+            else
+            {
+                vTaskDelay(pdMS_TO_TICKS(config.relief_delay));
+            }
+        }
+    }
+
+    shutdown_server();
+}
+
+void WSLightServer::shutdown_server()
+{
+    tx_rings_open = false;
+    for (auto &ring : tx_rings)
+    {
+        ring.close();
+    }
+    close_isr_wake_fd();
+    if (server_sock >= 0)
+    {
+        close(server_sock);
+        server_sock = -1;
+    }
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    for (auto &conn : connections)
+    {
+        if (conn.state == WS_CONN_OPEN)
+        {
+            close_client_connection(conn, WS_CLOSE_GOING_AWAY);
+        }
+    }
+    xSemaphoreGiveRecursive(conn_lock);
+
+    // Give queued frames, including the close frames, until the deadline to reach the clients.
+    int64_t deadline = esp_timer_get_time() + static_cast<int64_t>(drain_timeout_ms) * 1000;
+    while (true)
+    {
+        fd_set write_fds;
+        FD_ZERO(&write_fds);
+        int max_fd = -1;
+        for (auto &conn : connections)
+        {
+            if (conn.state != WS_CONN_FREE && (!conn.tx_queue.empty() || conn.tx_ring_offset > 0))
+            {
+                FD_SET(conn.sock, &write_fds);
+                max_fd = std::max(max_fd, conn.sock);
+            }
+        }
+        int64_t remaining_us = deadline - esp_timer_get_time();
+        if (max_fd < 0 || remaining_us <= 0)
+        {
+            break;
+        }
+
+        struct timeval tv = {};
+        tv.tv_sec = remaining_us / 1000000;
+        tv.tv_usec = remaining_us % 1000000;
+        if (select(max_fd + 1, nullptr, &write_fds, nullptr, &tv) <= 0)
+        {
+            break;
+        }
+        for (auto &conn : connections)
+        {
+            if (conn.state != WS_CONN_FREE && FD_ISSET(conn.sock, &write_fds))
+            {
+                xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+                int sent = flush_client_connection(conn);
+                xSemaphoreGiveRecursive(conn_lock);
+                if (sent < 0)
+                {
+                    cleanup_client_connection(conn);
+                }
+            }
+        }
+    }
+
+    for (auto &conn : connections)
+    {
+        if (conn.state != WS_CONN_FREE)
+        {
+            cleanup_client_connection(conn);
+        }
+    }
+
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    std::vector<ws_connection_t>().swap(connections);
+    xSemaphoreGiveRecursive(conn_lock);
+    release_tx_rings();
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    if (wake_sock >= 0)
+    {
+        // Other tasks wake the server holding conn_lock or, from commitMessage(), registered in
+        // ring_callers, which release_tx_rings() has waited out; none can use the descriptor after this.
+        close(wake_sock);
+        wake_sock = -1;
+    }
+    xSemaphoreGiveRecursive(conn_lock);
+    if (config.outbox != nullptr)
+    {
+        config.outbox->flush();
+    }
+}
+
+void WSLightServer::release_tx_rings()
+{
+    // Producers holding a reservation commit or cancel it into the closed rings first,
+    // the way close_isr_wake_fd() waits for interrupt handlers.
+    for (auto &ring : tx_rings)
+    {
+        while (ring.writers() > 0)
+        {
+            vTaskDelay(1);
+        }
+    }
+    tx_rings_live = false;
+    while (ring_callers.load() > 0)
+    {
+        vTaskDelay(1);
+    }
+    memory.release(config.tx_ring_size * tx_rings.size());
+    std::vector<WSTxRing>().swap(tx_rings);
+}
+
+bool WSLightServer::run_once(uint32_t timeout_ms)
+{
+    fd_set read_fds;
+    fd_set write_fds;
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+    int max_fd = prepare_poll(read_fds, write_fds, timeout_ms);
+
+    struct timeval tv = {};
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    int ready = select(max_fd + 1, &read_fds, &write_fds, nullptr, &tv);
+    if (ready < 0)
+    {
+        ESP_LOGE("WSLightServer", "select failed: errno %d", errno);
+        return false;
+    }
+
+    int64_t now = esp_timer_get_time();
+    wakeup_stats.wakeups++;
+    if (ready == 0)
+    {
+        wakeup_stats.timer_wakeups++;
+    }
+    wakeup_window_count++;
+    if (now - wakeup_window_us >= 1000000)
+    {
+        wakeup_stats.wakeups_per_sec = wakeup_window_count;
+        wakeup_window_count = 0;
+        wakeup_window_us = now;
+    }
+    return dispatch_poll(read_fds, write_fds);
+}
+
+int WSLightServer::prepare_poll(fd_set &read_fds, fd_set &write_fds, uint32_t &timeout_ms)
+{
+    FD_SET(server_sock, &read_fds);
+    int max_fd = server_sock;
+    if (wake_sock >= 0)
+    {
+        FD_SET(wake_sock, &read_fds);
+        max_fd = std::max(max_fd, wake_sock);
+    }
+    int isr_fd = isr_wake_fd.load();
+    if (isr_fd >= 0)
+    {
+        FD_SET(isr_fd, &read_fds);
+        max_fd = std::max(max_fd, isr_fd);
+    }
+    int64_t now = esp_timer_get_time();
+    service_timers(now);
+
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    timeout_ms = next_timeout_ms(now, timeout_ms);
+    for (auto &conn : connections)
+    {
+        if (conn.state == WS_CONN_FREE)
+        {
+            continue;
+        }
+        if (conn.rx_paused_until_us <= now)
+        {
+            FD_SET(conn.sock, &read_fds);
+        }
+        WSTxRing *ring = tx_ring(conn);
+        // An empty outbox waiting for a broadcast being stored is not worth a write wakeup,
+        // nor is a stored message the budget refused until that much is free again.
+        bool outbox_ready = is_outbox_target(conn) && (outbox_appends == 0 || !config.outbox->empty()) &&
+                            (outbox_wait_bytes == 0 || memory.fits(outbox_wait_bytes));
+        if (!conn.tx_queue.empty() || conn.tx_ring_offset > 0 ||
+            (conn.state == WS_CONN_OPEN && ((ring != nullptr && ring->ready()) || outbox_ready)))
+        {
+            FD_SET(conn.sock, &write_fds);
+        }
+        max_fd = std::max(max_fd, conn.sock);
+    }
+    xSemaphoreGiveRecursive(conn_lock);
+    return max_fd;
+}
+
+bool WSLightServer::dispatch_poll(const fd_set &read_fds, const fd_set &write_fds)
+{
+    int64_t now = esp_timer_get_time();
+    if (wake_sock >= 0 && FD_ISSET(wake_sock, &read_fds))
+    {
+        uint8_t drain[16];
+        while (recv(wake_sock, drain, sizeof(drain), MSG_DONTWAIT) > 0)
+        {
+        }
+        // Cleared after the drain, which could swallow the datagram of a request racing with it.
+        // A request skipped while the flag is still set is seen when the next pass builds its sets.
+        wake_pending = false;
+    }
+    int isr_fd = isr_wake_fd.load();
+    if (isr_fd >= 0 && FD_ISSET(isr_fd, &read_fds))
+    {
+        uint64_t count;
+        read(isr_fd, &count, sizeof(count));
+        isr_wake_pending = false;
+    }
+
+    bool served = false;
+    // Share the write quantum of each class between its writable connections.
+    size_t writable[WS_PRIORITY_COUNT] = {};
+    for (auto &conn : connections)
+    {
+        if (conn.state != WS_CONN_FREE && FD_ISSET(conn.sock, &write_fds))
+        {
+            writable[conn.priority]++;
+        }
+    }
+
+    size_t count = connections.size();
+    size_t first = next_slot;
+    next_slot = (next_slot + 1) % count;
+    for (size_t n = 0; n < count; ++n)
+    {
+        ws_connection_t &conn = connections[(first + n) % count];
+        if (conn.state == WS_CONN_FREE)
+        {
+            continue;
+        }
+        if (FD_ISSET(conn.sock, &write_fds))
+        {
+            size_t quantum = SIZE_MAX;
+            if (config.scheduling.write_quantum != 0)
+            {
+                quantum = config.scheduling.write_quantum * config.priority.weights[conn.priority] / writable[conn.priority];
+                quantum = std::max<size_t>(quantum, 1);
+            }
+            xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+            conn.tx_deficit = std::min(conn.tx_deficit, SIZE_MAX - quantum) + quantum;
+            drain_outbox(conn);
+            int sent = flush_client_connection(conn, conn.tx_deficit);
+            if (sent >= 0)
+            {
+                conn.tx_deficit = conn.tx_queue.empty() ? 0 : conn.tx_deficit - sent;
+            }
+            bool drained = sent >= 0 && conn.tx_drain_pending &&
+                           conn.tx_queued_bytes - conn.tx_offset <= config.tx_low_watermark;
+            if (drained)
+            {
+                conn.tx_drain_pending = false;
+            }
+            xSemaphoreGiveRecursive(conn_lock);
+            if (sent < 0)
+            {
+                cleanup_client_connection(conn);
+                continue;
+            }
+            if (drained && conn.state == WS_CONN_OPEN && drain_callback)
+            {
+                drain_callback(conn.sock);
+            }
+            finish_close(conn);
+            if (conn.state == WS_CONN_FREE)
+            {
+                continue;
+            }
+            served = true;
+        }
+        if (FD_ISSET(conn.sock, &read_fds))
+        {
+            size_t quantum = config.scheduling.read_quantum != 0 ? config.scheduling.read_quantum : SIZE_MAX;
+            conn.rx_deficit = std::min(conn.rx_deficit, SIZE_MAX - quantum) + quantum;
+            handle_client_connection(conn);
+            served = true;
+        }
+        else if (conn.state == WS_CONN_OPEN && conn.rx_paused_until_us == 0)
+        {
+            shrink_idle_rx_buffer(conn, now);
+        }
+        else if (conn.rx_paused_until_us != 0 && conn.rx_paused_until_us <= now)
+        {
+            conn.rx_paused_until_us = 0;
+            if (conn.state == WS_CONN_HANDSHAKE)
+            {
+                process_handshake(conn);
+            }
+            else
+            {
+                process_rx_buffer(conn);
+            }
+            served = true;
+        }
+    }
+
+    if (FD_ISSET(server_sock, &read_fds))
+    {
+        accept_client();
+        served = true;
+    }
+    return served;
+}
+
+bool WSLightServer::setup_server()
+{
+    server_sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_sock < 0)
+    {
+        ESP_LOGE("WSLightServer", "Unable to create socket: errno %d", errno);
+        return false;
+    }
+
+    int opt = 1;
+    if (setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0)
+    {
+        ESP_LOGE("WSLightServer", "Failed to set socket options: errno %d", errno);
+        close(server_sock);
+        server_sock = -1;
+        return false;
+    }
+
+    struct sockaddr_in server_addr = {};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(config.port);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) != 0)
+    {
+        ESP_LOGE("WSLightServer", "Socket unable to bind: errno %d", errno);
+        close(server_sock);
+        server_sock = -1;
+        return false;
+    }
+
+    apply_socket_options(server_sock, true);
+
+    if (listen(server_sock, config.socket.listen_backlog) != 0)
+    {
+        ESP_LOGE("WSLightServer", "Error occurred during listen: errno %d", errno);
+        close(server_sock);
+        server_sock = -1;
+        return false;
+    }
+
+    ESP_LOGI("WSLightServer", "Server listening on port %d, %lld ms after boot", config.port, esp_timer_get_time() / 1000);
+
+    if (!open_wake_socket())
+    {
+        ESP_LOGW("WSLightServer", "No loopback wake socket, polling every %u ms instead", (unsigned)POLL_INTERVAL_MS);
+    }
+    if (config.isr_submission && !open_isr_wake_fd())
+    {
+        ESP_LOGW("WSLightServer", "No eventfd for ISR submission, sendBinaryMessageFromISR() is unavailable");
+    }
+    next_ping_us = esp_timer_get_time() + static_cast<int64_t>(config.ping_interval_ms) * 1000;
+
+    return true;
+}
+
+void WSLightServer::accept_client()
+{
+    struct sockaddr_in client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    int sock = accept(server_sock, (struct sockaddr *)&client_addr, &client_addr_len);
+
+    if (sock < 0)
+    {
+        ESP_LOGE("WSLightServer", "Unable to accept connection: errno %d", errno);
+        return;
+    }
+
+    ws_connection_t *slot = nullptr;
+    for (auto &conn : connections)
+    {
+        if (conn.state == WS_CONN_FREE)
+        {
+            slot = &conn;
+            break;
+        }
+    }
+    if (slot == nullptr)
+    {
+        ESP_LOGW("WSLightServer", "Rejecting client %d: too many connections", sock);
+        rejected_connections++;
+        send_http_error(sock, "503 Service Unavailable");
+        close(sock);
+        return;
+    }
+
+    // No buffer is allocated until the upgrade request has been authorized.
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    apply_socket_options(sock, false);
+    slot->sock = sock;
+    slot->rx_last_activity_us = esp_timer_get_time();
+    slot->state = WS_CONN_HANDSHAKE;
+    ESP_LOGI("WSLightServer", "Client connected: %d", sock);
+}
+
+void WSLightServer::send_http_error(int sock, const char *status)
+{
+    char drain[128];
+    while (recv(sock, drain, sizeof(drain), MSG_DONTWAIT) > 0)
+    {
+    }
+
+    std::string response = std::string("HTTP/1.1 ") + status + "\r\n"
+                                                             "Connection: close\r\n"
+                                                             "Content-Length: 0\r\n\r\n";
+    send(sock, response.c_str(), response.length(), MSG_DONTWAIT);
+}
+void WSLightServer::apply_socket_options(int sock, bool listening)
+{
+    const ws_socket_config_t &opts = config.socket;
+    if (opts.send_buffer > 0 && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &opts.send_buffer, sizeof(opts.send_buffer)) < 0)
+    {
+        ESP_LOGW("WSLightServer", "Failed to set SO_SNDBUF: errno %d", errno);
+    }
+    if (opts.recv_buffer > 0 && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &opts.recv_buffer, sizeof(opts.recv_buffer)) < 0)
+    {
+        ESP_LOGW("WSLightServer", "Failed to set SO_RCVBUF: errno %d", errno);
+    }
+
+    // lwIP refuses TCP level options on a listening socket.
+    if (listening)
+    {
+        return;
+    }
+    int value = opts.nodelay ? 1 : 0;
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value)) < 0)
+    {
+        ESP_LOGW("WSLightServer", "Failed to set TCP_NODELAY: errno %d", errno);
+    }
+
+    if (!opts.keepalive)
+    {
+        return;
+    }
+    value = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &value, sizeof(value)) < 0)
+    {
+        ESP_LOGW("WSLightServer", "Failed to set SO_KEEPALIVE: errno %d", errno);
+        return;
+    }
+    if (setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, &opts.keepalive_idle_s, sizeof(opts.keepalive_idle_s)) < 0 ||
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, &opts.keepalive_interval_s, sizeof(opts.keepalive_interval_s)) < 0 ||
+        setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, &opts.keepalive_count, sizeof(opts.keepalive_count)) < 0)
+    {
+        ESP_LOGW("WSLightServer", "Failed to set keepalive timing: errno %d", errno);
+    }
+}
+
+void WSLightServer::handle_client_connection(ws_connection_t &conn)
+{
+    if (conn.state == WS_CONN_HANDSHAKE)
+    {
+        process_handshake(conn);
+        return;
+    }
+    if (conn.sink_dest != nullptr)
+    {
+        receive_direct_payload(conn);
+        return;
+    }
+    if (conn.rx_len >= conn.rx_capacity)
+    {
+        // Buffer full of a frame that is still waiting for tokens.
+        return;
+    }
+
+    size_t wanted = std::min(conn.rx_capacity - conn.rx_len, conn.rx_deficit);
+    int len = recv(conn.sock, conn.rx_buffer + conn.rx_len, wanted, 0);
+    if (len < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            conn.rx_deficit = 0;
+            return;
+        }
+        ESP_LOGE("WSLightServer", "recv failed: errno %d", errno);
+        cleanup_client_connection(conn);
+        return;
+    }
+    if (len == 0)
+    {
+        ESP_LOGI("WSLightServer", "Client %d closed connection", conn.sock);
+        cleanup_client_connection(conn);
+        return;
+    }
+
+    // A short read drained the socket, so unused credit is not carried into the next round.
+    conn.rx_deficit = static_cast<size_t>(len) < wanted ? 0 : conn.rx_deficit - len;
+    conn.rx_last_activity_us = esp_timer_get_time();
+    capture(conn, WS_CAPTURE_DATA, conn.rx_buffer + conn.rx_len, len);
+    conn.rx_len += len;
+    if (conn.rx_len == conn.rx_capacity && conn.rx_capacity < config.rx_buffer_size)
+    {
+        // A full read means more is probably waiting; fetch it in bigger chunks.
+        conn.rx_last_busy_us = esp_timer_get_time();
+        resize_rx_buffer(conn, std::min(conn.rx_capacity * 2, config.rx_buffer_size));
+    }
+    process_rx_buffer(conn);
+}
+
+bool WSLightServer::resize_rx_buffer(ws_connection_t &conn, size_t capacity)
+{
+    if (capacity > conn.rx_capacity && !memory.reserve(capacity - conn.rx_capacity))
+    {
+        return false;
+    }
+    uint8_t *buffer = static_cast<uint8_t *>(pvPortMalloc(capacity));
+    if (buffer == nullptr)
+    {
+        if (capacity > conn.rx_capacity)
+        {
+            memory.release(capacity - conn.rx_capacity);
+        }
+        return false;
+    }
+
+    memcpy(buffer, conn.rx_buffer, conn.rx_len);
+    vPortFree(conn.rx_buffer);
+    if (capacity < conn.rx_capacity)
+    {
+        memory.release(conn.rx_capacity - capacity);
+        rx_shrinks++;
+    }
+    else
+    {
+        rx_grows++;
+    }
+    conn.rx_buffer = buffer;
+    conn.rx_capacity = capacity;
+    return true;
+}
+
+void WSLightServer::shrink_idle_rx_buffer(ws_connection_t &conn, int64_t now)
+{
+    if (conn.rx_capacity <= config.rx_buffer_initial || conn.rx_len > config.rx_buffer_initial ||
+        now - conn.rx_last_busy_us < static_cast<int64_t>(config.rx_buffer_shrink_ms) * 1000)
+    {
+        return;
+    }
+    conn.rx_last_busy_us = now;
+    resize_rx_buffer(conn, config.rx_buffer_initial);
+}
+
+ws_rx_buffer_stats_t WSLightServer::getRxBufferStats()
+{
+    ws_rx_buffer_stats_t stats = {};
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    for (auto &conn : connections)
+    {
+        stats.total += conn.rx_capacity;
+        stats.largest = std::max(stats.largest, conn.rx_capacity);
+    }
+    xSemaphoreGiveRecursive(conn_lock);
+    stats.grows = rx_grows;
+    stats.shrinks = rx_shrinks;
+    stats.buffered_bytes = rx_buffered_bytes;
+    stats.direct_bytes = rx_direct_bytes;
+    return stats;
+}
+
+void WSLightServer::process_handshake(ws_connection_t &conn)
+{
+    // Peek so the request stays in the socket until it is complete and authorized.
+    char buffer[MAX_MESSAGE_SIZE];
+    int len = recv(conn.sock, buffer, sizeof(buffer), MSG_PEEK);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return;
+    }
+    if (len <= 0)
+    {
+        cleanup_client_connection(conn);
+        return;
+    }
+
+    std::string request(buffer, len);
+    size_t end = request.find("\r\n\r\n");
+    if (end == std::string::npos)
+    {
+        if (len >= MAX_MESSAGE_SIZE)
+        {
+            ESP_LOGE("WSLightServer", "Received message too large, closing connection");
+            cleanup_client_connection(conn);
+        }
+        else
+        {
+            conn.rx_paused_until_us = esp_timer_get_time() + POLL_INTERVAL_MS * 1000;
+        }
+        return;
+    }
+    request.resize(end + 4);
+
+    int64_t auth_start = esp_timer_get_time();
+    if (!authenticator.authorize(request))
+    {
+        ESP_LOGW("WSLightServer", "Rejecting client %d: unauthorized", conn.sock);
+        send_http_error(conn.sock, "401 Unauthorized");
+        cleanup_client_connection(conn);
+        auth_stats.rejected++;
+        auth_stats.reject_time_us += esp_timer_get_time() - auth_start;
+        return;
+    }
+    if (authenticator.enabled())
+    {
+        auth_stats.authorized++;
+    }
+
+    size_t rx_size = config.rx_buffer_initial;
+    bool reserved = memory.reserve(rx_size);
+    uint8_t *rx_buffer = reserved ? static_cast<uint8_t *>(pvPortMalloc(rx_size)) : nullptr;
+    mbedtls_sha256_context *rx_sha256 = nullptr;
+    if (rx_buffer != nullptr && (config.rx_digest & WS_DIGEST_SHA256))
+    {
+        rx_sha256 = static_cast<mbedtls_sha256_context *>(pvPortMalloc(sizeof(mbedtls_sha256_context)));
+        if (rx_sha256 == nullptr)
+        {
+            vPortFree(rx_buffer);
+            rx_buffer = nullptr;
+        }
+    }
+    if (rx_buffer == nullptr)
+    {
+        ESP_LOGW("WSLightServer", "Rejecting client %d: memory budget exhausted", conn.sock);
+        if (reserved)
+        {
+            memory.release(rx_size);
+        }
+        rejected_connections++;
+        send_http_error(conn.sock, "503 Service Unavailable");
+        cleanup_client_connection(conn);
+        return;
+    }
+
+    recv(conn.sock, buffer, request.size(), 0);
+    if (!send_handshake(conn.sock, request))
+    {
+        vPortFree(rx_buffer);
+        vPortFree(rx_sha256);
+        memory.release(rx_size);
+        cleanup_client_connection(conn);
+        return;
+    }
+
+    conn.rx_buffer = rx_buffer;
+    conn.rx_capacity = rx_size;
+    conn.rx_len = 0;
+    if (rx_sha256 != nullptr)
+    {
+        mbedtls_sha256_init(rx_sha256);
+        mbedtls_sha256_starts(rx_sha256, 0);
+        conn.rx_sha256 = rx_sha256;
+    }
+    conn.rx_last_busy_us = esp_timer_get_time();
+    conn.message_bucket.configure(config.rate_limit.messages_per_sec, config.rate_limit.message_burst);
+    conn.byte_bucket.configure(config.rate_limit.bytes_per_sec, config.rate_limit.byte_burst);
+    conn.priority = config.priority.default_class;
+    conn.tx_fragment_size = config.tx_fragment_size;
+    session_generation = session_generation == UINT16_MAX ? 1 : session_generation + 1;
+    conn.generation = session_generation;
+    WSTxRing *ring = tx_ring(conn);
+    if (ring != nullptr)
+    {
+        // A producer of the previous session may still be between reserve and commit.
+        int attempts = 0;
+        while (!ring->open(conn.generation) && ++attempts < 10)
+        {
+            vTaskDelay(1);
+        }
+        if (attempts == 10)
+        {
+            ESP_LOGW("WSLightServer", "Outbound ring of client %d still in use, reserveMessage() disabled", conn.sock);
+        }
+    }
+    conn.state = WS_CONN_OPEN;
+    select_outbox_target();
+    capture(conn, WS_CAPTURE_OPEN);
+    if (client_connected_callback)
+    {
+        client_connected_callback(conn.sock);
+    }
+    if (connection_opened_callback && conn.state == WS_CONN_OPEN)
+    {
+        conn.user_data = connection_opened_callback(connection_handle(conn));
+    }
+}
+
+void WSLightServer::process_rx_buffer(ws_connection_t &conn)
+{
+    size_t offset = 0;
+    while ((conn.state == WS_CONN_OPEN || conn.state == WS_CONN_CLOSING) && offset < conn.rx_len)
+    {
+        uint8_t *frame = conn.rx_buffer + offset;
+        size_t available = conn.rx_len - offset;
+
+        if (conn.discard_remaining > 0)
+        {
+            size_t skip = std::min<uint64_t>(available, conn.discard_remaining);
+            conn.discard_remaining -= skip;
+            offset += skip;
+            continue;
+        }
+
+        size_t header_len;
+        uint64_t payload_len;
+        if (!parse_frame_lengths(frame, available, header_len, payload_len))
+        {
+            break;
+        }
+        uint64_t frame_len = header_len + payload_len;
+
+        uint16_t close_code = WS_CLOSE_PROTOCOL_ERROR;
+        ws_frame_route_t route = route_frame(conn, frame, frame_len, close_code);
+        if (route == WS_ROUTE_CLOSE)
+        {
+            close_client_connection(conn, close_code);
+            continue;
+        }
+        if (route == WS_ROUTE_DISCARD)
+        {
+            conn.discard_remaining = frame_len;
+            continue;
+        }
+
+        if (!conn.frame_admitted)
+        {
+            bool close_connection = false;
+            if (!admit_inbound_frame(conn, frame, available, close_connection))
+            {
+                if (close_connection)
+                {
+                    close_client_connection(conn, WS_CLOSE_POLICY_VIOLATION);
+                    continue;
+                }
+                if (conn.rx_paused_until_us != 0)
+                {
+                    break;
+                }
+                conn.discard_remaining = frame_len;
+                continue;
+            }
+            conn.frame_admitted = true;
+        }
+
+        if (route == WS_ROUTE_BUFFER && available >= frame_len && binary_buffer_provider && payload_len > 0 &&
+            (frame[0] & 0x80) && (frame[0] & 0x0F) == HTTPD_WS_TYPE_BINARY)
+        {
+            // A buffered frame only leaves the receive buffer for one the application supplies.
+            conn.sink_dest = binary_buffer_provider(conn.sock, payload_len);
+            conn.sink_app = conn.sink_dest != nullptr;
+            if (conn.sink_app)
+            {
+                route = WS_ROUTE_DIRECT;
+            }
+        }
+
+        if (route == WS_ROUTE_DIRECT)
+        {
+            // Too big for the receive buffer, or going to the application's: read the payload into its final buffer.
+            if (available < header_len)
+            {
+                break;
+            }
+            conn.frame_admitted = false;
+            conn.sink_type = static_cast<ws_type_t>(frame[0] & 0x0F);
+            conn.sink_fin = frame[0] & 0x80;
+            if (!conn.sink_app && conn.sink_type == HTTPD_WS_TYPE_BINARY && conn.sink_fin && binary_buffer_provider &&
+                payload_len > 0 && payload_len <= SIZE_MAX)
+            {
+                conn.sink_dest = binary_buffer_provider(conn.sock, payload_len);
+                conn.sink_app = conn.sink_dest != nullptr;
+            }
+            if (!conn.sink_app)
+            {
+                if (frame_len > config.rx_buffer_size)
+                {
+                    ESP_LOGE("WSLightServer", "Received message too large, closing connection");
+                    close_client_connection(conn, WS_CLOSE_MESSAGE_TOO_BIG);
+                    continue;
+                }
+                if (!begin_payload(conn, conn.sink_type, conn.sink_fin, payload_len, conn.sink_message, conn.sink_dest))
+                {
+                    continue;
+                }
+            }
+            memcpy(conn.sink_mask, frame + header_len - 4, 4);
+            conn.sink_length = payload_len;
+            conn.sink_received = std::min<uint64_t>(available - header_len, payload_len);
+            unmask_data(conn, conn.sink_type, conn.sink_dest, frame + header_len, conn.sink_received, conn.sink_mask, 0);
+            rx_buffered_bytes += conn.sink_received;
+            offset += header_len + conn.sink_received;
+            if (conn.sink_received == conn.sink_length)
+            {
+                complete_direct_payload(conn);
+            }
+            continue;
+        }
+        if (available < frame_len)
+        {
+            break;
+        }
+
+        conn.frame_admitted = false;
+        offset += frame_len;
+
+        ws_type_t type;
+        DecodedMessage decoded;
+        if (decode_frame(conn, frame, frame_len, type, decoded))
+        {
+            process_message(conn, decoded, type);
+        }
+    }
+    finish_close(conn);
+
+    if (conn.state != WS_CONN_FREE && offset > 0)
+    {
+        conn.rx_len -= offset;
+        memmove(conn.rx_buffer, conn.rx_buffer + offset, conn.rx_len);
+    }
+}
+
+bool WSLightServer::admit_inbound_frame(ws_connection_t &conn, const uint8_t *frame, size_t len, bool &close_connection)
+{
+    if (!conn.message_bucket.enabled() && !conn.byte_bucket.enabled())
+    {
+        return true;
+    }
+    if ((frame[0] & 0x0F) == HTTPD_WS_TYPE_CLOSE)
+    {
+        return true;
+    }
+
+    size_t header_len;
+    uint64_t payload_len = 0;
+    parse_frame_lengths(frame, len, header_len, payload_len);
+    uint32_t bytes = payload_len > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(payload_len);
+
+    if (conn.message_bucket.waitTimeUs(1) == 0 && conn.byte_bucket.waitTimeUs(bytes) == 0)
+    {
+        conn.message_bucket.tryConsume(1);
+        conn.byte_bucket.tryConsume(bytes);
+        if (conn.frame_delayed)
+        {
+            conn.frame_delayed = false;
+            rate_limit_stats.delayed++;
+        }
+        else
+        {
+            rate_limit_stats.accepted++;
+        }
+        return true;
+    }
+
+    switch (config.rate_limit.action)
+    {
+    case WS_RATE_LIMIT_DELAY:
+    {
+        // Leave the frame in the buffer and stop reading; the client's window fills up.
+        uint64_t wait_us = std::max(conn.message_bucket.waitTimeUs(1), conn.byte_bucket.waitTimeUs(bytes));
+        conn.rx_paused_until_us = esp_timer_get_time() + wait_us;
+        conn.frame_delayed = true;
+        return false;
+    }
+
+    case WS_RATE_LIMIT_DROP:
+        rate_limit_stats.dropped++;
+        if (debug)
+        {
+            ESP_LOGW("WSLightServer", "Rate limit exceeded, dropping frame from client %d", conn.sock);
+        }
+        if ((frame[0] & 0x08) == 0)
+        {
+            // Drop the whole message, never deliver it with a hole where this fragment was.
+            discard_fragments(conn);
+            bool fin = frame[0] & 0x80;
+            ws_type_t type = static_cast<ws_type_t>(frame[0] & 0x0F);
+            if (fin)
+            {
+                conn.fragment_type = HTTPD_WS_TYPE_CONTINUE;
+            }
+            else if (type != HTTPD_WS_TYPE_CONTINUE)
+            {
+                conn.fragment_type = type;
+            }
+            conn.rx_drop_message = !fin;
+        }
+        return false;
+
+    case WS_RATE_LIMIT_CLOSE:
+    default:
+        rate_limit_stats.closed++;
+        ESP_LOGW("WSLightServer", "Rate limit exceeded, closing client %d", conn.sock);
+        close_connection = true;
+        return false;
+    }
+}
+
+esp_err_t WSLightServer::setClientPriority(int client_sock, ws_priority_t priority)
+{
+    if (priority < 0 || priority >= WS_PRIORITY_COUNT)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    ws_connection_t *conn = find_connection(client_sock);
+    if (conn != nullptr)
+    {
+        conn->priority = priority;
+    }
+    xSemaphoreGiveRecursive(conn_lock);
+    return conn != nullptr ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t WSLightServer::setFragmentSize(int client_sock, size_t fragment_size)
+{
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    ws_connection_t *conn = find_connection(client_sock);
+    if (conn != nullptr)
+    {
+        conn->tx_fragment_size = fragment_size;
+    }
+    xSemaphoreGiveRecursive(conn_lock);
+    return conn != nullptr ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+ws_priority_stats_t WSLightServer::getPriorityStats(ws_priority_t priority)
+{
+    ws_priority_stats_t stats = {};
+    if (priority < 0 || priority >= WS_PRIORITY_COUNT)
+    {
+        return stats;
+    }
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    stats = priority_stats[priority];
+    for (auto &conn : connections)
+    {
+        if (conn.state == WS_CONN_OPEN && conn.priority == priority)
+        {
+            stats.connections++;
+            stats.queued_bytes += conn.tx_queued_bytes;
+        }
+    }
+    xSemaphoreGiveRecursive(conn_lock);
+    return stats;
+}
+
+ws_close_stats_t WSLightServer::getCloseStats() const
+{
+    return close_stats;
+}
+
+ws_wakeup_stats_t WSLightServer::getWakeupStats() const
+{
+    ws_wakeup_stats_t stats = wakeup_stats;
+    int64_t elapsed_us = esp_timer_get_time() - wakeup_window_us;
+    if (elapsed_us >= 2000000)
+    {
+        // The loop has been asleep for a while; report the rate over the open window instead.
+        stats.wakeups_per_sec = wakeup_window_count * 1000000LL / elapsed_us;
+    }
+    return stats;
+}
+
+ws_rate_limit_stats_t WSLightServer::getRateLimitStats() const
+{
+    return rate_limit_stats;
+}
+
+ws_auth_stats_t WSLightServer::getAuthStats() const
+{
+    return auth_stats;
+}
+
+ws_memory_stats_t WSLightServer::getMemoryStats() const
+{
+    ws_memory_stats_t stats;
+    stats.used = memory.used();
+    stats.peak = memory.peak();
+    stats.budget = memory.budget();
+    stats.failed_reservations = memory.failures();
+    stats.rejected_connections = rejected_connections;
+    stats.shed_frames = shed_frames;
+    stats.shed_bytes = shed_bytes;
+    return stats;
+}
+
+void WSLightServer::send_close_frame(ws_connection_t &conn, uint16_t code)
+{
+    std::vector<uint8_t> payload = {static_cast<uint8_t>(code >> 8), static_cast<uint8_t>(code & 0xFF)};
+    std::vector<uint8_t> close_frame = encode_frame(payload, HTTPD_WS_TYPE_CLOSE);
+    send(conn.sock, close_frame.data(), close_frame.size(), MSG_DONTWAIT);
+}
+
+void WSLightServer::close_client_connection(ws_connection_t &conn, uint16_t code)
+{
+    if (conn.state != WS_CONN_OPEN)
+    {
+        cleanup_client_connection(conn);
+        return;
+    }
+
+    std::vector<uint8_t> payload = {static_cast<uint8_t>(code >> 8), static_cast<uint8_t>(code & 0xFF)};
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    esp_err_t err = enqueue_frame(conn, encode_frame(payload, HTTPD_WS_TYPE_CLOSE));
+    if (err == ESP_OK)
+    {
+        // Senders in other tasks must not queue data behind the close frame.
+        close_tx_ring(conn);
+        conn.state = WS_CONN_CLOSING;
+    }
+    xSemaphoreGiveRecursive(conn_lock);
+    if (err != ESP_OK)
+    {
+        cleanup_client_connection(conn);
+        return;
+    }
+
+    if (conn.sink_dest != nullptr)
+    {
+        abort_direct_payload(conn);
+    }
+    close_stats.initiated++;
+    conn.close_deadline_us = esp_timer_get_time() + static_cast<int64_t>(config.close_linger_ms) * 1000;
+    conn.frame_admitted = false;
+    conn.rx_paused_until_us = 0;
+}
+
+void WSLightServer::handle_close(ws_connection_t &conn, DecodedMessage &decoded)
+{
+    if (conn.state == WS_CONN_CLOSING)
+    {
+        // The client answered our close frame, or repeated its own.
+        conn.close_received = true;
+        return;
+    }
+
+    const uint8_t *payload = static_cast<const uint8_t *>(decoded.data);
+    uint16_t code = WS_CLOSE_NO_STATUS;
+    std::string reason;
+    uint16_t reply = WS_CLOSE_NORMAL;
+    if (decoded.length == 1)
+    {
+        reply = WS_CLOSE_PROTOCOL_ERROR;
+    }
+    else if (decoded.length >= 2)
+    {
+        code = (payload[0] << 8) | payload[1];
+        reason.assign(reinterpret_cast<const char *>(payload) + 2, decoded.length - 2);
+        if (!valid_close_code(code))
+        {
+            reply = WS_CLOSE_PROTOCOL_ERROR;
+        }
+        else if (!valid_utf8(payload + 2, decoded.length - 2))
+        {
+            reply = WS_CLOSE_INVALID_PAYLOAD;
+        }
+        else
+        {
+            reply = code;
+        }
+    }
+
+    ESP_LOGI("WSLightServer", "Received close frame from client %d, code %u", conn.sock, code);
+    if (close_message_callback)
+    {
+        close_message_callback(conn.sock);
+    }
+    if (close_status_callback)
+    {
+        close_status_callback(conn.sock, code, reason);
+    }
+
+    std::vector<uint8_t> echo;
+    if (decoded.length != 0)
+    {
+        echo = {static_cast<uint8_t>(reply >> 8), static_cast<uint8_t>(reply & 0xFF)};
+    }
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    esp_err_t err = enqueue_frame(conn, encode_frame(echo, HTTPD_WS_TYPE_CLOSE));
+    if (err == ESP_OK)
+    {
+        close_tx_ring(conn);
+        conn.state = WS_CONN_CLOSING;
+    }
+    xSemaphoreGiveRecursive(conn_lock);
+    if (err != ESP_OK)
+    {
+        cleanup_client_connection(conn);
+        return;
+    }
+
+    close_stats.received++;
+    conn.close_received = true;
+    conn.close_deadline_us = esp_timer_get_time() + static_cast<int64_t>(config.close_linger_ms) * 1000;
+}
+
+void WSLightServer::capture(ws_connection_t &conn, ws_capture_kind_t kind, const uint8_t *data, size_t length)
+{
+    if (config.capture != nullptr)
+    {
+        config.capture->record(connection_handle(conn).slot, kind, data, length);
+    }
+}
+
+bool WSLightServer::is_outbox_target(const ws_connection_t &conn) const
+{
+    return outbox_target.generation != 0 && conn.generation == outbox_target.generation &&
+           connection_handle(conn).slot == outbox_target.slot;
+}
+
+void WSLightServer::select_outbox_target()
+{
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    if (config.outbox != nullptr && outbox_target.generation == 0 && !config.outbox->empty())
+    {
+        for (auto &conn : connections)
+        {
+            if (conn.state == WS_CONN_OPEN)
+            {
+                outbox_target = connection_handle(conn);
+                outbox_wait_bytes = 0;
+                ESP_LOGI("WSLightServer", "Draining the outbox to client %d", conn.sock);
+                break;
+            }
+        }
+    }
+    xSemaphoreGiveRecursive(conn_lock);
+}
+
+void WSLightServer::drain_outbox(ws_connection_t &conn)
+{
+    if (!is_outbox_target(conn) || conn.state != WS_CONN_OPEN || !conn.tx_queue.empty() || conn.tx_ring_offset > 0)
+    {
+        return;
+    }
+    // Everything gathered so far has been handed to the socket.
+    config.outbox->release();
+    if (config.outbox->empty())
+    {
+        if (outbox_appends > 0)
+        {
+            // A broadcast still being stored belongs behind the drained ones; send_message() wakes the task.
+            return;
+        }
+        outbox_target = {};
+        ESP_LOGI("WSLightServer", "Outbox drained to client %d", conn.sock);
+        return;
+    }
+    outbox_wait_bytes = 0;
+    config.outbox->gather([&](const uint8_t *data, size_t length, ws_type_t type)
+                          {
+        if (!message_deliverable(length, conn.tx_fragment_size))
+        {
+            ESP_LOGW("WSLightServer", "Dropping a stored message of %zu bytes client %d cannot take", length, conn.sock);
+            return ESP_ERR_INVALID_SIZE;
+        }
+        esp_err_t err = enqueue_message(conn, data, length, type);
+        if (err == ESP_ERR_NO_MEM)
+        {
+            outbox_wait_bytes = message_wire_size(length, conn.tx_fragment_size);
+        }
+        return err; });
+}
 
-    if (listen(server_sock, 128) != 0)
+void WSLightServer::finish_close(ws_connection_t &conn)
+{
+    // The server closes TCP first once both close frames have been exchanged (RFC 6455, section 7.1.1).
+    if (conn.state == WS_CONN_CLOSING && conn.close_received && conn.tx_queue.empty())
     {
-        ESP_LOGE("WSLightServer", "Error occurred during listen: errno %d", errno);
-        close(server_sock);
-        vTaskDelete(nullptr);
-        return false;
+        close_stats.completed++;
+        cleanup_client_connection(conn);
     }
+}
 
-    ESP_LOGI("WSLightServer", "Server listening on port %d", port);
-
-    if (ping_pong_enabled)
+ws_connection_t *WSLightServer::find_connection(int client_sock)
+{
+    for (auto &conn : connections)
     {
-        ping_timer = xTimerCreate("PingTimer", pdMS_TO_TICKS(ping_interval_ms), pdTRUE, this, &WSLightServer::send_ping);
-        if (ping_timer == nullptr)
-        {
-            ESP_LOGE("WSLightServer", "Failed to create ping timer");
-            close(server_sock);
-            vTaskDelete(nullptr);
-            return false;
-        }
-        if (xTimerStart(ping_timer, 0) != pdPASS)
+        if (conn.state == WS_CONN_OPEN && conn.sock == client_sock)
         {
-            ESP_LOGE("WSLightServer", "Failed to start ping timer");
-            xTimerDelete(ping_timer, 0);
-            close(server_sock);
-            vTaskDelete(nullptr);
-            return false;
+            return &conn;
         }
     }
-
-    return true;
+    return nullptr;
 }
 
-void WSLightServer::handle_client_connection()
+ws_connection_t *WSLightServer::find_connection(ws_conn_handle_t handle)
 {
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
-    client_sock = accept(server_sock, (struct sockaddr *)&client_addr, &client_addr_len);
-
-    if (client_sock < 0)
+    if (handle.generation == 0 || handle.slot >= connections.size())
     {
-        ESP_LOGE("WSLightServer", "Unable to accept connection: errno %d", errno);
-        return;
+        return nullptr;
     }
+    ws_connection_t &conn = connections[handle.slot];
+    return conn.state == WS_CONN_OPEN && conn.generation == handle.generation ? &conn : nullptr;
+}
 
-    ESP_LOGI("WSLightServer", "Client connected: %d", client_sock);
-    if (client_connected_callback)
+ws_conn_handle_t WSLightServer::connection_handle(const ws_connection_t &conn) const
+{
+    ws_conn_handle_t handle = {static_cast<uint16_t>(&conn - connections.data()), conn.generation};
+    return handle;
+}
+
+WSTxRing *WSLightServer::tx_ring(const ws_connection_t &conn)
+{
+    return tx_rings.empty() ? nullptr : &tx_rings[connection_handle(conn).slot];
+}
+
+void WSLightServer::close_tx_ring(ws_connection_t &conn)
+{
+    WSTxRing *ring = tx_ring(conn);
+    if (ring != nullptr)
     {
-        client_connected_callback(client_sock);
+        ring->close();
     }
+}
 
-    char buffer[MAX_MESSAGE_SIZE];
-    int len = recv(client_sock, buffer, sizeof(buffer) - 1, 0);
-    if (len < 0)
+size_t WSLightServer::buffered_bytes(ws_connection_t &conn)
+{
+    WSTxRing *ring = tx_ring(conn);
+    return conn.tx_queued_bytes - conn.tx_offset + (ring != nullptr ? ring->pending() - conn.tx_ring_offset : 0);
+}
+
+void WSLightServer::cleanup_client_connection(ws_connection_t &conn)
+{
+    if (conn.state == WS_CONN_FREE)
     {
-        ESP_LOGE("WSLightServer", "recv failed: errno %d", errno);
-        close(client_sock);
         return;
     }
-    if (len >= MAX_MESSAGE_SIZE)
+    if (conn.sink_dest != nullptr)
     {
-        ESP_LOGE("WSLightServer", "Received message too large, closing connection");
-        close(client_sock);
-        return;
+        abort_direct_payload(conn);
     }
-
-    buffer[len] = '\0';
-    send_handshake(client_sock, std::string(buffer, len));
-
-    while (true)
+    close_stats.reclaimed++;
+    if (conn.state == WS_CONN_OPEN)
     {
-        len = recv(client_sock, buffer, sizeof(buffer), 0);
-        if (len < 0)
-        {
-            ESP_LOGE("WSLightServer", "recv failed: errno %d", errno);
-            break;
-        }
-        if (len == 0)
+        close_stats.aborted++;
+    }
+    if (conn.state == WS_CONN_OPEN || conn.state == WS_CONN_CLOSING)
+    {
+        close_tx_ring(conn);
+        capture(conn, WS_CAPTURE_CLOSE);
+        if (client_disconnected_callback)
         {
-            ESP_LOGI("WSLightServer", "Client %d closed connection", client_sock);
-            break;
+            client_disconnected_callback(conn.sock);
         }
-
-        if (len >= MAX_MESSAGE_SIZE)
+        else
         {
-            ESP_LOGE("WSLightServer", "Received message too large, closing connection");
-            break;
+            ESP_LOGI("WSLightServer", "Client disconnected: %d", conn.sock);
         }
-
-        std::vector<uint8_t> frame(buffer, buffer + len);
-        ws_type_t type;
-        auto decoded = decode_frame(frame, type);
-        if (decoded.data == nullptr)
+        if (connection_closed_callback)
         {
-            continue;
+            connection_closed_callback(connection_handle(conn), conn.user_data);
         }
-
-        process_message(client_sock, decoded, type);
-        vTaskDelay(pdMS_TO_TICKS(relief_delay));
     }
-}
 
-void WSLightServer::cleanup_client_connection()
-{
-    if (client_disconnected_callback)
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    bool outbox_dropped = is_outbox_target(conn);
+    close(conn.sock);
+    if (conn.rx_buffer != nullptr)
     {
-        client_disconnected_callback(client_sock);
+        vPortFree(conn.rx_buffer);
+        memory.release(conn.rx_capacity);
     }
-    else
+    discard_fragments(conn);
+    if (conn.rx_sha256 != nullptr)
     {
-        ESP_LOGI("WSLightServer", "Client disconnected: %d", client_sock);
+        mbedtls_sha256_free(conn.rx_sha256);
+        vPortFree(conn.rx_sha256);
     }
-
-    close(client_sock);
-    client_sock = -1;
-}
-void WSLightServer::process_message(int client_sock, DecodedMessage &decoded, ws_type_t type)
-{
-    if (type == HTTPD_WS_TYPE_CONTINUE)
+    memory.release(conn.tx_queued_bytes);
+    conn = ws_connection_t();
+    if (outbox_dropped)
     {
-        ESP_LOGI("WSLightServer", "Continuation frame");
-        return;
+        // What it was handed but not released goes to the next session again.
+        config.outbox->rewind();
+        outbox_target = {};
+        select_outbox_target();
     }
-
+    xSemaphoreGiveRecursive(conn_lock);
+}
+void WSLightServer::process_message(ws_connection_t &conn, DecodedMessage &decoded, ws_type_t type)
+{
+    int client_sock = conn.sock;
 
     switch (type)
     {
-    case HTTPD_WS_TYPE_CONTINUE:
-
-        ESP_LOGI("WSLightServer", "Continuation frame");
-        break;
-
     case HTTPD_WS_TYPE_TEXT:
-        if (text_message_callback)
+        if (!valid_utf8(static_cast<const uint8_t *>(decoded.data), decoded.length))
+        {
+            ESP_LOGE("WSLightServer", "Text message from client %d is not valid UTF-8", client_sock);
+            close_client_connection(conn, WS_CLOSE_INVALID_PAYLOAD);
+        }
+        else if (text_message_callback || connection_text_callback || connection_message_callback)
         {
-            text_message_callback(client_sock, std::string((char *)decoded.data, decoded.length));
+            if (text_message_callback || connection_text_callback)
+            {
+                std::string text((char *)decoded.data, decoded.length);
+                if (text_message_callback)
+                {
+                    text_message_callback(client_sock, text);
+                }
+                if (connection_text_callback)
+                {
+                    connection_text_callback(connection_handle(conn), conn.user_data, text);
+                }
+            }
+            lend_message(conn, decoded, type);
         }
         else
         {
@@ -438,9 +2932,22 @@ void WSLightServer::process_message(int client_sock, DecodedMessage &decoded, ws
         break;
 
     case HTTPD_WS_TYPE_BINARY:
-        if (binary_message_callback)
+        finish_digest(conn);
+        if (binary_message_callback || connection_binary_callback || connection_message_callback)
         {
-            binary_message_callback(client_sock, std::vector<uint8_t>((uint8_t *)decoded.data, (uint8_t *)decoded.data + decoded.length));
+            if (binary_message_callback || connection_binary_callback)
+            {
+                std::vector<uint8_t> data((uint8_t *)decoded.data, (uint8_t *)decoded.data + decoded.length);
+                if (binary_message_callback)
+                {
+                    binary_message_callback(client_sock, data);
+                }
+                if (connection_binary_callback)
+                {
+                    connection_binary_callback(connection_handle(conn), conn.user_data, data);
+                }
+            }
+            lend_message(conn, decoded, type);
         }
         else
         {
@@ -450,7 +2957,7 @@ void WSLightServer::process_message(int client_sock, DecodedMessage &decoded, ws
         break;
 
     case HTTPD_WS_TYPE_PING:
-        handle_ping(client_sock, decoded);
+        handle_ping(conn, decoded);
         break;
 
     case HTTPD_WS_TYPE_PONG:
@@ -468,12 +2975,7 @@ void WSLightServer::process_message(int client_sock, DecodedMessage &decoded, ws
         break;
 
     case HTTPD_WS_TYPE_CLOSE:
-        ESP_LOGI("WSLightServer", "Received close frame from client %d", client_sock);
-        if (close_message_callback)
-        {
-            close_message_callback(client_sock);
-        }
-        cleanup_client_connection();
+        handle_close(conn, decoded);
         break;
 
     default:
@@ -482,17 +2984,41 @@ void WSLightServer::process_message(int client_sock, DecodedMessage &decoded, ws
     }
 
 
-    if (decoded.data != nullptr)
+    if (decoded.data != nullptr && decoded.headroom == 0)
     {
         vPortFree(decoded.data);
+        memory.release(decoded.length);
+    }
+}
+
+void WSLightServer::lend_message(ws_connection_t &conn, DecodedMessage &decoded, ws_type_t type)
+{
+    if (!connection_message_callback || conn.state != WS_CONN_OPEN)
+    {
+        return;
     }
+    // An empty message may have no buffer; forwarding it still needs a valid pointer.
+    static const uint8_t empty = 0;
+    ws_message_view_t message = {decoded.data != nullptr ? static_cast<const uint8_t *>(decoded.data) : &empty,
+                                 static_cast<size_t>(decoded.length), type};
+    lent_message = decoded.headroom > 0 ? static_cast<uint8_t *>(decoded.data) : nullptr;
+    connection_message_callback(connection_handle(conn), conn.user_data, message);
+    lent_message = nullptr;
 }
 
-void WSLightServer::handle_ping(int client_sock, DecodedMessage &decoded)
+void WSLightServer::handle_ping(ws_connection_t &conn, DecodedMessage &decoded)
 {
+    int client_sock = conn.sock;
     std::vector<uint8_t> ping_data(static_cast<uint8_t *>(decoded.data), static_cast<uint8_t *>(decoded.data) + decoded.length);
     std::vector<uint8_t> pong_frame = encode_frame(ping_data, HTTPD_WS_TYPE_PONG);
-    send(client_sock, pong_frame.data(), pong_frame.size(), 0);
+    if (debug)
+    {
+        ESP_LOGW("WSLightServer", "Sending pong frame:");
+        esp_log_buffer_hex("WSLightServer", pong_frame.data(), pong_frame.size());
+    }
+    xSemaphoreTakeRecursive(conn_lock, portMAX_DELAY);
+    enqueue_frame(conn, std::move(pong_frame));
+    xSemaphoreGiveRecursive(conn_lock);
     if (ping_message_callback)
     {
         ping_message_callback(client_sock);
@@ -503,13 +3029,11 @@ void WSLightServer::handle_ping(int client_sock, DecodedMessage &decoded)
         {
             ESP_LOGI("WSLightServer", "Received ping from client %d", client_sock);
             esp_log_buffer_hex("Ping Data", ping_data.data(), ping_data.size());
-            ESP_LOGW("WSLightServer", "Sending pong frame:");
-            esp_log_buffer_hex("WSLightServer", pong_frame.data(), pong_frame.size());
         }
     }
 }
 
-void WSLightServer::send_handshake(int client_sock, const std::string &request)
+bool WSLightServer::send_handshake(int client_sock, const std::string &request)
 {
     std::string request_lower = request;
     std::transform(request_lower.begin(), request_lower.end(), request_lower.begin(), ::tolower);
@@ -552,251 +3076,412 @@ void WSLightServer::send_handshake(int client_sock, const std::string &request)
         }
 
         send(client_sock, handshake.c_str(), handshake.length(), 0);
+        return true;
     }
     else
     {
         ESP_LOGE("HANDSHAKE", "Sec-WebSocket-Key header not found!");
+        return false;
     }
 }
 
-WSLightServer::DecodedMessage WSLightServer::decode_frame(const std::vector<uint8_t> &frame, ws_type_t &type)
+bool WSLightServer::decode_frame(ws_connection_t &conn, uint8_t *frame, size_t len, ws_type_t &type, DecodedMessage &decoded)
 {
-    if (frame.size() < 2)
+    size_t offset;
+    uint64_t payload_len;
+    if (!parse_frame_lengths(frame, len, offset, payload_len) || len < offset + payload_len)
     {
-        ESP_LOGE("WSLightServer", "Frame too short to be valid. Size: %zu", frame.size());
+        ESP_LOGE("WSLightServer", "Frame too short to be valid. Size: %zu", len);
         if (debug)
         {
-            log_frame_details(frame);
+            log_frame_details(frame, len);
         }
-        return {nullptr, 0};
+        return false;
     }
 
-    uint8_t first_byte = frame[0];
-    uint8_t second_byte = frame[1];
-    bool fin = first_byte & 0x80;
-    type = static_cast<ws_type_t>(first_byte & 0x0F);
+    bool fin = frame[0] & 0x80;
+    type = static_cast<ws_type_t>(frame[0] & 0x0F);
+    ESP_LOGD("WSLightServer", "Frame details - FIN: %d, Type: %d, Payload Length: %llu", fin, type, payload_len);
+
+    if (fin && (type == HTTPD_WS_TYPE_TEXT || type == HTTPD_WS_TYPE_BINARY))
+    {
+        // A whole data message is unmasked where it lies, and its header leaves room to forward it.
+        uint8_t *payload = frame + offset;
+        unmask_data(conn, type, payload, payload, payload_len, frame + offset - 4, 0);
+        rx_buffered_bytes += payload_len;
+        decoded = {payload, payload_len, offset};
+        return true;
+    }
 
-    bool masked = second_byte & 0x80;
-    uint64_t payload_len = second_byte & 0x7F;
-    size_t offset = 2;
+    uint8_t *message;
+    uint8_t *dest;
+    if (!begin_payload(conn, type, fin, payload_len, message, dest))
+    {
+        return false;
+    }
+    unmask_data(conn, type, dest, frame + offset, payload_len, frame + offset - 4, 0);
+    rx_buffered_bytes += payload_len;
+    return end_payload(conn, type, fin, message, payload_len, decoded);
+}
 
-    ESP_LOGD("WSLightServer", "Frame details - FIN: %d, Type: %d, Masked: %d, Payload Length: %llu",
-             fin, type, masked, payload_len);
+ws_frame_route_t WSLightServer::route_frame(ws_connection_t &conn, const uint8_t *frame, uint64_t frame_len, uint16_t &close_code)
+{
+    ws_type_t type = static_cast<ws_type_t>(frame[0] & 0x0F);
+    bool fin = frame[0] & 0x80;
+    bool control = type & 0x08;
+    uint64_t payload_len = frame[1] & 0x7F;
 
-    if (payload_len == 126)
+    if (conn.state == WS_CONN_CLOSING)
     {
-        if (frame.size() < 4)
-        {
-            ESP_LOGE("WSLightServer", "Frame too short for extended payload length. Size: %zu", frame.size());
-            if (debug)
-            {
-                log_frame_details(frame);
-            }
-            return {nullptr, 0};
-        }
-        payload_len = (frame[2] << 8) | frame[3];
-        offset = 4;
+        // Only the answer to our close frame matters now.
+        return type == HTTPD_WS_TYPE_CLOSE && frame_len <= conn.rx_capacity ? WS_ROUTE_BUFFER : WS_ROUTE_DISCARD;
     }
-    else if (payload_len == 127)
+
+    close_code = WS_CLOSE_PROTOCOL_ERROR;
+    if (frame[0] & 0x70)
     {
-        if (frame.size() < 10)
-        {
-            ESP_LOGE("WSLightServer", "Frame too short for extended payload length. Size: %zu", frame.size());
-            if (debug)
-            {
-                log_frame_details(frame);
-            }
-            return {nullptr, 0};
-        }
-        payload_len = 0;
-        for (int i = 0; i < 8; ++i)
-        {
-            payload_len = (payload_len << 8) | frame[2 + i];
-        }
-        offset = 10;
+        ESP_LOGE("WSLightServer", "Reserved bits set without a negotiated extension");
+        return WS_ROUTE_CLOSE;
+    }
+    if (type != HTTPD_WS_TYPE_CONTINUE && type != HTTPD_WS_TYPE_TEXT && type != HTTPD_WS_TYPE_BINARY &&
+        type != HTTPD_WS_TYPE_CLOSE && type != HTTPD_WS_TYPE_PING && type != HTTPD_WS_TYPE_PONG)
+    {
+        ESP_LOGE("WSLightServer", "Reserved opcode %d", type);
+        return WS_ROUTE_CLOSE;
+    }
+    if (!(frame[1] & 0x80))
+    {
+        ESP_LOGE("WSLightServer", "Client frames must be masked. Frame Type: %d", type);
+        return WS_ROUTE_CLOSE;
+    }
+    if (payload_len == 127 && (frame[2] & 0x80))
+    {
+        ESP_LOGE("WSLightServer", "64-bit payload length with the most significant bit set");
+        return WS_ROUTE_CLOSE;
+    }
+    if (control && (!fin || payload_len > 125))
+    {
+        ESP_LOGE("WSLightServer", "Control frames must be whole and at most 125 bytes");
+        return WS_ROUTE_CLOSE;
+    }
+    if (type == HTTPD_WS_TYPE_CONTINUE && conn.fragment_type == HTTPD_WS_TYPE_CONTINUE)
+    {
+        ESP_LOGE("WSLightServer", "Continuation frame without a message to continue");
+        return WS_ROUTE_CLOSE;
+    }
+    if (!control && type != HTTPD_WS_TYPE_CONTINUE && conn.fragment_type != HTTPD_WS_TYPE_CONTINUE)
+    {
+        ESP_LOGE("WSLightServer", "New message before the fragmented one ended");
+        return WS_ROUTE_CLOSE;
     }
 
-    if (masked)
+    if (type == HTTPD_WS_TYPE_CONTINUE && conn.rx_drop_message)
     {
-        if (frame.size() < offset + 4 + payload_len)
+        // The rest of a message dropped by rate limiting.
+        if (fin)
         {
-            ESP_LOGE("WSLightServer", "Frame too short for mask and payload. Expected: %llu, Size: %d", offset + 4 + payload_len, frame.size());
-            if (debug)
-            {
-                log_frame_details(frame);
-            }
-            return {nullptr, 0};
+            conn.rx_drop_message = false;
+            conn.fragment_type = HTTPD_WS_TYPE_CONTINUE;
         }
-        std::vector<uint8_t> mask_key(frame.begin() + offset, frame.begin() + offset + 4);
-        offset += 4;
+        return WS_ROUTE_DISCARD;
+    }
 
-        void *message = nullptr;
-        if (payload_len > 0)
+    close_code = WS_CLOSE_MESSAGE_TOO_BIG;
+    if (type == HTTPD_WS_TYPE_CONTINUE || (!control && !fin))
+    {
+        // Each fragment fits rx_buffer_size, the message they add up to must fit rx_message_max.
+        uint64_t length = frame_len - 6 - (payload_len == 126 ? 2 : payload_len == 127 ? 8 : 0);
+        uint64_t total = (type == HTTPD_WS_TYPE_CONTINUE ? conn.fragment_length : 0) + length;
+        if (total > (config.rx_message_max != 0 ? config.rx_message_max : config.rx_buffer_size))
         {
-            message = pvPortMalloc(payload_len);
-            if (!message)
-            {
-                ESP_LOGE("WSLightServer", "Memory allocation failed");
-                return {nullptr, 0};
-            }
-            for (uint64_t i = 0; i < payload_len; ++i)
-            {
-                ((uint8_t *)message)[i] = frame[offset + i] ^ mask_key[i % 4];
-            }
+            ESP_LOGE("WSLightServer", "Fragmented message too large, closing connection");
+            return WS_ROUTE_CLOSE;
         }
+    }
 
-        if (fin)
-        {
-            DecodedMessage decoded = {message, payload_len};
-            accumulated_message.data = nullptr;
-            accumulated_message.length = 0;
-            return decoded;
-        }
-        else
-        {
-            if (accumulated_message.data != nullptr)
-            {
-                size_t new_length = accumulated_message.length + payload_len;
-                void *new_data = pvPortMalloc(new_length);
-                if (!new_data)
-                {
-                    ESP_LOGE("WSLightServer", "Memory allocation failed during accumulation");
-                    vPortFree(accumulated_message.data);
-                    accumulated_message.data = nullptr;
-                    accumulated_message.length = 0;
-                    return {nullptr, 0};
-                }
+    // The application may want a binary message in its own buffer, whatever the size.
+    bool app_buffer = type == HTTPD_WS_TYPE_BINARY && fin && binary_buffer_provider;
+    if (frame_len > config.rx_buffer_size && !app_buffer)
+    {
+        ESP_LOGE("WSLightServer", "Received message too large, closing connection");
+        return WS_ROUTE_CLOSE;
+    }
+    return frame_len <= conn.rx_capacity ? WS_ROUTE_BUFFER : WS_ROUTE_DIRECT;
+}
 
-                memcpy(new_data, accumulated_message.data, accumulated_message.length);
-                memcpy(static_cast<uint8_t *>(new_data) + accumulated_message.length, (uint8_t *)message, payload_len);
-                vPortFree(accumulated_message.data);
-                accumulated_message.data = new_data;
-                accumulated_message.length = new_length;
-                vPortFree(message);
-            }
-            else
-            {
-                accumulated_message.data = message;
-                accumulated_message.length = payload_len;
-            }
+bool WSLightServer::begin_payload(ws_connection_t &conn, ws_type_t type, bool fin, uint64_t length, uint8_t *&message, uint8_t *&dest)
+{
+    message = nullptr;
+    dest = nullptr;
+    if (length == 0)
+    {
+        return true;
+    }
 
-            return {nullptr, 0};
-        }
+    bool whole = (type & 0x08) || (fin && type != HTTPD_WS_TYPE_CONTINUE);
+    size_t size = whole ? length : conn.fragment_length + length;
+    if (!whole && size <= conn.fragment_capacity)
+    {
+        dest = conn.fragment_data + conn.fragment_length;
+        conn.fragment_length = size;
+        return true;
     }
-    else
+    if (!whole)
     {
-        ESP_LOGE("WSLightServer", "Client frames must be masked. Frame Type: %d", type);
-        if (debug)
+        // Grow geometrically up to the message limit so reassembly copies each byte a bounded number of times.
+        size_t limit = config.rx_message_max != 0 ? config.rx_message_max : config.rx_buffer_size;
+        size = std::max(size, std::min(conn.fragment_capacity * 2, limit));
+    }
+    size_t growth = size - (whole ? 0 : conn.fragment_capacity);
+    bool reserved = memory.reserve(growth);
+    uint8_t *buffer = reserved ? static_cast<uint8_t *>(pvPortMalloc(size)) : nullptr;
+    if (buffer == nullptr)
+    {
+        ESP_LOGE("WSLightServer", "Memory allocation failed");
+        if (reserved)
         {
-            log_frame_details(frame);
+            memory.release(growth);
         }
-        return {nullptr, 0};
+        close_client_connection(conn, WS_CLOSE_MESSAGE_TOO_BIG);
+        return false;
     }
+
+    if (whole)
+    {
+        message = buffer;
+        dest = buffer;
+        return true;
+    }
+    if (conn.fragment_data != nullptr)
+    {
+        memcpy(buffer, conn.fragment_data, conn.fragment_length);
+        vPortFree(conn.fragment_data);
+    }
+    conn.fragment_data = buffer;
+    conn.fragment_capacity = size;
+    dest = buffer + conn.fragment_length;
+    conn.fragment_length += length;
+    return true;
 }
 
-std::vector<uint8_t> WSLightServer::encode_frame(const std::vector<uint8_t> &message, ws_type_t type)
+void WSLightServer::discard_fragments(ws_connection_t &conn)
 {
-    std::vector<uint8_t> frame;
-    uint8_t first_byte = 0x80 | (type & 0x0F);
-    frame.push_back(first_byte);
-
-    size_t message_size = message.size();
+    if (conn.fragment_data != nullptr)
+    {
+        vPortFree(conn.fragment_data);
+        memory.release(conn.fragment_capacity);
+    }
+    conn.fragment_data = nullptr;
+    conn.fragment_length = 0;
+    conn.fragment_capacity = 0;
+}
 
-    if (message_size <= 125)
+bool WSLightServer::end_payload(ws_connection_t &conn, ws_type_t &type, bool fin, uint8_t *message, uint64_t length, DecodedMessage &decoded)
+{
+    if ((type & 0x08) || (fin && type != HTTPD_WS_TYPE_CONTINUE))
     {
-        frame.push_back(static_cast<uint8_t>(message_size));
+        decoded = {message, length};
+        return true;
     }
-    else if (message_size <= 65535)
+
+    if (type != HTTPD_WS_TYPE_CONTINUE)
     {
-        frame.push_back(126);
-        frame.push_back((message_size >> 8) & 0xFF);
-        frame.push_back(message_size & 0xFF);
+        conn.fragment_type = type;
     }
-    else
+    if (!fin)
     {
-        frame.push_back(127);
-        for (int i = 7; i >= 0; --i)
-        {
-            frame.push_back((message_size >> (i * 8)) & 0xFF);
-        }
+        return false;
     }
 
-    bool mask = false;
-    if (mask)
-    {
-        frame[1] |= 0x80;
-        uint8_t mask_key[4];
-        for (int i = 0; i < 4; ++i)
-        {
-            mask_key[i] = rand() % 256;
-            frame.push_back(mask_key[i]);
-        }
+    type = conn.fragment_type;
+    decoded = {conn.fragment_data, conn.fragment_length};
+    // The message is released by its length once handled; the unused tail of the buffer now.
+    memory.release(conn.fragment_capacity - conn.fragment_length);
+    conn.fragment_data = nullptr;
+    conn.fragment_length = 0;
+    conn.fragment_capacity = 0;
+    conn.fragment_type = HTTPD_WS_TYPE_CONTINUE;
+    return true;
+}
 
-        for (size_t i = 0; i < message_size; ++i)
+void WSLightServer::receive_direct_payload(ws_connection_t &conn)
+{
+    uint64_t remaining = conn.sink_length - conn.sink_received;
+    size_t wanted = std::min<uint64_t>(remaining, conn.rx_deficit);
+    uint8_t *dest = conn.sink_dest + conn.sink_received;
+    int len = recv(conn.sock, dest, wanted, 0);
+    if (len < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
         {
-            frame.push_back(message[i] ^ mask_key[i % 4]);
+            conn.rx_deficit = 0;
+            return;
         }
+        ESP_LOGE("WSLightServer", "recv failed: errno %d", errno);
+        cleanup_client_connection(conn);
+        return;
     }
-    else
+    if (len == 0)
     {
-
-        frame.insert(frame.end(), message.begin(), message.end());
+        ESP_LOGI("WSLightServer", "Client %d closed connection", conn.sock);
+        cleanup_client_connection(conn);
+        return;
     }
 
-    return frame;
+    conn.rx_deficit = static_cast<size_t>(len) < wanted ? 0 : conn.rx_deficit - len;
+    conn.rx_last_activity_us = esp_timer_get_time();
+    capture(conn, WS_CAPTURE_DATA, dest, len);
+    unmask_data(conn, conn.sink_type, dest, dest, len, conn.sink_mask, conn.sink_received);
+    conn.sink_received += len;
+    rx_direct_bytes += len;
+    if (conn.sink_received == conn.sink_length)
+    {
+        complete_direct_payload(conn);
+        finish_close(conn);
+    }
 }
 
-std::vector<uint8_t> WSLightServer::encode_frame(const std::string &message, ws_type_t type)
+void WSLightServer::complete_direct_payload(ws_connection_t &conn)
 {
-    std::vector<uint8_t> frame;
-    uint8_t first_byte = 0x80 | (type & 0x0F);
-    frame.push_back(first_byte);
+    ws_type_t type = conn.sink_type;
+    uint8_t *message = conn.sink_message;
+    uint8_t *dest = conn.sink_dest;
+    uint64_t length = conn.sink_length;
+    bool app = conn.sink_app;
+    conn.sink_message = nullptr;
+    conn.sink_dest = nullptr;
+    conn.sink_length = 0;
+    conn.sink_received = 0;
+    conn.sink_app = false;
+
+    if (app)
+    {
+        finish_digest(conn);
+        binary_buffer_complete(conn.sock, dest, length, ESP_OK);
+        return;
+    }
 
-    size_t message_size = message.size();
+    DecodedMessage decoded;
+    if (end_payload(conn, type, conn.sink_fin, message, length, decoded))
+    {
+        process_message(conn, decoded, type);
+    }
+}
 
-    if (message_size <= 125)
+void WSLightServer::abort_direct_payload(ws_connection_t &conn)
+{
+    if (conn.sink_message != nullptr)
     {
-        frame.push_back(static_cast<uint8_t>(message_size));
+        vPortFree(conn.sink_message);
+        memory.release(conn.sink_length);
     }
-    else if (message_size <= 65535)
+    if (conn.sink_app)
     {
-        frame.push_back(126);
-        frame.push_back((message_size >> 8) & 0xFF);
-        frame.push_back(message_size & 0xFF);
+        binary_buffer_complete(conn.sock, conn.sink_dest, conn.sink_received, ESP_FAIL);
     }
-    else
+    conn.discard_remaining = conn.sink_length - conn.sink_received;
+    conn.sink_message = nullptr;
+    conn.sink_dest = nullptr;
+    conn.sink_length = 0;
+    conn.sink_received = 0;
+    conn.sink_app = false;
+}
+
+void WSLightServer::unmask_data(ws_connection_t &conn, ws_type_t type, uint8_t *dest, const uint8_t *src, size_t len,
+                                const uint8_t *mask, uint64_t position)
+{
+    bool binary = type == HTTPD_WS_TYPE_BINARY || (type == HTTPD_WS_TYPE_CONTINUE && conn.fragment_type == HTTPD_WS_TYPE_BINARY);
+    if (config.rx_digest == WS_DIGEST_NONE || !binary)
+    {
+        unmask_payload(dest, src, len, mask, position);
+        return;
+    }
+
+    if (type == HTTPD_WS_TYPE_BINARY && position == 0)
     {
-        frame.push_back(127);
-        for (int i = 7; i >= 0; --i)
+        conn.rx_crc32 = 0;
+        conn.rx_digest_length = 0;
+        conn.rx_digest_complete = false;
+        if (conn.rx_sha256 != nullptr)
         {
-            frame.push_back((message_size >> (i * 8)) & 0xFF);
+            mbedtls_sha256_starts(conn.rx_sha256, 0);
         }
     }
-
-    bool mask = false;
-    if (mask)
+    // Checksum each block right after unmasking it rather than going over the whole payload again.
+    for (size_t done = 0; done < len; done += DIGEST_BLOCK_SIZE)
     {
-        frame[1] |= 0x80;
-        uint8_t mask_key[4];
-        for (int i = 0; i < 4; ++i)
+        size_t block = std::min(DIGEST_BLOCK_SIZE, len - done);
+        unmask_payload(dest + done, src + done, block, mask, position + done);
+        if (config.rx_digest & WS_DIGEST_CRC32)
         {
-            mask_key[i] = rand() % 256;
-            frame.push_back(mask_key[i]);
+            conn.rx_crc32 = esp_rom_crc32_le(conn.rx_crc32, dest + done, block);
         }
-
-        for (size_t i = 0; i < message_size; ++i)
+        if (conn.rx_sha256 != nullptr)
         {
-            frame.push_back(static_cast<uint8_t>(message[i]) ^ mask_key[i % 4]);
+            mbedtls_sha256_update(conn.rx_sha256, dest + done, block);
         }
     }
-    else
+    conn.rx_digest_length += len;
+}
+
+void WSLightServer::finish_digest(ws_connection_t &conn)
+{
+    if (config.rx_digest == WS_DIGEST_NONE || conn.rx_digest_complete)
+    {
+        return;
+    }
+    if (conn.rx_sha256 != nullptr)
+    {
+        mbedtls_sha256_finish(conn.rx_sha256, conn.rx_sha256_result);
+    }
+    conn.rx_digest_complete = true;
+}
+
+void WSLightServer::read_digest(ws_connection_t &conn, ws_message_digest_t &digest)
+{
+    digest = {};
+    digest.length = conn.rx_digest_length;
+    digest.crc32 = conn.rx_crc32;
+    digest.complete = conn.rx_digest_complete;
+    if (conn.rx_sha256 == nullptr)
     {
-        frame.insert(frame.end(), message.begin(), message.end());
+        return;
+    }
+    if (conn.rx_digest_complete)
+    {
+        memcpy(digest.sha256, conn.rx_sha256_result, sizeof(digest.sha256));
+        return;
     }
+    // Finish a copy so the message can go on being hashed.
+    mbedtls_sha256_context running;
+    mbedtls_sha256_init(&running);
+    mbedtls_sha256_clone(&running, conn.rx_sha256);
+    mbedtls_sha256_finish(&running, digest.sha256);
+    mbedtls_sha256_free(&running);
+}
+
+std::vector<uint8_t> WSLightServer::encode_frame(const std::vector<uint8_t> &message, ws_type_t type)
+{
+    return encode_frame(message.data(), message.size(), type, true);
+}
 
+std::vector<uint8_t> WSLightServer::encode_frame(const uint8_t *data, size_t length, ws_type_t type, bool fin)
+{
+    size_t header_len = ws_frame_header_size(length);
+    std::vector<uint8_t> frame(header_len + length);
+    ws_write_frame_header(frame.data() + header_len, length, type, fin);
+    if (length > 0)
+    {
+        memcpy(frame.data() + header_len, data, length);
+    }
     return frame;
 }
 
+std::vector<uint8_t> WSLightServer::encode_frame(const std::string &message, ws_type_t type)
+{
+    return encode_frame(reinterpret_cast<const uint8_t *>(message.data()), message.size(), type, true);
+}
+
 ws_client_info_t WSLightServer::get_client_info(const std::string &request)
 {
     std::string request_lower = request;
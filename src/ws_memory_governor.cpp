@@ -0,0 +1,65 @@
+/**
+ * @file ws_memory_governor.cpp
+ * @brief WSMemoryGovernor implementation.
+ *
+ * @author Daniel Giménez
+ * @date 2024-08-05
+ * @license MIT License
+ */
+
+#include "ws_memory_governor.h"
+
+void WSMemoryGovernor::configure(size_t budget, uint8_t shed_threshold_pct)
+{
+    taskENTER_CRITICAL(&lock);
+    budget_bytes = budget;
+    threshold_bytes = static_cast<size_t>(static_cast<uint64_t>(budget) * (shed_threshold_pct > 100 ? 100 : shed_threshold_pct) / 100);
+    used_bytes = 0;
+    peak_bytes = 0;
+    failed_reservations = 0;
+    taskEXIT_CRITICAL(&lock);
+}
+
+bool WSMemoryGovernor::reserve(size_t bytes)
+{
+    bool ok = true;
+    taskENTER_CRITICAL(&lock);
+    if (budget_bytes != 0 && used_bytes + bytes > budget_bytes)
+    {
+        failed_reservations++;
+        ok = false;
+    }
+    else
+    {
+        used_bytes += bytes;
+        if (used_bytes > peak_bytes)
+        {
+            peak_bytes = used_bytes;
+        }
+    }
+    taskEXIT_CRITICAL(&lock);
+    return ok;
+}
+
+void WSMemoryGovernor::release(size_t bytes)
+{
+    taskENTER_CRITICAL(&lock);
+    used_bytes = bytes > used_bytes ? 0 : used_bytes - bytes;
+    taskEXIT_CRITICAL(&lock);
+}
+
+bool WSMemoryGovernor::fits(size_t bytes) const
+{
+    taskENTER_CRITICAL(&lock);
+    bool ok = budget_bytes == 0 || used_bytes + bytes <= budget_bytes;
+    taskEXIT_CRITICAL(&lock);
+    return ok;
+}
+
+bool WSMemoryGovernor::underPressure() const
+{
+    taskENTER_CRITICAL(&lock);
+    bool pressure = budget_bytes != 0 && used_bytes > threshold_bytes;
+    taskEXIT_CRITICAL(&lock);
+    return pressure;
+}
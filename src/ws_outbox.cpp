@@ -0,0 +1,659 @@
+/**
+ * @file ws_outbox.cpp
+ * @brief WSOutbox and storage backends implementation.
+ *
+ * @author Daniel Giménez
+ * @date 2024-08-05
+ * @license MIT License
+ */
+
+#include "ws_outbox.h"
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <esp_rom_crc.h>
+#include <esp_timer.h>
+
+// Sector layout: a magic word, the 32-bit sequence number, a word cleared once the
+// sector is drained and a reserved word, then records. A record is a word holding the
+// type in its top byte and the payload length below, the CRC-32 of that word and the
+// payload, then the payload padded to 4 bytes. Erased flash reads as 0xFF.
+static constexpr uint32_t SECTOR_MAGIC = 0x314F5357u; // "WSO1"
+static constexpr size_t SECTOR_HEADER_SIZE = 16;
+static constexpr size_t DRAINED_OFFSET = 8;
+static constexpr size_t RECORD_HEADER_SIZE = 8;
+static constexpr uint32_t ERASED_WORD = 0xFFFFFFFFu;
+static constexpr uint32_t RECORD_LENGTH_MASK = 0x00FFFFFFu;
+static constexpr uint32_t RECORD_TYPE_SHIFT = 24;
+
+static inline size_t record_size(size_t length)
+{
+    return RECORD_HEADER_SIZE + ((length + 3) & ~static_cast<size_t>(3));
+}
+
+static inline uint32_t load_word(const uint8_t *at)
+{
+    uint32_t word;
+    memcpy(&word, at, sizeof(word));
+    return word;
+}
+
+static uint32_t record_crc(uint32_t word, const uint8_t *data, size_t length)
+{
+    uint32_t crc = esp_rom_crc32_le(0, reinterpret_cast<const uint8_t *>(&word), sizeof(word));
+    return esp_rom_crc32_le(crc, data, length);
+}
+
+/**
+ * @brief Check the record at @p at.
+ * @param at Start of the record.
+ * @param available Bytes readable from @p at.
+ * @param length Receives the payload length.
+ * @param type Receives the message type.
+ * @return false for erased space, a torn write or anything else that is not a whole record.
+ */
+static bool parse_record(const uint8_t *at, size_t available, size_t &length, ws_type_t &type)
+{
+    if (available < RECORD_HEADER_SIZE)
+    {
+        return false;
+    }
+    uint32_t word = load_word(at);
+    type = static_cast<ws_type_t>(word >> RECORD_TYPE_SHIFT);
+    length = word & RECORD_LENGTH_MASK;
+    if (word == ERASED_WORD || (type != HTTPD_WS_TYPE_TEXT && type != HTTPD_WS_TYPE_BINARY) ||
+        record_size(length) > available)
+    {
+        return false;
+    }
+    return load_word(at + 4) == record_crc(word, at + RECORD_HEADER_SIZE, length);
+}
+
+esp_err_t WSPartitionStorage::init(const char *label)
+{
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    return partition != nullptr ? ESP_OK : ESP_ERR_NOT_FOUND;
+}
+
+size_t WSPartitionStorage::size() const
+{
+    return partition != nullptr ? partition->size : 0;
+}
+
+size_t WSPartitionStorage::sector_size() const
+{
+    return partition != nullptr ? partition->erase_size : 0;
+}
+
+esp_err_t WSPartitionStorage::read(size_t offset, void *data, size_t length)
+{
+    return esp_partition_read(partition, offset, data, length);
+}
+
+esp_err_t WSPartitionStorage::write(size_t offset, const void *data, size_t length)
+{
+    return esp_partition_write(partition, offset, data, length);
+}
+
+esp_err_t WSPartitionStorage::erase(size_t offset)
+{
+    return esp_partition_erase_range(partition, offset, partition->erase_size);
+}
+
+WSFileStorage::~WSFileStorage()
+{
+    if (file != nullptr)
+    {
+        fclose(file);
+    }
+}
+
+esp_err_t WSFileStorage::init(const char *path, size_t size, size_t sector_size)
+{
+    if (path == nullptr || sector_size == 0 || size == 0 || size % sector_size != 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (file != nullptr)
+    {
+        fclose(file);
+    }
+    file = fopen(path, "r+b");
+    if (file == nullptr)
+    {
+        file = fopen(path, "w+b");
+    }
+    if (file == nullptr || fseek(file, 0, SEEK_END) != 0)
+    {
+        return ESP_FAIL;
+    }
+
+    // Bytes past the end of the file read as erased.
+    uint8_t erased[256];
+    memset(erased, 0xFF, sizeof(erased));
+    long current = ftell(file);
+    for (size_t position = current < 0 ? 0 : static_cast<size_t>(current); position < size;)
+    {
+        size_t chunk = std::min(sizeof(erased), size - position);
+        if (fwrite(erased, 1, chunk, file) != chunk)
+        {
+            return ESP_FAIL;
+        }
+        position += chunk;
+    }
+    file_size = size;
+    sector = sector_size;
+    return sync();
+}
+
+esp_err_t WSFileStorage::read(size_t offset, void *data, size_t length)
+{
+    if (file == nullptr || fseek(file, static_cast<long>(offset), SEEK_SET) != 0 || fread(data, 1, length, file) != length)
+    {
+        return ESP_FAIL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t WSFileStorage::write(size_t offset, const void *data, size_t length)
+{
+    if (file == nullptr || fseek(file, static_cast<long>(offset), SEEK_SET) != 0 || fwrite(data, 1, length, file) != length)
+    {
+        return ESP_FAIL;
+    }
+    return sync();
+}
+
+esp_err_t WSFileStorage::erase(size_t offset)
+{
+    if (file == nullptr || fseek(file, static_cast<long>(offset), SEEK_SET) != 0)
+    {
+        return ESP_FAIL;
+    }
+    uint8_t erased[256];
+    memset(erased, 0xFF, sizeof(erased));
+    for (size_t done = 0; done < sector; done += sizeof(erased))
+    {
+        size_t chunk = std::min(sizeof(erased), sector - done);
+        if (fwrite(erased, 1, chunk, file) != chunk)
+        {
+            return ESP_FAIL;
+        }
+    }
+    return sync();
+}
+
+esp_err_t WSFileStorage::sync()
+{
+    return fflush(file) == 0 && fsync(fileno(file)) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+WSOutbox::~WSOutbox()
+{
+    if (lock != nullptr)
+    {
+        flush();
+        vSemaphoreDelete(lock);
+    }
+    vPortFree(sector_buffer);
+    vPortFree(batch);
+}
+
+esp_err_t WSOutbox::init(WSOutboxStorage *storage, size_t batch_size, uint32_t flush_interval_ms)
+{
+    if (storage == nullptr)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    size_t sector = storage->sector_size();
+    if (sector < 64 || sector % 4 != 0 || storage->size() / sector < 2 ||
+        (batch_size != 0 && batch_size < RECORD_HEADER_SIZE))
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (lock == nullptr)
+    {
+        lock = xSemaphoreCreateMutex();
+        if (lock == nullptr)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    vPortFree(sector_buffer);
+    vPortFree(batch);
+    this->storage = nullptr;
+    batch_capacity = std::min(batch_size, sector - SECTOR_HEADER_SIZE);
+    sector_buffer = static_cast<uint8_t *>(pvPortMalloc(sector));
+    batch = batch_capacity > 0 ? static_cast<uint8_t *>(pvPortMalloc(batch_capacity)) : nullptr;
+    esp_err_t err = ESP_ERR_NO_MEM;
+    if (sector_buffer != nullptr && (batch != nullptr || batch_capacity == 0))
+    {
+        this->storage = storage;
+        sector_size = sector;
+        sector_count = storage->size() / sector;
+        batch_len = 0;
+        flush_interval_us = static_cast<int64_t>(flush_interval_ms) * 1000;
+        counters = {};
+        err = mount();
+        if (err != ESP_OK)
+        {
+            this->storage = nullptr;
+        }
+    }
+    xSemaphoreGive(lock);
+    return err;
+}
+
+esp_err_t WSOutbox::mount()
+{
+    bool found = false;
+    uint32_t newest = 0;
+    for (size_t sector = 0; sector < sector_count; ++sector)
+    {
+        uint8_t header[SECTOR_HEADER_SIZE];
+        esp_err_t err = storage->read(sector * sector_size, header, sizeof(header));
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+        if (load_word(header) == SECTOR_MAGIC && (!found || load_word(header + 4) > newest))
+        {
+            found = true;
+            newest = load_word(header + 4);
+            write_sector = sector;
+        }
+    }
+
+    gathered = 0;
+    skipped = 0;
+    if (!found)
+    {
+        // Blank storage: the first append opens sector 0.
+        sequence = 0;
+        write_sector = sector_count - 1;
+        write_offset = sector_size;
+        write_drained = true;
+        read_sector = gather_sector = write_sector;
+        read_offset = gather_offset = write_offset;
+        return ESP_OK;
+    }
+
+    // Appends resume after the last whole record of the newest sector.
+    sequence = newest;
+    esp_err_t err = storage->read(write_sector * sector_size, sector_buffer, sector_size);
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+    write_drained = load_word(sector_buffer + DRAINED_OFFSET) != ERASED_WORD;
+    write_offset = SECTOR_HEADER_SIZE;
+    while (!write_drained && write_offset + RECORD_HEADER_SIZE <= sector_size)
+    {
+        size_t length;
+        ws_type_t type;
+        if (load_word(sector_buffer + write_offset) == ERASED_WORD)
+        {
+            break;
+        }
+        if (!parse_record(sector_buffer + write_offset, sector_size - write_offset, length, type))
+        {
+            // A torn write: never program over it, the next append opens a new sector.
+            write_offset = sector_size;
+            break;
+        }
+        write_offset += record_size(length);
+    }
+    if (write_drained)
+    {
+        write_offset = sector_size;
+    }
+
+    // Unsent records start at the oldest undrained sector in the run that ends at the newest one.
+    read_sector = write_sector;
+    read_offset = write_drained ? write_offset : SECTOR_HEADER_SIZE;
+    for (size_t steps = 1; !write_drained && steps < sector_count; ++steps)
+    {
+        size_t previous = (read_sector + sector_count - 1) % sector_count;
+        uint8_t header[SECTOR_HEADER_SIZE];
+        err = storage->read(previous * sector_size, header, sizeof(header));
+        if (err != ESP_OK)
+        {
+            return err;
+        }
+        if (load_word(header) != SECTOR_MAGIC || load_word(header + 4) != newest - steps ||
+            load_word(header + DRAINED_OFFSET) != ERASED_WORD)
+        {
+            break;
+        }
+        read_sector = previous;
+    }
+    gather_sector = read_sector;
+    gather_offset = read_offset;
+    return ESP_OK;
+}
+
+esp_err_t WSOutbox::write_storage(size_t offset, const void *data, size_t length)
+{
+    counters.writes++;
+    return storage->write(offset, data, length);
+}
+
+esp_err_t WSOutbox::flush_batch()
+{
+    if (batch_len == 0)
+    {
+        return ESP_OK;
+    }
+    esp_err_t err = write_storage(write_sector * sector_size + batch_start, batch, batch_len);
+    batch_len = 0;
+    if (err != ESP_OK)
+    {
+        // Part of the batch may be programmed; the rest of the sector is left alone.
+        write_offset = sector_size;
+    }
+    return err;
+}
+
+esp_err_t WSOutbox::open_sector()
+{
+    size_t next = (write_sector + 1) % sector_count;
+    if (next == read_sector)
+    {
+        return ESP_ERR_NO_MEM;
+    }
+    bool was_empty = read_sector == write_sector && read_offset >= write_offset;
+
+    counters.erases++;
+    esp_err_t err = storage->erase(next * sector_size);
+    uint32_t header[2] = {SECTOR_MAGIC, sequence + 1};
+    if (err == ESP_OK)
+    {
+        err = write_storage(next * sector_size, header, sizeof(header));
+    }
+    if (err != ESP_OK)
+    {
+        return err;
+    }
+
+    sequence++;
+    write_sector = next;
+    write_offset = SECTOR_HEADER_SIZE;
+    write_drained = false;
+    if (was_empty)
+    {
+        read_sector = gather_sector = next;
+        read_offset = gather_offset = SECTOR_HEADER_SIZE;
+    }
+    return ESP_OK;
+}
+
+void WSOutbox::mark_drained(size_t sector)
+{
+    uint32_t drained = 0;
+    write_storage(sector * sector_size + DRAINED_OFFSET, &drained, sizeof(drained));
+}
+
+size_t WSOutbox::sector_end(size_t sector) const
+{
+    return sector == write_sector ? write_offset : sector_size;
+}
+
+void WSOutbox::skip_finished(size_t &sector, size_t &offset)
+{
+    while (sector != write_sector && offset >= sector_end(sector))
+    {
+        sector = (sector + 1) % sector_count;
+        offset = SECTOR_HEADER_SIZE;
+    }
+}
+
+esp_err_t WSOutbox::append(const uint8_t *data, size_t length, ws_type_t type)
+{
+    if (type != HTTPD_WS_TYPE_TEXT && type != HTTPD_WS_TYPE_BINARY)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (lock == nullptr)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (storage == nullptr)
+    {
+        xSemaphoreGive(lock);
+        return ESP_ERR_INVALID_STATE;
+    }
+    size_t record = record_size(length);
+    esp_err_t err = ESP_OK;
+    if (length > RECORD_LENGTH_MASK || record > sector_size - SECTOR_HEADER_SIZE)
+    {
+        err = ESP_ERR_INVALID_SIZE;
+    }
+    else if (write_drained || write_offset + record > sector_size)
+    {
+        err = flush_batch();
+        if (err == ESP_OK)
+        {
+            err = open_sector();
+        }
+    }
+    else if (batch_len > 0 && batch_len + record > batch_capacity)
+    {
+        err = flush_batch();
+    }
+    if (err != ESP_OK)
+    {
+        counters.rejected++;
+        xSemaphoreGive(lock);
+        return err;
+    }
+
+    uint32_t word = static_cast<uint32_t>(length) | (static_cast<uint32_t>(type) << RECORD_TYPE_SHIFT);
+    uint32_t header[2] = {word, record_crc(word, data, length)};
+    if (record <= batch_capacity)
+    {
+        if (batch_len == 0)
+        {
+            batch_start = write_offset;
+            batch_started_us = esp_timer_get_time();
+        }
+        uint8_t *at = batch + batch_len;
+        memcpy(at, header, sizeof(header));
+        memcpy(at + RECORD_HEADER_SIZE, data, length);
+        memset(at + RECORD_HEADER_SIZE + length, 0xFF, record - RECORD_HEADER_SIZE - length);
+        batch_len += record;
+        if (esp_timer_get_time() - batch_started_us >= flush_interval_us)
+        {
+            err = flush_batch();
+        }
+    }
+    else
+    {
+        // Larger than the batch: built in the sector buffer and written on its own.
+        memcpy(sector_buffer, header, sizeof(header));
+        memcpy(sector_buffer + RECORD_HEADER_SIZE, data, length);
+        memset(sector_buffer + RECORD_HEADER_SIZE + length, 0xFF, record - RECORD_HEADER_SIZE - length);
+        err = write_storage(write_sector * sector_size + write_offset, sector_buffer, record);
+        if (err != ESP_OK)
+        {
+            write_offset = sector_size;
+        }
+    }
+    if (err == ESP_OK)
+    {
+        write_offset += record;
+        counters.appended++;
+    }
+    else
+    {
+        counters.rejected++;
+    }
+    xSemaphoreGive(lock);
+    return err;
+}
+
+esp_err_t WSOutbox::flush()
+{
+    if (lock == nullptr)
+    {
+        return ESP_ERR_INVALID_STATE;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    esp_err_t err = storage != nullptr ? flush_batch() : ESP_OK;
+    xSemaphoreGive(lock);
+    return err;
+}
+
+int64_t WSOutbox::flush_deadline() const
+{
+    if (lock == nullptr)
+    {
+        return 0;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    int64_t deadline = batch_len > 0 ? batch_started_us + flush_interval_us : 0;
+    xSemaphoreGive(lock);
+    return deadline;
+}
+
+size_t WSOutbox::gather(const std::function<esp_err_t(const uint8_t *, size_t, ws_type_t)> &deliver)
+{
+    if (lock == nullptr)
+    {
+        return 0;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (storage == nullptr)
+    {
+        xSemaphoreGive(lock);
+        return 0;
+    }
+    flush_batch();
+    skip_finished(gather_sector, gather_offset);
+
+    // One read covers the rest of the sector, or what has been written of it.
+    size_t count = 0;
+    size_t start = gather_offset;
+    size_t end = sector_end(gather_sector);
+    if (start < end && storage->read(gather_sector * sector_size + start, sector_buffer, end - start) == ESP_OK)
+    {
+        size_t offset = start;
+        while (offset < end)
+        {
+            size_t length;
+            ws_type_t type;
+            if (!parse_record(sector_buffer + offset - start, end - offset, length, type))
+            {
+                // Nothing whole follows in this sector.
+                if (gather_sector == write_sector)
+                {
+                    write_offset = sector_size;
+                }
+                offset = sector_size;
+                break;
+            }
+            esp_err_t err = deliver(sector_buffer + offset - start + RECORD_HEADER_SIZE, length, type);
+            if (err == ESP_ERR_INVALID_SIZE)
+            {
+                // Retrying would stop every record behind it.
+                skipped++;
+            }
+            else if (err != ESP_OK)
+            {
+                break;
+            }
+            else
+            {
+                count++;
+            }
+            offset += record_size(length);
+        }
+        gather_offset = offset;
+    }
+    gathered += count;
+    xSemaphoreGive(lock);
+    return count;
+}
+
+void WSOutbox::release()
+{
+    if (lock == nullptr)
+    {
+        return;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    if (storage == nullptr)
+    {
+        xSemaphoreGive(lock);
+        return;
+    }
+    skip_finished(gather_sector, gather_offset);
+    while (read_sector != gather_sector)
+    {
+        mark_drained(read_sector);
+        read_sector = (read_sector + 1) % sector_count;
+    }
+    read_offset = gather_offset;
+    counters.drained += gathered;
+    counters.dropped += skipped;
+    gathered = 0;
+    skipped = 0;
+
+    if (read_sector == write_sector && read_offset >= write_offset && write_offset > SECTOR_HEADER_SIZE && !write_drained)
+    {
+        // Empty: close the sector so a reset does not send its records again.
+        mark_drained(write_sector);
+        write_drained = true;
+        write_offset = sector_size;
+        read_offset = gather_offset = sector_size;
+    }
+    xSemaphoreGive(lock);
+}
+
+void WSOutbox::rewind()
+{
+    if (lock == nullptr)
+    {
+        return;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    gather_sector = read_sector;
+    gather_offset = read_offset;
+    gathered = 0;
+    skipped = 0;
+    xSemaphoreGive(lock);
+}
+
+bool WSOutbox::empty() const
+{
+    if (lock == nullptr)
+    {
+        return true;
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    size_t sector = read_sector;
+    size_t offset = read_offset;
+    while (storage != nullptr && sector != write_sector && offset >= sector_end(sector))
+    {
+        sector = (sector + 1) % sector_count;
+        offset = SECTOR_HEADER_SIZE;
+    }
+    bool result = storage == nullptr || (sector == write_sector && offset >= write_offset);
+    xSemaphoreGive(lock);
+    return result;
+}
+
+ws_outbox_stats_t WSOutbox::stats() const
+{
+    if (lock == nullptr)
+    {
+        return {};
+    }
+    xSemaphoreTake(lock, portMAX_DELAY);
+    ws_outbox_stats_t snapshot = counters;
+    xSemaphoreGive(lock);
+    return snapshot;
+}
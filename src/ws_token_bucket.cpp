@@ -0,0 +1,81 @@
+/**
+ * @file ws_token_bucket.cpp
+ * @brief WSTokenBucket implementation.
+ *
+ * @author Daniel Giménez
+ * @date 2024-08-05
+ * @license MIT License
+ */
+
+#include "ws_token_bucket.h"
+#include <esp_timer.h>
+
+static constexpr uint64_t MICRO = 1000000ULL;
+
+void WSTokenBucket::configure(uint32_t rate_per_sec, uint32_t burst)
+{
+    rate = rate_per_sec;
+    this->burst = burst != 0 ? burst : rate_per_sec;
+    reset();
+}
+
+void WSTokenBucket::reset()
+{
+    micro_tokens = static_cast<uint64_t>(burst) * MICRO;
+    last_refill_us = esp_timer_get_time();
+}
+
+void WSTokenBucket::refill()
+{
+    int64_t now = esp_timer_get_time();
+    uint64_t elapsed_us = static_cast<uint64_t>(now - last_refill_us);
+    last_refill_us = now;
+
+    uint64_t capacity = static_cast<uint64_t>(burst) * MICRO;
+    micro_tokens += elapsed_us * rate;
+    if (micro_tokens > capacity)
+    {
+        micro_tokens = capacity;
+    }
+}
+
+bool WSTokenBucket::tryConsume(uint32_t count)
+{
+    if (!enabled())
+    {
+        return true;
+    }
+    if (count > burst)
+    {
+        count = burst;
+    }
+
+    refill();
+    uint64_t needed = static_cast<uint64_t>(count) * MICRO;
+    if (micro_tokens < needed)
+    {
+        return false;
+    }
+    micro_tokens -= needed;
+    return true;
+}
+
+uint64_t WSTokenBucket::waitTimeUs(uint32_t count)
+{
+    if (!enabled())
+    {
+        return 0;
+    }
+    if (count > burst)
+    {
+        count = burst;
+    }
+
+    refill();
+    uint64_t needed = static_cast<uint64_t>(count) * MICRO;
+    if (micro_tokens >= needed)
+    {
+        return 0;
+    }
+    return (needed - micro_tokens + rate - 1) / rate;
+}
@@ -0,0 +1,221 @@
+/**
+ * @file ws_tx_ring.cpp
+ * @brief WSTxRing implementation.
+ *
+ * @author Daniel Giménez
+ * @date 2024-08-05
+ * @license MIT License
+ */
+
+#include "ws_tx_ring.h"
+#include <string.h>
+#include "ws_frame.h"
+#include <freertos/FreeRTOS.h>
+
+// Record layout: a 32-bit state word, the 32-bit record size, 12 bytes where the
+// frame header is encoded right-aligned, then the payload. Records are 4-byte aligned.
+static constexpr size_t RECORD_HEADER_SIZE = 20;
+static constexpr uint32_t WORD_COMMITTED = 0x80000000u;
+static constexpr uint32_t WORD_PADDING = 0x40000000u;
+static constexpr uint32_t WORD_TYPE_SHIFT = 24;
+static constexpr uint32_t WORD_LENGTH_MASK = 0x00FFFFFFu;
+
+static constexpr uint32_t STATE_WRITERS = 0x7FFFu;
+static constexpr uint32_t STATE_OPEN = 0x8000u;
+
+/**
+ * @brief Load the state word of a record; it is shared with producer tasks.
+ */
+static inline uint32_t load_word(const uint8_t *record)
+{
+    return __atomic_load_n(reinterpret_cast<const uint32_t *>(record), __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Publish the state word of a record after everything it describes.
+ */
+static inline void store_word(uint8_t *record, uint32_t word)
+{
+    __atomic_store_n(reinterpret_cast<uint32_t *>(record), word, __ATOMIC_RELEASE);
+}
+
+WSTxRing::~WSTxRing()
+{
+    vPortFree(buffer);
+}
+
+esp_err_t WSTxRing::init(size_t capacity)
+{
+    if (capacity < 64 || (capacity & (capacity - 1)) != 0)
+    {
+        return ESP_ERR_INVALID_ARG;
+    }
+    vPortFree(buffer);
+    buffer = static_cast<uint8_t *>(pvPortMalloc(capacity));
+    if (buffer == nullptr)
+    {
+        this->capacity = 0;
+        return ESP_ERR_NO_MEM;
+    }
+    memset(buffer, 0, capacity);
+    this->capacity = capacity;
+    head.store(0);
+    tail.store(0);
+    state.store(0);
+    return ESP_OK;
+}
+
+bool WSTxRing::open(uint16_t generation)
+{
+    if (buffer == nullptr || (state.load(std::memory_order_acquire) & STATE_WRITERS) != 0)
+    {
+        return false;
+    }
+    // Closed with no writers: nobody can register until the new state is published.
+    memset(buffer, 0, capacity);
+    head.store(0, std::memory_order_relaxed);
+    tail.store(0, std::memory_order_relaxed);
+    state.store((static_cast<uint32_t>(generation) << 16) | STATE_OPEN, std::memory_order_release);
+    return true;
+}
+
+void WSTxRing::close()
+{
+    state.fetch_and(~STATE_OPEN, std::memory_order_acq_rel);
+}
+
+uint32_t WSTxRing::writers() const
+{
+    return state.load(std::memory_order_acquire) & STATE_WRITERS;
+}
+
+esp_err_t WSTxRing::reserve(uint16_t generation, size_t length, uint8_t **data)
+{
+    uint32_t current = state.load(std::memory_order_acquire);
+    do
+    {
+        if ((current & STATE_OPEN) == 0 || (current >> 16) != generation)
+        {
+            return ESP_ERR_NOT_FOUND;
+        }
+        if ((current & STATE_WRITERS) == STATE_WRITERS)
+        {
+            return ESP_ERR_NO_MEM;
+        }
+    } while (!state.compare_exchange_weak(current, current + 1, std::memory_order_acq_rel, std::memory_order_acquire));
+
+    size_t record = (RECORD_HEADER_SIZE + length + 3) & ~static_cast<size_t>(3);
+    if (length > WORD_LENGTH_MASK || record > capacity)
+    {
+        state.fetch_sub(1, std::memory_order_release);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    size_t position = head.load(std::memory_order_relaxed);
+    size_t padding;
+    do
+    {
+        size_t index = position & (capacity - 1);
+        padding = capacity - index < record ? capacity - index : 0;
+        if (position + padding + record - tail.load(std::memory_order_acquire) > capacity)
+        {
+            state.fetch_sub(1, std::memory_order_release);
+            return ESP_ERR_NO_MEM;
+        }
+    } while (!head.compare_exchange_weak(position, position + padding + record, std::memory_order_acq_rel, std::memory_order_relaxed));
+
+    if (padding > 0)
+    {
+        store_word(buffer + (position & (capacity - 1)), WORD_PADDING | static_cast<uint32_t>(padding));
+        position += padding;
+    }
+    uint8_t *start = buffer + (position & (capacity - 1));
+    uint32_t record_size = static_cast<uint32_t>(record);
+    memcpy(start + 4, &record_size, sizeof(record_size));
+    *data = start + RECORD_HEADER_SIZE;
+    return ESP_OK;
+}
+
+void WSTxRing::commit(uint8_t *data, size_t length, ws_type_t type)
+{
+    store_word(data - RECORD_HEADER_SIZE, WORD_COMMITTED | (static_cast<uint32_t>(type & 0x0F) << WORD_TYPE_SHIFT) |
+                                              static_cast<uint32_t>(length));
+    state.fetch_sub(1, std::memory_order_release);
+}
+
+void WSTxRing::cancel(uint8_t *data)
+{
+    uint32_t record_size;
+    memcpy(&record_size, data - RECORD_HEADER_SIZE + 4, sizeof(record_size));
+    store_word(data - RECORD_HEADER_SIZE, WORD_PADDING | record_size);
+    state.fetch_sub(1, std::memory_order_release);
+}
+
+bool WSTxRing::ready() const
+{
+    size_t position = tail.load(std::memory_order_relaxed);
+    size_t end = head.load(std::memory_order_acquire);
+    while (buffer != nullptr && position != end)
+    {
+        uint32_t word = load_word(buffer + (position & (capacity - 1)));
+        if ((word & WORD_PADDING) == 0)
+        {
+            return word != 0;
+        }
+        position += word & WORD_LENGTH_MASK;
+    }
+    return false;
+}
+
+size_t WSTxRing::gather(const uint8_t **frames, size_t *lengths, size_t max)
+{
+    size_t count = 0;
+    size_t position = tail.load(std::memory_order_relaxed);
+    size_t end = head.load(std::memory_order_acquire);
+    while (count < max && position != end)
+    {
+        uint8_t *start = buffer + (position & (capacity - 1));
+        uint32_t word = load_word(start);
+        if (word == 0)
+        {
+            break;
+        }
+        if (word & WORD_PADDING)
+        {
+            position += word & WORD_LENGTH_MASK;
+            continue;
+        }
+
+        size_t payload = word & WORD_LENGTH_MASK;
+        ws_type_t type = static_cast<ws_type_t>((word >> WORD_TYPE_SHIFT) & 0x0F);
+        size_t header_len = ws_write_frame_header(start + RECORD_HEADER_SIZE, payload, type);
+        uint8_t *out = start + RECORD_HEADER_SIZE - header_len;
+        frames[count] = out;
+        lengths[count] = header_len + payload;
+        count++;
+
+        uint32_t record_size;
+        memcpy(&record_size, start + 4, sizeof(record_size));
+        position += record_size;
+    }
+    return count;
+}
+
+void WSTxRing::release(size_t frames)
+{
+    size_t position = tail.load(std::memory_order_relaxed);
+    while (frames > 0)
+    {
+        uint8_t *start = buffer + (position & (capacity - 1));
+        uint32_t word = load_word(start);
+        uint32_t record_size = word & WORD_LENGTH_MASK;
+        if ((word & WORD_PADDING) == 0)
+        {
+            memcpy(&record_size, start + 4, sizeof(record_size));
+            frames--;
+        }
+        memset(start, 0, record_size);
+        position += record_size;
+    }
+    tail.store(position, std::memory_order_release);
+}
@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+"""
+@file netem_proxy.py
+@brief TCP proxy that makes a perfect LAN look like a poor Wi-Fi link.
+
+Sit it between a load client and a host build of WSLightServer:
+
+    python3 tools/netem_proxy.py --listen 127.0.0.1:9000 --target 127.0.0.1:8080 \
+        --latency-ms 40 --jitter-ms 30 --bandwidth 200000 --chunk 1..64 --reset-prob 0.0005
+
+Each direction is shaped on its own. Bytes are cut into chunks of random size,
+every chunk is held back by latency plus jitter (order is kept, so jitter shows
+up as bursts the way it does on a real link) and paced to the bandwidth cap.
+With --reset-prob every chunk may abort the connection with a TCP reset.
+At most --max-in-flight bytes wait in the proxy per direction; beyond that it
+stops reading, so a sender faster than the shaped link is held back by TCP flow
+control instead of growing the proxy's memory.
+"""
+
+import argparse
+import asyncio
+import random
+import socket
+import struct
+import time
+
+
+def parse_address(text):
+    host, _, port = text.rpartition(":")
+    return host or "127.0.0.1", int(port)
+
+
+def parse_range(text):
+    low, _, high = text.partition("..")
+    return int(low), int(high or low)
+
+
+class Link:
+    """Shaping parameters shared by every connection."""
+
+    def __init__(self, args):
+        self.latency = args.latency_ms / 1000.0
+        self.jitter = args.jitter_ms / 1000.0
+        self.bandwidth = args.bandwidth
+        self.chunk_min, self.chunk_max = parse_range(args.chunk)
+        self.reset_prob = args.reset_prob
+        self.max_in_flight = args.max_in_flight
+        self.random = random.Random(args.seed)
+
+    def delay(self):
+        return max(0.0, self.latency + self.random.uniform(-self.jitter, self.jitter))
+
+    def chunk_size(self):
+        return self.random.randint(self.chunk_min, self.chunk_max)
+
+    def reset(self):
+        return self.reset_prob > 0 and self.random.random() < self.reset_prob
+
+
+def abort_with_reset(writer):
+    """Close the socket with SO_LINGER 0 so the peer sees a reset rather than a FIN."""
+    sock = writer.get_extra_info("socket")
+    if sock is not None:
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack("ii", 1, 0))
+    writer.transport.abort()
+
+
+async def pipe(link, name, reader, writer, peer_writer, stats):
+    queue = asyncio.Queue()
+    room = asyncio.Condition()
+    in_flight = 0
+    writing = True
+    ready_at = 0.0
+
+    async def deliver():
+        nonlocal in_flight, writing
+        try:
+            while True:
+                due, data = await queue.get()
+                if data is None:
+                    break
+                wait = due - time.monotonic()
+                if wait > 0:
+                    await asyncio.sleep(wait)
+                writer.write(data)
+                await writer.drain()
+                stats[name] += len(data)
+                async with room:
+                    in_flight -= len(data)
+                    room.notify()
+            if writer.can_write_eof():
+                writer.write_eof()
+        finally:
+            async with room:
+                writing = False
+                room.notify()
+
+    sender = asyncio.ensure_future(deliver())
+    try:
+        while True:
+            data = await reader.read(4096)
+            if not data:
+                break
+            while data:
+                size = link.chunk_size()
+                chunk, data = data[:size], data[size:]
+                if link.reset():
+                    stats["resets"] += 1
+                    abort_with_reset(writer)
+                    abort_with_reset(peer_writer)
+                    return
+                # Stop reading while the link is full; a failed writer ends the wait too.
+                async with room:
+                    await room.wait_for(lambda: in_flight < link.max_in_flight or not writing)
+                    in_flight += len(chunk)
+                if not writing:
+                    await sender
+                    return
+                # Keep the order: a chunk never overtakes the one before it.
+                now = time.monotonic()
+                ready_at = max(ready_at, now + link.delay())
+                if link.bandwidth > 0:
+                    ready_at = max(ready_at, now) + len(chunk) / link.bandwidth
+                queue.put_nowait((ready_at, chunk))
+        queue.put_nowait((0.0, None))
+        await sender
+    except (ConnectionError, OSError):
+        pass
+    finally:
+        sender.cancel()
+
+
+async def handle(link, target, client_reader, client_writer):
+    peer = client_writer.get_extra_info("peername")
+    try:
+        server_reader, server_writer = await asyncio.open_connection(*target)
+    except OSError as err:
+        print("%s: cannot reach %s:%d: %s" % (peer, target[0], target[1], err))
+        client_writer.close()
+        return
+
+    stats = {"up": 0, "down": 0, "resets": 0}
+    started = time.monotonic()
+    await asyncio.gather(
+        pipe(link, "up", client_reader, server_writer, client_writer, stats),
+        pipe(link, "down", server_reader, client_writer, server_writer, stats),
+    )
+    for writer in (client_writer, server_writer):
+        writer.close()
+    print("%s: %.1f s, %d bytes up, %d bytes down%s" % (
+        peer, time.monotonic() - started, stats["up"], stats["down"], ", reset" if stats["resets"] else ""))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0].split("@brief ")[-1])
+    parser.add_argument("--listen", default="127.0.0.1:9000", help="address the load client connects to")
+    parser.add_argument("--target", default="127.0.0.1:8080", help="address of the server under test")
+    parser.add_argument("--latency-ms", type=float, default=0.0, help="one-way delay added to every chunk")
+    parser.add_argument("--jitter-ms", type=float, default=0.0, help="uniform +/- variation of the delay")
+    parser.add_argument("--bandwidth", type=float, default=0.0, help="bytes per second per direction, 0 for unlimited")
+    parser.add_argument("--chunk", default="4096", help="bytes per write, N or MIN..MAX to fragment reads")
+    parser.add_argument("--reset-prob", type=float, default=0.0, help="chance per chunk of a TCP reset")
+    parser.add_argument("--max-in-flight", type=int, default=256 * 1024,
+                        help="bytes queued per direction before the proxy stops reading")
+    parser.add_argument("--seed", type=int, default=None, help="seed for repeatable runs")
+    args = parser.parse_args()
+
+    link = Link(args)
+    listen = parse_address(args.listen)
+    target = parse_address(args.target)
+
+    async def serve():
+        server = await asyncio.start_server(lambda r, w: handle(link, target, r, w), *listen)
+        print("Shaping %s:%d -> %s:%d" % (listen[0], listen[1], target[0], target[1]))
+        async with server:
+            await server.serve_forever()
+
+    try:
+        asyncio.run(serve())
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
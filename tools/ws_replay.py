@@ -0,0 +1,228 @@
+#!/usr/bin/env python3
+"""
+@file ws_replay.py
+@brief Replays a WSCaptureRing capture against a host build of WSLightServer.
+
+    python3 tools/ws_replay.py capture.bin --target 127.0.0.1:8080 --speed 10
+
+The capture is WS_CAPTURE_MAGIC followed by the bytes drained from the ring.
+Every captured connection gets its own socket and handshake, then its inbound
+bytes are written again, still masked as the client sent them, at the recorded
+offsets divided by --speed (0 sends as fast as possible). Reads are kept in the
+same pieces, so a capture of a fragmented link replays as fragmented.
+
+Latency is measured from the last byte of each complete data message to the
+next data message the server sends back on that connection, which assumes an
+echoing server such as examples/echo_server.cpp. Messages without a reply are
+counted but not timed.
+"""
+
+import argparse
+import asyncio
+import base64
+import os
+import struct
+import time
+
+MAGIC = b"WSCAP1\n"
+RECORD = struct.Struct("<IHBBH")
+KIND_OPEN, KIND_DATA, KIND_CLOSE = 1, 2, 3
+
+
+def parse_address(text):
+    host, _, port = text.rpartition(":")
+    return host or "127.0.0.1", int(port)
+
+
+def load_sessions(path):
+    """Split a capture into sessions of (seconds, bytes) with a 64-bit clock."""
+    with open(path, "rb") as f:
+        data = f.read()
+    if not data.startswith(MAGIC):
+        raise SystemExit("%s: not a capture file" % path)
+
+    sessions, open_by_slot = [], {}
+    offset, last, epoch = len(MAGIC), 0, 0
+    while offset + RECORD.size <= len(data):
+        time_us, conn, kind, _, length = RECORD.unpack_from(data, offset)
+        payload = data[offset + RECORD.size:offset + RECORD.size + length]
+        offset += RECORD.size + length
+        if len(payload) < length:
+            break
+        if time_us < last:
+            epoch += 1 << 32
+        last = time_us
+        when = (epoch + time_us) / 1e6
+
+        if kind == KIND_OPEN:
+            session = {"slot": conn, "start": when, "chunks": []}
+            open_by_slot[conn] = session
+            sessions.append(session)
+        elif kind == KIND_DATA and conn in open_by_slot:
+            open_by_slot[conn]["chunks"].append((when, payload))
+        elif kind == KIND_CLOSE:
+            open_by_slot.pop(conn, None)
+    return sessions
+
+
+class FrameScanner:
+    """Tracks frame boundaries of the client stream to find where messages end."""
+
+    def __init__(self):
+        self.pending = b""
+        self.remaining = 0
+        self.message_end = False
+
+    def feed(self, data):
+        """Return how many data messages complete inside @p data."""
+        completed = 0
+        while data:
+            if self.remaining:
+                take = min(self.remaining, len(data))
+                self.remaining -= take
+                data = data[take:]
+                if self.remaining == 0 and self.message_end:
+                    completed += 1
+                continue
+            self.pending += data
+            data = b""
+            header = self.header_length(self.pending)
+            if header is None or len(self.pending) < header:
+                continue
+            first, second = self.pending[0], self.pending[1]
+            length = second & 0x7F
+            if length == 126:
+                length = struct.unpack_from(">H", self.pending, 2)[0]
+            elif length == 127:
+                length = struct.unpack_from(">Q", self.pending, 2)[0]
+            opcode = first & 0x0F
+            self.message_end = bool(first & 0x80) and opcode < 0x8
+            data, self.pending = self.pending[header:], b""
+            self.remaining = length
+            if length == 0 and self.message_end:
+                completed += 1
+        return completed
+
+    @staticmethod
+    def header_length(buf):
+        if len(buf) < 2:
+            return None
+        length = buf[1] & 0x7F
+        extra = 2 if length == 126 else 8 if length == 127 else 0
+        return 2 + extra + (4 if buf[1] & 0x80 else 0)
+
+
+async def read_frames(reader, on_message):
+    """Count data messages sent by the server until the connection closes."""
+    while True:
+        head = await reader.readexactly(2)
+        length = head[1] & 0x7F
+        if length == 126:
+            length = struct.unpack(">H", await reader.readexactly(2))[0]
+        elif length == 127:
+            length = struct.unpack(">Q", await reader.readexactly(8))[0]
+        await reader.readexactly(length)
+        opcode = head[0] & 0x0F
+        if opcode == 0x8:
+            return
+        if head[0] & 0x80 and opcode < 0x8:
+            on_message()
+
+
+async def replay(session, args, origin, results):
+    host, port = args.target
+    try:
+        reader, writer = await asyncio.open_connection(host, port)
+    except OSError as err:
+        results["failed"] += 1
+        print("slot %d: cannot connect: %s" % (session["slot"], err))
+        return
+
+    key = base64.b64encode(os.urandom(16)).decode()
+    request = "GET %s HTTP/1.1\r\nHost: %s:%d\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n" \
+              "Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n" % (args.path, host, port, key)
+    for header in args.header:
+        request += header + "\r\n"
+    writer.write((request + "\r\n").encode())
+    response = await reader.readuntil(b"\r\n\r\n")
+    if b" 101 " not in response.split(b"\r\n", 1)[0]:
+        results["failed"] += 1
+        print("slot %d: handshake refused: %s" % (session["slot"], response.split(b"\r\n", 1)[0].decode()))
+        writer.close()
+        return
+
+    sent = []
+
+    def on_message():
+        if sent:
+            results["latencies"].append(time.monotonic() - sent.pop(0))
+
+    receiver = asyncio.ensure_future(read_frames(reader, on_message))
+    scanner = FrameScanner()
+    try:
+        for when, data in session["chunks"]:
+            if args.speed > 0:
+                wait = origin + when / args.speed - time.monotonic()
+                if wait > 0:
+                    await asyncio.sleep(wait)
+            writer.write(data)
+            await writer.drain()
+            now = time.monotonic()
+            for _ in range(scanner.feed(data)):
+                sent.append(now)
+                results["messages"] += 1
+            results["bytes"] += len(data)
+        await asyncio.wait_for(receiver, args.drain)
+    except (asyncio.TimeoutError, asyncio.IncompleteReadError, ConnectionError, OSError):
+        pass
+    finally:
+        receiver.cancel()
+        writer.close()
+
+
+def percentile(values, fraction):
+    if not values:
+        return 0.0
+    index = min(len(values) - 1, int(round(fraction * (len(values) - 1))))
+    return values[index]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n\n")[0].split("@brief ")[-1])
+    parser.add_argument("capture", help="file holding WS_CAPTURE_MAGIC and the ring contents")
+    parser.add_argument("--target", default="127.0.0.1:8080", help="address of the server under test")
+    parser.add_argument("--path", default="/", help="request path of the handshake")
+    parser.add_argument("--header", action="append", default=[], help="extra handshake header, repeatable")
+    parser.add_argument("--speed", type=float, default=1.0, help="time scale, 2 replays twice as fast, 0 without pauses")
+    parser.add_argument("--drain", type=float, default=2.0, help="seconds to wait for replies after the last write")
+    args = parser.parse_args()
+    args.target = parse_address(args.target)
+
+    sessions = load_sessions(args.capture)
+    if not sessions:
+        raise SystemExit("%s: no sessions" % args.capture)
+    base = min(s["start"] for s in sessions)
+    for s in sessions:
+        s["chunks"] = [(when - base, data) for when, data in s["chunks"]]
+
+    results = {"messages": 0, "bytes": 0, "failed": 0, "latencies": []}
+
+    async def run():
+        origin = time.monotonic()
+        await asyncio.gather(*(replay(s, args, origin, results) for s in sessions))
+
+    started = time.monotonic()
+    asyncio.run(run())
+    elapsed = time.monotonic() - started
+
+    latencies = sorted(results["latencies"])
+    print("%d sessions (%d failed), %d messages, %d bytes in %.2f s" % (
+        len(sessions), results["failed"], results["messages"], results["bytes"], elapsed))
+    if latencies:
+        print("latency over %d replies: p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, max %.3f ms" % (
+            len(latencies), percentile(latencies, 0.50) * 1e3, percentile(latencies, 0.95) * 1e3,
+            percentile(latencies, 0.99) * 1e3, latencies[-1] * 1e3))
+
+
+if __name__ == "__main__":
+    main()